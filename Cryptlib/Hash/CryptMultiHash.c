@@ -0,0 +1,255 @@
+/** @file
+  Fused SHA-1/SHA-256 Digest Wrapper Implementation over OpenSSL.
+
+  Authenticode hashing needs both the SHA-1 and the SHA-256 digest of the
+  same byte ranges.  Feeding the whole range to one algorithm and then to
+  the other drags every byte of a large image through the cache twice.
+  This wrapper walks the input once, in strides that fit comfortably in L1,
+  and lets every enabled algorithm consume a stride before moving on.
+
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#include "InternalCryptLib.h"
+#include <openssl/sha.h>
+
+///
+/// Number of bytes handed to each algorithm before switching to the next one.
+/// Must be a multiple of the 64 byte SHA-1/SHA-256 block size, and small
+/// enough that a stride is still resident in L1 when the second algorithm
+/// reads it.
+///
+#define MULTI_HASH_STRIDE   (64 * 64)
+
+typedef struct {
+  UINT32      HashMask;
+  SHA_CTX     Sha1;
+  SHA256_CTX  Sha256;
+} MULTI_HASH_CTX;
+
+/**
+  Retrieves the size, in bytes, of the context buffer required for fused
+  SHA-1/SHA-256 hash operations.
+
+  @return  The size, in bytes, of the context buffer required for fused hash operations.
+
+**/
+UINTN
+EFIAPI
+MultiHashGetContextSize (
+  VOID
+  )
+{
+  return (UINTN) (sizeof (MULTI_HASH_CTX));
+}
+
+/**
+  Initializes user-supplied memory pointed by MultiHashContext as a fused hash
+  context for subsequent use.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashMask does not select at least one supported algorithm, then return FALSE.
+
+  @param[out]  MultiHashContext  Pointer to fused hash context being initialized.
+  @param[in]   HashMask          Bitmask of MULTI_HASH_SHA1 and MULTI_HASH_SHA256
+                                 selecting the digests to compute.
+
+  @retval TRUE   Fused hash context initialization succeeded.
+  @retval FALSE  Fused hash context initialization failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashInit (
+  OUT  VOID    *MultiHashContext,
+  IN   UINT32  HashMask
+  )
+{
+  MULTI_HASH_CTX  *Ctx;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL) {
+    return FALSE;
+  }
+  if ((HashMask & (MULTI_HASH_SHA1 | MULTI_HASH_SHA256)) == 0 ||
+      (HashMask & ~(MULTI_HASH_SHA1 | MULTI_HASH_SHA256)) != 0) {
+    return FALSE;
+  }
+
+  Ctx = (MULTI_HASH_CTX *) MultiHashContext;
+  ZeroMem (Ctx, sizeof (*Ctx));
+  Ctx->HashMask = HashMask;
+
+  if ((HashMask & MULTI_HASH_SHA1) != 0 && !SHA1_Init (&Ctx->Sha1)) {
+    return FALSE;
+  }
+  if ((HashMask & MULTI_HASH_SHA256) != 0 && !SHA256_Init (&Ctx->Sha256)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+  Makes a copy of an existing fused hash context.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If NewMultiHashContext is NULL, then return FALSE.
+
+  @param[in]  MultiHashContext     Pointer to fused hash context being copied.
+  @param[out] NewMultiHashContext  Pointer to new fused hash context.
+
+  @retval TRUE   Fused hash context copy succeeded.
+  @retval FALSE  Fused hash context copy failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashDuplicate (
+  IN   CONST VOID  *MultiHashContext,
+  OUT  VOID        *NewMultiHashContext
+  )
+{
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL || NewMultiHashContext == NULL) {
+    return FALSE;
+  }
+
+  CopyMem (NewMultiHashContext, MultiHashContext, sizeof (MULTI_HASH_CTX));
+
+  return TRUE;
+}
+
+/**
+  Digests the input data and updates every algorithm in the fused hash context.
+
+  The data is consumed in MULTI_HASH_STRIDE sized pieces; each piece is run
+  through all enabled algorithms before the next piece is touched, so the
+  input only has to be fetched from memory once.
+  It can be called multiple times to compute the digest of long or discontinuous
+  data streams.  The fused hash context should be already correctly initialized
+  by MultiHashInit(), and should not be finalized by MultiHashFinal().  Behavior
+  with invalid context is undefined.
+
+  If MultiHashContext is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the fused hash context.
+  @param[in]       Data              Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize          Size of Data buffer in bytes.
+
+  @retval TRUE   Fused hash data digest succeeded.
+  @retval FALSE  Fused hash data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashUpdate (
+  IN OUT  VOID        *MultiHashContext,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  )
+{
+  MULTI_HASH_CTX  *Ctx;
+  CONST UINT8     *Buffer;
+  UINTN           Length;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL) {
+    return FALSE;
+  }
+
+  //
+  // Check invalid parameters, in case that only DataLength was checked in OpenSSL
+  //
+  if (Data == NULL && DataSize != 0) {
+    return FALSE;
+  }
+
+  Ctx    = (MULTI_HASH_CTX *) MultiHashContext;
+  Buffer = (CONST UINT8 *) Data;
+
+  while (DataSize > 0) {
+    Length = DataSize > MULTI_HASH_STRIDE ? MULTI_HASH_STRIDE : DataSize;
+
+    if ((Ctx->HashMask & MULTI_HASH_SHA256) != 0 &&
+        !SHA256_Update (&Ctx->Sha256, Buffer, Length)) {
+      return FALSE;
+    }
+    if ((Ctx->HashMask & MULTI_HASH_SHA1) != 0 &&
+        !SHA1_Update (&Ctx->Sha1, Buffer, Length)) {
+      return FALSE;
+    }
+
+    Buffer   += Length;
+    DataSize -= Length;
+  }
+
+  return TRUE;
+}
+
+/**
+  Completes computation of the fused digest values.
+
+  This function completes every enabled hash computation and retrieves the digest
+  values into the specified memory.  After this function has been called, the fused
+  hash context cannot be used again.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If a digest buffer is NULL for an algorithm that was enabled in MultiHashInit(),
+  then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the fused hash context.
+  @param[out]      Sha1HashValue     Pointer to a buffer that receives the SHA-1 digest
+                                     value (20 bytes).  Ignored if SHA-1 is not enabled.
+  @param[out]      Sha256HashValue   Pointer to a buffer that receives the SHA-256 digest
+                                     value (32 bytes).  Ignored if SHA-256 is not enabled.
+
+  @retval TRUE   Fused digest computation succeeded.
+  @retval FALSE  Fused digest computation failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashFinal (
+  IN OUT  VOID   *MultiHashContext,
+  OUT     UINT8  *Sha1HashValue,   OPTIONAL
+  OUT     UINT8  *Sha256HashValue  OPTIONAL
+  )
+{
+  MULTI_HASH_CTX  *Ctx;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL) {
+    return FALSE;
+  }
+
+  Ctx = (MULTI_HASH_CTX *) MultiHashContext;
+
+  if ((Ctx->HashMask & MULTI_HASH_SHA1) != 0) {
+    if (Sha1HashValue == NULL || !SHA1_Final (Sha1HashValue, &Ctx->Sha1)) {
+      return FALSE;
+    }
+  }
+  if ((Ctx->HashMask & MULTI_HASH_SHA256) != 0) {
+    if (Sha256HashValue == NULL || !SHA256_Final (Sha256HashValue, &Ctx->Sha256)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
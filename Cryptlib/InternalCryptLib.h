@@ -30,5 +30,17 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #define OBJ_length(o) ((o)->length)
 #endif
 
+/**
+  Registers the digest algorithms needed for PKCS#7 handling.
+
+  @retval  TRUE   The digests were registered.
+  @retval  FALSE  Registration failed.
+
+**/
+BOOLEAN
+Pkcs7AddDigests (
+  VOID
+  );
+
 #endif
 
@@ -52,6 +52,12 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 ///
 #define SHA512_DIGEST_SIZE  64
 
+///
+/// Algorithm selectors for the fused SHA-1/SHA-256 hash (MultiHashInit).
+///
+#define MULTI_HASH_SHA1     0x00000001
+#define MULTI_HASH_SHA256   0x00000002
+
 ///
 /// TDES block size in bytes
 ///
@@ -893,6 +899,116 @@ Sha512HashAll (
   OUT  UINT8       *HashValue
   );
 
+/**
+  Retrieves the size, in bytes, of the context buffer required for fused
+  SHA-1/SHA-256 hash operations.
+
+  @return  The size, in bytes, of the context buffer required for fused hash operations.
+
+**/
+UINTN
+EFIAPI
+MultiHashGetContextSize (
+  VOID
+  );
+
+/**
+  Initializes user-supplied memory pointed by MultiHashContext as a fused hash
+  context for subsequent use.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashMask does not select at least one supported algorithm, then return FALSE.
+
+  @param[out]  MultiHashContext  Pointer to fused hash context being initialized.
+  @param[in]   HashMask          Bitmask of MULTI_HASH_SHA1 and MULTI_HASH_SHA256
+                                 selecting the digests to compute.
+
+  @retval TRUE   Fused hash context initialization succeeded.
+  @retval FALSE  Fused hash context initialization failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashInit (
+  OUT  VOID    *MultiHashContext,
+  IN   UINT32  HashMask
+  );
+
+/**
+  Makes a copy of an existing fused hash context.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If NewMultiHashContext is NULL, then return FALSE.
+
+  @param[in]  MultiHashContext     Pointer to fused hash context being copied.
+  @param[out] NewMultiHashContext  Pointer to new fused hash context.
+
+  @retval TRUE   Fused hash context copy succeeded.
+  @retval FALSE  Fused hash context copy failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashDuplicate (
+  IN   CONST VOID  *MultiHashContext,
+  OUT  VOID        *NewMultiHashContext
+  );
+
+/**
+  Digests the input data and updates every algorithm in the fused hash context.
+
+  The input is walked once; each cache-sized piece is consumed by all enabled
+  algorithms before the next piece is read.
+  It can be called multiple times to compute the digest of long or discontinuous
+  data streams.  The fused hash context should be already correctly initialized
+  by MultiHashInit(), and should not be finalized by MultiHashFinal().  Behavior
+  with invalid context is undefined.
+
+  If MultiHashContext is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the fused hash context.
+  @param[in]       Data              Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize          Size of Data buffer in bytes.
+
+  @retval TRUE   Fused hash data digest succeeded.
+  @retval FALSE  Fused hash data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashUpdate (
+  IN OUT  VOID        *MultiHashContext,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  );
+
+/**
+  Completes computation of the fused digest values.
+
+  After this function has been called, the fused hash context cannot be used again.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If a digest buffer is NULL for an algorithm that was enabled in MultiHashInit(),
+  then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the fused hash context.
+  @param[out]      Sha1HashValue     Pointer to a buffer that receives the SHA-1 digest
+                                     value (20 bytes).  Ignored if SHA-1 is not enabled.
+  @param[out]      Sha256HashValue   Pointer to a buffer that receives the SHA-256 digest
+                                     value (32 bytes).  Ignored if SHA-256 is not enabled.
+
+  @retval TRUE   Fused digest computation succeeded.
+  @retval FALSE  Fused digest computation failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashFinal (
+  IN OUT  VOID   *MultiHashContext,
+  OUT     UINT8  *Sha1HashValue,   OPTIONAL
+  OUT     UINT8  *Sha256HashValue  OPTIONAL
+  );
+
 //=====================================================================================
 //    MAC (Message Authentication Code) Primitive
 //=====================================================================================
@@ -2403,6 +2519,69 @@ Pkcs7Verify (
   IN  UINTN        DataLength
   );
 
+/**
+  Creates a certificate store holding one trusted certificate, configured the
+  way Pkcs7Verify() uses it, so that it can be reused for any number of
+  verifications against that certificate.
+
+  If TrustedCert is NULL, then return NULL.
+  If CertLength overflow, then return NULL.
+
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @return  Pointer to the new certificate store, or NULL on failure.  Release it
+           with Pkcs7CertStoreFree().
+
+**/
+VOID *
+EFIAPI
+Pkcs7CertStoreNew (
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  );
+
+/**
+  Releases a certificate store created by Pkcs7CertStoreNew().
+
+  @param[in]  CertStore  Pointer to the certificate store to free.  May be NULL.
+
+**/
+VOID
+EFIAPI
+Pkcs7CertStoreFree (
+  IN  VOID  *CertStore
+  );
+
+/**
+  Verifies the validity of a PKCS#7 signed data against a certificate store
+  created by Pkcs7CertStoreNew().  The input signed data could be wrapped in a
+  ContentInfo structure.
+
+  If P7Data, CertStore or InData is NULL, then return FALSE.
+  If P7Length or DataLength overflow, then return FALSE.
+
+  @param[in]  P7Data       Pointer to the PKCS#7 message to verify.
+  @param[in]  P7Length     Length of the PKCS#7 message in bytes.
+  @param[in]  CertStore    Certificate store holding the trusted certificate.
+  @param[in]  InData       Pointer to the content to be verified.
+  @param[in]  DataLength   Length of InData in bytes.
+
+  @retval  TRUE  The specified PKCS#7 signed data is valid.
+  @retval  FALSE Invalid PKCS#7 signed data.
+
+**/
+BOOLEAN
+EFIAPI
+Pkcs7VerifyWithStore (
+  IN  CONST UINT8  *P7Data,
+  IN  UINTN        P7Length,
+  IN  VOID         *CertStore,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength
+  );
+
 /**
   Extracts the attached content from a PKCS#7 signed data if existed. The input signed
   data could be wrapped in a ContentInfo structure.
@@ -2467,6 +2646,87 @@ AuthenticodeVerify (
   IN  UINTN        HashSize
   );
 
+/**
+  Decodes a PE/COFF Authenticode Signature once, so that it can be verified
+  against any number of certificate stores with AuthenticodeVerifyParsed().
+
+  If AuthData is NULL, then return NULL.
+
+  Caution: This function may receive untrusted input.
+  PE/COFF Authenticode is external input, so this function will do basic check for
+  Authenticode data structure.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+
+  @return  Pointer to the Authenticode signature handle, or NULL on failure.
+           Release it with AuthenticodeFree().
+
+**/
+VOID *
+EFIAPI
+AuthenticodeParse (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize
+  );
+
+/**
+  Verifies an Authenticode signature decoded by AuthenticodeParse() against the
+  image hash and a certificate store created by Pkcs7CertStoreNew().
+
+  If Handle is NULL, then return FALSE.
+  If CertStore is NULL, then return FALSE.
+  If ImageHash is NULL, then return FALSE.
+
+  @param[in]  Handle       Authenticode signature handle from AuthenticodeParse().
+  @param[in]  CertStore    Certificate store holding the trusted certificate.
+  @param[in]  ImageHash    Pointer to the original image file hash value.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerifyParsed (
+  IN  VOID         *Handle,
+  IN  VOID         *CertStore,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  );
+
+/**
+  Retrieves the certificates carried in an Authenticode signature decoded by
+  AuthenticodeParse().
+
+  If Handle is NULL, then return NULL.
+
+  @param[in]  Handle  Authenticode signature handle from AuthenticodeParse().
+
+  @return  The signature's STACK_OF(X509), or NULL if it carries none.  It
+           belongs to the handle and goes away with AuthenticodeFree().
+
+**/
+VOID *
+EFIAPI
+AuthenticodeGetCertificates (
+  IN  VOID  *Handle
+  );
+
+/**
+  Releases an Authenticode signature handle created by AuthenticodeParse().
+
+  @param[in]  Handle  Pointer to the Authenticode signature handle.  May be NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeFree (
+  IN  VOID  *Handle
+  );
+
 /**
   Verifies the validity of a RFC3161 Timestamp CounterSignature embedded in PE/COFF Authenticode
   signature.
@@ -6,8 +6,8 @@
   This external input must be validated carefully to avoid security issue like
   buffer overflow, integer overflow.
 
-  AuthenticodeVerify() will get PE/COFF Authenticode and will do basic check for
-  data structure.
+  AuthenticodeVerify() and AuthenticodeParse() will get PE/COFF Authenticode and
+  will do basic check for data structure.
 
 Copyright (c) 2011 - 2015, Intel Corporation. All rights reserved.<BR>
 This program and the accompanying materials
@@ -33,12 +33,54 @@ UINT8 mSpcIndirectOidValue[] = {
   0x2B, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x04
   };
 
+///
+/// A decoded Authenticode signature, as returned by AuthenticodeParse().  The
+/// signed content is kept as a read-only memory BIO over the PKCS#7 structure,
+/// so verifying it against another certificate store needs no further parsing
+/// or copying.
+///
+typedef struct {
+  PKCS7           *Pkcs7;
+  STACK_OF(X509)  *Signers;
+  CONST UINT8     *Content;
+  UINTN           ContentSize;
+  BIO             *ContentBio;
+} AUTHENTICODE_CONTEXT;
+
 /**
-  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
-  Authenticode Portable Executable Signature Format".
+  Releases an Authenticode signature handle created by AuthenticodeParse().
 
-  If AuthData is NULL, then return FALSE.
-  If ImageHash is NULL, then return FALSE.
+  @param[in]  Handle  Pointer to the Authenticode signature handle.  May be NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeFree (
+  IN  VOID  *Handle
+  )
+{
+  AUTHENTICODE_CONTEXT  *Context;
+
+  if (Handle == NULL) {
+    return;
+  }
+
+  Context = (AUTHENTICODE_CONTEXT *) Handle;
+  BIO_free (Context->ContentBio);
+  sk_X509_free (Context->Signers);
+  PKCS7_free (Context->Pkcs7);
+  FreePool (Context);
+}
+
+/**
+  Decodes a PE/COFF Authenticode Signature as described in "Windows Authenticode
+  Portable Executable Signature Format", for use with AuthenticodeVerifyParsed().
+
+  The PKCS#7 structure is decoded, the SpcIndirectDataContent holding the image
+  digest is located and the signer certificates are looked up once, so that the
+  signature can then be checked against any number of trust anchors.
+
+  If AuthData is NULL, then return NULL.
 
   Caution: This function may receive untrusted input.
   PE/COFF Authenticode is external input, so this function will do basic check for
@@ -47,67 +89,59 @@ UINT8 mSpcIndirectOidValue[] = {
   @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
                            PE/COFF image to be verified.
   @param[in]  DataSize     Size of the Authenticode Signature in bytes.
-  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
-                           is used for certificate chain verification.
-  @param[in]  CertSize     Size of the trusted certificate in bytes.
-  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
-                           for calculating the image hash value is described in Authenticode
-                           specification.
-  @param[in]  HashSize     Size of Image hash value in bytes.
 
-  @retval  TRUE   The specified Authenticode Signature is valid.
-  @retval  FALSE  Invalid Authenticode Signature.
+  @return  Pointer to the Authenticode signature handle, or NULL if the signature
+           is malformed or resources are exhausted.  Release it with
+           AuthenticodeFree().
 
 **/
-BOOLEAN
+VOID *
 EFIAPI
-AuthenticodeVerify (
+AuthenticodeParse (
   IN  CONST UINT8  *AuthData,
-  IN  UINTN        DataSize,
-  IN  CONST UINT8  *TrustedCert,
-  IN  UINTN        CertSize,
-  IN  CONST UINT8  *ImageHash,
-  IN  UINTN        HashSize
+  IN  UINTN        DataSize
   )
 {
-  BOOLEAN      Status;
-  PKCS7        *Pkcs7;
-  CONST UINT8  *Temp;
-  CONST UINT8  *OrigAuthData;
-  UINT8        *SpcIndirectDataContent;
-  UINT8        Asn1Byte;
-  UINTN        ContentSize;
-  CONST UINT8  *SpcIndirectDataOid;
+  AUTHENTICODE_CONTEXT  *Context;
+  CONST UINT8           *Temp;
+  UINT8                 *SpcIndirectDataContent;
+  UINT8                 Asn1Byte;
+  UINTN                 ContentSize;
+  UINTN                 HeaderSize;
+  UINTN                 Length;
+  CONST UINT8           *SpcIndirectDataOid;
+  ASN1_TYPE             *Other;
 
   //
   // Check input parameters.
   //
-  if ((AuthData == NULL) || (TrustedCert == NULL) || (ImageHash == NULL)) {
-    return FALSE;
+  if (AuthData == NULL || DataSize > INT_MAX) {
+    return NULL;
   }
 
-  if ((DataSize > INT_MAX) || (CertSize > INT_MAX) || (HashSize > INT_MAX)) {
-    return FALSE;
+  if (!Pkcs7AddDigests ()) {
+    return NULL;
   }
 
-  Status       = FALSE;
-  Pkcs7        = NULL;
-  OrigAuthData = AuthData;
+  Context = AllocateZeroPool (sizeof (AUTHENTICODE_CONTEXT));
+  if (Context == NULL) {
+    return NULL;
+  }
 
   //
   // Retrieve & Parse PKCS#7 Data (DER encoding) from Authenticode Signature
   //
-  Temp  = AuthData;
-  Pkcs7 = d2i_PKCS7 (NULL, &Temp, (int)DataSize);
-  if (Pkcs7 == NULL) {
-    goto _Exit;
+  Temp           = AuthData;
+  Context->Pkcs7 = d2i_PKCS7 (NULL, &Temp, (int)DataSize);
+  if (Context->Pkcs7 == NULL) {
+    goto _Error;
   }
 
   //
   // Check if it's PKCS#7 Signed Data (for Authenticode Scenario)
   //
-  if (!PKCS7_type_is_signed (Pkcs7)) {
-    goto _Exit;
+  if (!PKCS7_type_is_signed (Context->Pkcs7)) {
+    goto _Error;
   }
 
   //
@@ -115,8 +149,8 @@ AuthenticodeVerify (
   //       some authenticode-specific structure. Use opaque ASN.1 string to retrieve
   //       PKCS#7 ContentInfo here.
   //
-  SpcIndirectDataOid = OBJ_get0_data(Pkcs7->d.sign->contents->type);
-  if (OBJ_length(Pkcs7->d.sign->contents->type) != sizeof(mSpcIndirectOidValue) ||
+  SpcIndirectDataOid = OBJ_get0_data(Context->Pkcs7->d.sign->contents->type);
+  if (OBJ_length(Context->Pkcs7->d.sign->contents->type) != sizeof(mSpcIndirectOidValue) ||
       CompareMem (
         SpcIndirectDataOid,
         mSpcIndirectOidValue,
@@ -125,11 +159,17 @@ AuthenticodeVerify (
     //
     // Un-matched SPC_INDIRECT_DATA_OBJID.
     //
-    goto _Exit;
+    goto _Error;
   }
 
+  Other = Context->Pkcs7->d.sign->contents->d.other;
+  if (Other == NULL || Other->value.asn1_string == NULL ||
+      Other->value.asn1_string->length < 2) {
+    goto _Error;
+  }
 
-  SpcIndirectDataContent = (UINT8 *)(Pkcs7->d.sign->contents->d.other->value.asn1_string->data);
+  SpcIndirectDataContent = (UINT8 *)(Other->value.asn1_string->data);
+  Length                 = (UINTN) Other->value.asn1_string->length;
 
   //
   // Retrieve the SEQUENCE data size from ASN.1-encoded SpcIndirectDataContent.
@@ -141,58 +181,223 @@ AuthenticodeVerify (
     // Short Form of Length Encoding (Length < 128)
     //
     ContentSize = (UINTN) (Asn1Byte & 0x7F);
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 2;
+    HeaderSize  = 2;
 
-  } else if ((Asn1Byte & 0x81) == 0x81) {
+  } else if ((Asn1Byte & 0x81) == 0x81 && Length >= 3) {
     //
     // Long Form of Length Encoding (128 <= Length < 255, Single Octet)
     //
     ContentSize = (UINTN) (*(UINT8 *)(SpcIndirectDataContent + 2));
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 3;
+    HeaderSize  = 3;
 
-  } else if ((Asn1Byte & 0x82) == 0x82) {
+  } else if ((Asn1Byte & 0x82) == 0x82 && Length >= 4) {
     //
     // Long Form of Length Encoding (Length > 255, Two Octet)
     //
     ContentSize = (UINTN) (*(UINT8 *)(SpcIndirectDataContent + 2));
     ContentSize = (ContentSize << 8) + (UINTN)(*(UINT8 *)(SpcIndirectDataContent + 3));
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 4;
+    HeaderSize  = 4;
 
   } else {
-    goto _Exit;
+    goto _Error;
+  }
+
+  //
+  // Skip the SEQUENCE Tag, and make sure the content fits in the string.
+  //
+  if (ContentSize > Length - HeaderSize) {
+    goto _Error;
   }
+  Context->Content     = SpcIndirectDataContent + HeaderSize;
+  Context->ContentSize = ContentSize;
+
+  //
+  // Look the signer certificates up once; every later verification uses
+  // exactly these.
+  //
+  Context->Signers = PKCS7_get0_signers (Context->Pkcs7, NULL, 0);
+  if (Context->Signers == NULL) {
+    goto _Error;
+  }
+
+  Context->ContentBio = BIO_new_mem_buf ((VOID *) Context->Content, (int) Context->ContentSize);
+  if (Context->ContentBio == NULL) {
+    goto _Error;
+  }
+
+  return Context;
+
+_Error:
+  AuthenticodeFree (Context);
+
+  return NULL;
+}
+
+/**
+  Verifies an Authenticode signature decoded by AuthenticodeParse() against the
+  image hash and a certificate store created by Pkcs7CertStoreNew().
+
+  If Handle is NULL, then return FALSE.
+  If CertStore is NULL, then return FALSE.
+  If ImageHash is NULL, then return FALSE.
+
+  @param[in]  Handle       Authenticode signature handle from AuthenticodeParse().
+  @param[in]  CertStore    Certificate store holding the trusted certificate.
+  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
+                           for calculating the image hash value is described in Authenticode
+                           specification.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerifyParsed (
+  IN  VOID         *Handle,
+  IN  VOID         *CertStore,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  )
+{
+  AUTHENTICODE_CONTEXT  *Context;
+
+  //
+  // Check input parameters.
+  //
+  if (Handle == NULL || CertStore == NULL || ImageHash == NULL) {
+    return FALSE;
+  }
+
+  Context = (AUTHENTICODE_CONTEXT *) Handle;
 
   //
   // Compare the original file hash value to the digest retrieve from SpcIndirectDataContent
   // defined in Authenticode
   // NOTE: Need to double-check HashLength here!
   //
-  if (CompareMem (SpcIndirectDataContent + ContentSize - HashSize, ImageHash, HashSize) != 0) {
+  if (HashSize > Context->ContentSize ||
+      CompareMem (Context->Content + Context->ContentSize - HashSize, ImageHash, HashSize) != 0) {
     //
     // Un-matched PE/COFF Hash Value
     //
-    goto _Exit;
+    return FALSE;
   }
 
   //
-  // Verifies the PKCS#7 Signed Data in PE/COFF Authenticode Signature
+  // Verifies the PKCS#7 Signed Data in PE/COFF Authenticode Signature.  The
+  // signers were resolved by AuthenticodeParse(), so don't look them up again.
   //
-  Status = (BOOLEAN) Pkcs7Verify (OrigAuthData, DataSize, TrustedCert, CertSize, SpcIndirectDataContent, ContentSize);
+  (VOID) BIO_reset (Context->ContentBio);
+  return (BOOLEAN) PKCS7_verify (
+                     Context->Pkcs7,
+                     Context->Signers,
+                     (X509_STORE *) CertStore,
+                     Context->ContentBio,
+                     NULL,
+                     PKCS7_BINARY | PKCS7_NOINTERN
+                     );
+}
+
+/**
+  Retrieves the certificates carried in an Authenticode signature decoded by
+  AuthenticodeParse(), so that callers can look at the chain without decoding
+  the signature again.
+
+  If Handle is NULL, then return NULL.
+
+  @param[in]  Handle  Authenticode signature handle from AuthenticodeParse().
+
+  @return  The signature's STACK_OF(X509), or NULL if it carries none.  It
+           belongs to the handle and goes away with AuthenticodeFree().
+
+**/
+VOID *
+EFIAPI
+AuthenticodeGetCertificates (
+  IN  VOID  *Handle
+  )
+{
+  AUTHENTICODE_CONTEXT  *Context;
+
+  if (Handle == NULL) {
+    return NULL;
+  }
+
+  Context = (AUTHENTICODE_CONTEXT *) Handle;
+  if (Context->Pkcs7->d.sign == NULL) {
+    return NULL;
+  }
+
+  return Context->Pkcs7->d.sign->cert;
+}
+
+/**
+  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
+  Authenticode Portable Executable Signature Format".
+
+  If AuthData is NULL, then return FALSE.
+  If ImageHash is NULL, then return FALSE.
+
+  Caution: This function may receive untrusted input.
+  PE/COFF Authenticode is external input, so this function will do basic check for
+  Authenticode data structure.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertSize     Size of the trusted certificate in bytes.
+  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
+                           for calculating the image hash value is described in Authenticode
+                           specification.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerify (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertSize,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  )
+{
+  VOID     *Handle;
+  VOID     *CertStore;
+  BOOLEAN  Status;
 
-_Exit:
   //
-  // Release Resources
+  // Check input parameters.
   //
-  PKCS7_free (Pkcs7);
+  if ((AuthData == NULL) || (TrustedCert == NULL) || (ImageHash == NULL)) {
+    return FALSE;
+  }
+
+  if ((DataSize > INT_MAX) || (CertSize > INT_MAX) || (HashSize > INT_MAX)) {
+    return FALSE;
+  }
+
+  Handle = AuthenticodeParse (AuthData, DataSize);
+  if (Handle == NULL) {
+    return FALSE;
+  }
+
+  Status    = FALSE;
+  CertStore = Pkcs7CertStoreNew (TrustedCert, CertSize);
+  if (CertStore != NULL) {
+    Status = AuthenticodeVerifyParsed (Handle, CertStore, ImageHash, HashSize);
+    Pkcs7CertStoreFree (CertStore);
+  }
+
+  AuthenticodeFree (Handle);
 
   return Status;
 }
@@ -803,12 +803,143 @@ _Error:
 }
 
 /**
-  Verifies the validity of a PKCS#7 signed data as described in "PKCS #7:
-  Cryptographic Message Syntax Standard". The input signed data could be wrapped
-  in a ContentInfo structure.
+  Registers the digest algorithms needed for PKCS#7 handling.
 
-  If P7Data, TrustedCert or InData is NULL, then return FALSE.
-  If P7Length, CertLength or DataLength overflow, then return FALSE.
+  @retval  TRUE   The digests were registered.
+  @retval  FALSE  Registration failed.
+
+**/
+BOOLEAN
+Pkcs7AddDigests (
+  VOID
+  )
+{
+  //
+  // Register & Initialize necessary digest algorithms for PKCS#7 Handling
+  //
+  if (EVP_add_digest (EVP_md5 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha1 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha256 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha384 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha512 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA) == 0) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+  Creates a certificate store holding one trusted certificate, configured the
+  way Pkcs7Verify() uses it, so that it can be reused for any number of
+  verifications against that certificate.
+
+  If TrustedCert is NULL, then return NULL.
+  If CertLength overflow, then return NULL.
+
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @return  Pointer to the new certificate store, or NULL on failure.  Release it
+           with Pkcs7CertStoreFree().
+
+**/
+VOID *
+EFIAPI
+Pkcs7CertStoreNew (
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  )
+{
+  X509        *Cert;
+  X509_STORE  *CertStore;
+  CONST UINT8 *Temp;
+
+  //
+  // Check input parameters.
+  //
+  if (TrustedCert == NULL || CertLength > INT_MAX) {
+    return NULL;
+  }
+
+  //
+  // Read DER-encoded root certificate and Construct X509 Certificate
+  //
+  Temp = TrustedCert;
+  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
+  if (Cert == NULL) {
+    return NULL;
+  }
+
+  //
+  // Setup X509 Store for trusted certificate.  The store takes its own
+  // reference on Cert.
+  //
+  CertStore = X509_STORE_new ();
+  if (CertStore == NULL) {
+    goto _Exit;
+  }
+  if (!(X509_STORE_add_cert (CertStore, Cert))) {
+    X509_STORE_free (CertStore);
+    CertStore = NULL;
+    goto _Exit;
+  }
+
+  X509_STORE_set_verify_cb (CertStore, X509VerifyCb);
+
+  //
+  // Allow partial certificate chains, terminated by a non-self-signed but
+  // still trusted intermediate certificate. Also disable time checks.
+  //
+  X509_STORE_set_flags (CertStore,
+                        X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
+
+  //
+  // OpenSSL PKCS7 Verification by default checks for SMIME (email signing) and
+  // doesn't support the extended key usage for Authenticode Code Signing.
+  // Bypass the certificate purpose checking by enabling any purposes setting.
+  //
+  X509_STORE_set_purpose (CertStore, X509_PURPOSE_ANY);
+
+_Exit:
+  X509_free (Cert);
+
+  return CertStore;
+}
+
+/**
+  Releases a certificate store created by Pkcs7CertStoreNew().
+
+  @param[in]  CertStore  Pointer to the certificate store to free.  May be NULL.
+
+**/
+VOID
+EFIAPI
+Pkcs7CertStoreFree (
+  IN  VOID  *CertStore
+  )
+{
+  X509_STORE_free ((X509_STORE *) CertStore);
+}
+
+/**
+  Verifies the validity of a PKCS#7 signed data against a certificate store
+  created by Pkcs7CertStoreNew().  The input signed data could be wrapped in a
+  ContentInfo structure.
+
+  If P7Data, CertStore or InData is NULL, then return FALSE.
+  If P7Length or DataLength overflow, then return FALSE.
 
   Caution: This function may receive untrusted input.
   UEFI Authenticated Variable is external input, so this function will do basic
@@ -816,9 +947,7 @@ _Error:
 
   @param[in]  P7Data       Pointer to the PKCS#7 message to verify.
   @param[in]  P7Length     Length of the PKCS#7 message in bytes.
-  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
-                           is used for certificate chain verification.
-  @param[in]  CertLength   Length of the trusted certificate in bytes.
+  @param[in]  CertStore    Certificate store holding the trusted certificate.
   @param[in]  InData       Pointer to the content to be verified.
   @param[in]  DataLength   Length of InData in bytes.
 
@@ -828,11 +957,10 @@ _Error:
 **/
 BOOLEAN
 EFIAPI
-Pkcs7Verify (
+Pkcs7VerifyWithStore (
   IN  CONST UINT8  *P7Data,
   IN  UINTN        P7Length,
-  IN  CONST UINT8  *TrustedCert,
-  IN  UINTN        CertLength,
+  IN  VOID         *CertStore,
   IN  CONST UINT8  *InData,
   IN  UINTN        DataLength
   )
@@ -840,8 +968,6 @@ Pkcs7Verify (
   PKCS7       *Pkcs7;
   BIO         *DataBio;
   BOOLEAN     Status;
-  X509        *Cert;
-  X509_STORE  *CertStore;
   UINT8       *SignedData;
   CONST UINT8 *Temp;
   UINTN       SignedDataSize;
@@ -850,35 +976,15 @@ Pkcs7Verify (
   //
   // Check input parameters.
   //
-  if (P7Data == NULL || TrustedCert == NULL || InData == NULL ||
-    P7Length > INT_MAX || CertLength > INT_MAX || DataLength > INT_MAX) {
+  if (P7Data == NULL || CertStore == NULL || InData == NULL ||
+    P7Length > INT_MAX || DataLength > INT_MAX) {
     return FALSE;
   }
 
   Pkcs7     = NULL;
   DataBio   = NULL;
-  Cert      = NULL;
-  CertStore = NULL;
 
-  //
-  // Register & Initialize necessary digest algorithms for PKCS#7 Handling
-  //
-  if (EVP_add_digest (EVP_md5 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha1 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha256 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha384 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha512 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA) == 0) {
+  if (!Pkcs7AddDigests ()) {
     return FALSE;
   }
 
@@ -909,28 +1015,6 @@ Pkcs7Verify (
     goto _Exit;
   }
 
-  //
-  // Read DER-encoded root certificate and Construct X509 Certificate
-  //
-  Temp = TrustedCert;
-  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
-  if (Cert == NULL) {
-    goto _Exit;
-  }
-
-  //
-  // Setup X509 Store for trusted certificate
-  //
-  CertStore = X509_STORE_new ();
-  if (CertStore == NULL) {
-    goto _Exit;
-  }
-  if (!(X509_STORE_add_cert (CertStore, Cert))) {
-    goto _Exit;
-  }
-
-  X509_STORE_set_verify_cb (CertStore, X509VerifyCb);
-
   //
   // For generic PKCS#7 handling, InData may be NULL if the content is present
   // in PKCS#7 structure. So ignore NULL checking here.
@@ -944,32 +1028,16 @@ Pkcs7Verify (
     goto _Exit;
   }
 
-  //
-  // Allow partial certificate chains, terminated by a non-self-signed but
-  // still trusted intermediate certificate. Also disable time checks.
-  //
-  X509_STORE_set_flags (CertStore,
-                        X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
-
-  //
-  // OpenSSL PKCS7 Verification by default checks for SMIME (email signing) and
-  // doesn't support the extended key usage for Authenticode Code Signing.
-  // Bypass the certificate purpose checking by enabling any purposes setting.
-  //
-  X509_STORE_set_purpose (CertStore, X509_PURPOSE_ANY);
-
   //
   // Verifies the PKCS#7 signedData structure
   //
-  Status = (BOOLEAN) PKCS7_verify (Pkcs7, NULL, CertStore, DataBio, NULL, PKCS7_BINARY);
+  Status = (BOOLEAN) PKCS7_verify (Pkcs7, NULL, (X509_STORE *) CertStore, DataBio, NULL, PKCS7_BINARY);
 
 _Exit:
   //
   // Release Resources
   //
   BIO_free (DataBio);
-  X509_free (Cert);
-  X509_STORE_free (CertStore);
   PKCS7_free (Pkcs7);
 
   if (!Wrapped) {
@@ -979,6 +1047,64 @@ _Exit:
   return Status;
 }
 
+/**
+  Verifies the validity of a PKCS#7 signed data as described in "PKCS #7:
+  Cryptographic Message Syntax Standard". The input signed data could be wrapped
+  in a ContentInfo structure.
+
+  If P7Data, TrustedCert or InData is NULL, then return FALSE.
+  If P7Length, CertLength or DataLength overflow, then return FALSE.
+
+  Caution: This function may receive untrusted input.
+  UEFI Authenticated Variable is external input, so this function will do basic
+  check for PKCS#7 data structure.
+
+  @param[in]  P7Data       Pointer to the PKCS#7 message to verify.
+  @param[in]  P7Length     Length of the PKCS#7 message in bytes.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+  @param[in]  InData       Pointer to the content to be verified.
+  @param[in]  DataLength   Length of InData in bytes.
+
+  @retval  TRUE  The specified PKCS#7 signed data is valid.
+  @retval  FALSE Invalid PKCS#7 signed data.
+
+**/
+BOOLEAN
+EFIAPI
+Pkcs7Verify (
+  IN  CONST UINT8  *P7Data,
+  IN  UINTN        P7Length,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength
+  )
+{
+  VOID     *CertStore;
+  BOOLEAN  Status;
+
+  //
+  // Check input parameters.
+  //
+  if (P7Data == NULL || TrustedCert == NULL || InData == NULL ||
+    P7Length > INT_MAX || CertLength > INT_MAX || DataLength > INT_MAX) {
+    return FALSE;
+  }
+
+  CertStore = Pkcs7CertStoreNew (TrustedCert, CertLength);
+  if (CertStore == NULL) {
+    return FALSE;
+  }
+
+  Status = Pkcs7VerifyWithStore (P7Data, P7Length, CertStore, InData, DataLength);
+
+  Pkcs7CertStoreFree (CertStore);
+
+  return Status;
+}
+
 /**
   Extracts the attached content from a PKCS#7 signed data if existed. The input signed
   data could be wrapped in a ContentInfo structure.
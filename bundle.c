@@ -0,0 +1,148 @@
+/*
+ * bundle.c - find binaries inside a bundle file
+ *
+ * See include/bundle.h for what a bundle is and what's in one.
+ */
+
+#include "shim.h"
+
+static EFI_STATUS bundle_read(EFI_FILE *file, UINT64 offset, VOID *buf,
+			      UINTN size)
+{
+	EFI_STATUS efi_status;
+	UINTN len;
+
+	efi_status = file->SetPosition(file, offset);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	while (size > 0) {
+		len = size;
+		efi_status = file->Read(file, &len, buf);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		if (len == 0)
+			return EFI_END_OF_FILE;
+		buf = (UINT8 *)buf + len;
+		size -= len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * The last part of a path, without the separator before it
+ */
+static CHAR16 *path_basename(CHAR16 *path)
+{
+	CHAR16 *name = path;
+
+	for (; *path; path++) {
+		if (*path == L'\\' || *path == L'/')
+			name = path + 1;
+	}
+	return name;
+}
+
+/*
+ * Look for the binary called name (only its last part counts) in the
+ * bundle at path on device.  If it's there, *file is the bundle, left
+ * open for the caller to close, and the binary is the *size bytes of it
+ * starting at *offset.  Returns EFI_NOT_FOUND, quietly, if there's no
+ * bundle or it doesn't hold the binary.
+ */
+EFI_STATUS bundle_find(EFI_HANDLE device, CHAR16 *path, CHAR16 *name,
+		       EFI_FILE **file, UINTN *offset, UINTN *size)
+{
+	EFI_STATUS efi_status;
+	EFI_FILE_IO_INTERFACE *drive;
+	EFI_FILE *root, *bundle = NULL;
+	struct bundle_header hdr;
+	struct bundle_entry *entries = NULL, *entry;
+	UINT64 filesize, indexsize;
+	UINTN i, j;
+
+	name = path_basename(name);
+	if (StrLen(name) == 0 || StrLen(name) >= BUNDLE_NAME_MAX)
+		return EFI_NOT_FOUND;
+
+	efi_status = gBS->HandleProtocol(device, &EFI_SIMPLE_FILE_SYSTEM_GUID,
+					 (void **) &drive);
+	if (EFI_ERROR(efi_status))
+		return EFI_NOT_FOUND;
+
+	efi_status = drive->OpenVolume(drive, &root);
+	if (EFI_ERROR(efi_status))
+		return EFI_NOT_FOUND;
+
+	efi_status = root->Open(root, &bundle, path, EFI_FILE_MODE_READ, 0);
+	root->Close(root);
+	if (EFI_ERROR(efi_status))
+		return EFI_NOT_FOUND;
+
+	/* Seeking to the all-ones position goes to the end of the file */
+	efi_status = bundle->SetPosition(bundle, 0xFFFFFFFFFFFFFFFFULL);
+	if (!EFI_ERROR(efi_status))
+		efi_status = bundle->GetPosition(bundle, &filesize);
+	if (EFI_ERROR(efi_status))
+		goto not_found;
+
+	efi_status = bundle_read(bundle, 0, &hdr, sizeof(hdr));
+	if (EFI_ERROR(efi_status))
+		goto invalid;
+	if (CompareMem(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != BUNDLE_VERSION || hdr.count == 0 ||
+	    hdr.count > BUNDLE_MAX_MEMBERS)
+		goto invalid;
+
+	indexsize = hdr.count * sizeof(*entries);
+	if (indexsize > filesize - sizeof(hdr))
+		goto invalid;
+	entries = AllocatePool(indexsize);
+	if (!entries) {
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto err;
+	}
+	efi_status = bundle_read(bundle, sizeof(hdr), entries, indexsize);
+	if (EFI_ERROR(efi_status))
+		goto invalid;
+
+	for (i = 0; i < hdr.count; i++) {
+		entry = &entries[i];
+
+		/* make sure the name is terminated before comparing it */
+		for (j = 0; j < BUNDLE_NAME_MAX && entry->name[j]; j++)
+			;
+		if (j == BUNDLE_NAME_MAX || StrCaseCmp(entry->name, name))
+			continue;
+
+		if (entry->size == 0 || entry->size > 0x7fffffff ||
+		    entry->offset < sizeof(hdr) + indexsize ||
+		    entry->offset > filesize ||
+		    entry->size > filesize - entry->offset) {
+			perror(L"Bundle member %s is out of bounds\n", name);
+			goto invalid;
+		}
+
+		dprint(L"Found %s in %s at 0x%lx, 0x%lx bytes\n", name, path,
+		       entry->offset, entry->size);
+		*file = bundle;
+		*offset = entry->offset;
+		*size = entry->size;
+		FreePool(entries);
+		return EFI_SUCCESS;
+	}
+	goto not_found;
+
+invalid:
+	perror(L"Ignoring invalid bundle %s\n", path);
+not_found:
+	efi_status = EFI_NOT_FOUND;
+err:
+	if (entries)
+		FreePool(entries);
+	bundle->Close(bundle);
+	return efi_status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
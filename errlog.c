@@ -5,51 +5,316 @@
 #include "shim.h"
 #include "hexdump.h"
 
-static CHAR16 **errs = NULL;
-static UINTN nerrs = 0;
+/*
+ * Errors go into a fixed ring and are only turned into text when
+ * somebody asks for it.  Most of what gets logged is the trail of
+ * "not in this database" misses on the way to a successful
+ * verification, which nobody ever reads, so a pool allocation and a
+ * format per entry was pure overhead.
+ *
+ * An entry keeps the format string and location pointers as they are -
+ * they're always literals - plus a copy of each argument.  String, GUID
+ * and time arguments are copied into the entry itself, because whatever
+ * they point at may well be gone by the time they get printed.  When
+ * the ring is full the oldest entry is dropped.
+ */
+#define ERRLOG_ENTRIES		32
+#define ERRLOG_MAX_ARGS		8
+#define ERRLOG_DATA_SIZE	128	/* in CHAR16s */
+#define ERRLOG_LINE_SIZE	256	/* in CHAR16s */
 
-EFI_STATUS
-vdprint_(const CHAR16 *fmt, const char *file, int line, const char *func, va_list args)
+typedef enum {
+	ERRLOG_ARG_U32,
+	ERRLOG_ARG_U64,
+	ERRLOG_ARG_UINTN,
+	ERRLOG_ARG_NULL,
+	ERRLOG_ARG_DATA,
+} errlog_arg_type_t;
+
+struct errlog_arg {
+	errlog_arg_type_t type;
+	UINT64 value;		/* for ERRLOG_ARG_DATA, the offset into data */
+};
+
+struct errlog_entry {
+	const char *file;
+	int line;
+	const char *func;
+	const CHAR16 *fmt;
+	UINTN nargs;
+	BOOLEAN truncated;	/* arguments past nargs weren't kept */
+	struct errlog_arg args[ERRLOG_MAX_ARGS];
+	UINTN datalen;
+	union {
+		UINT64 align;
+		CHAR16 chars[ERRLOG_DATA_SIZE];
+	} data;
+};
+
+static struct errlog_entry errlog[ERRLOG_ENTRIES];
+static UINTN errlog_first = 0;
+static UINTN errlog_count = 0;
+static UINTN errlog_dropped = 0;
+
+static BOOLEAN
+is_one_of(CHAR16 c, const CHAR16 *set)
 {
-	va_list args2;
-	EFI_STATUS efi_status = EFI_SUCCESS;
+	for (; *set; set++) {
+		if (*set == c)
+			return TRUE;
+	}
+	return FALSE;
+}
 
-	if (verbose) {
-		va_copy(args2, args);
-		console_print(L"%a:%d:%a() ", file, line, func);
-		efi_status = VPrint(fmt, args2);
-		va_end(args2);
+/*
+ * Walk one conversion of a Print() style format, starting at its '%'.
+ * Returns a pointer just past it.
+ */
+static const CHAR16 *
+parse_conversion(const CHAR16 *p, CHAR16 *type, BOOLEAN *islong,
+		 BOOLEAN *star)
+{
+	*islong = FALSE;
+	*star = FALSE;
+
+	for (p++; *p; p++) {
+		if (*p == L'*')
+			*star = TRUE;
+		else if (*p == L'l')
+			*islong = TRUE;
+		else if (!is_one_of(*p, L"-+ #0,.123456789"))
+			break;
 	}
-	return efi_status;
+	*type = *p;
+	return *p ? p + 1 : p;
+}
+
+static BOOLEAN
+keep_arg(struct errlog_entry *e, errlog_arg_type_t type, UINT64 value)
+{
+	if (e->nargs >= ERRLOG_MAX_ARGS) {
+		e->truncated = TRUE;
+		return FALSE;
+	}
+	e->args[e->nargs].type = type;
+	e->args[e->nargs].value = value;
+	e->nargs++;
+	return TRUE;
+}
+
+static BOOLEAN
+keep_string(struct errlog_entry *e, const CHAR16 *s16, const CHAR8 *s8)
+{
+	UINTN off = e->datalen, i;
+
+	if (!s16 && !s8)
+		return keep_arg(e, ERRLOG_ARG_NULL, 0);
+	if (off >= ERRLOG_DATA_SIZE)
+		off = ERRLOG_DATA_SIZE - 1;
+
+	for (i = 0; off + i < ERRLOG_DATA_SIZE - 1; i++) {
+		CHAR16 c = s16 ? s16[i] : (CHAR16)s8[i];
+
+		if (!c)
+			break;
+		e->data.chars[off + i] = c;
+	}
+	e->data.chars[off + i] = L'\0';
+	e->datalen = off + i + 1;
+	return keep_arg(e, ERRLOG_ARG_DATA, off);
+}
+
+static BOOLEAN
+keep_blob(struct errlog_entry *e, const VOID *blob, UINTN size)
+{
+	/* keep binary data 8-byte aligned within the entry */
+	UINTN off = ALIGN_VALUE(e->datalen, 4);
+
+	if (!blob)
+		return keep_arg(e, ERRLOG_ARG_NULL, 0);
+	if (off + size / sizeof(CHAR16) > ERRLOG_DATA_SIZE) {
+		e->truncated = TRUE;
+		return FALSE;
+	}
+	CopyMem(&e->data.chars[off], blob, size);
+	e->datalen = off + size / sizeof(CHAR16);
+	return keep_arg(e, ERRLOG_ARG_DATA, off);
 }
 
 EFI_STATUS
 VLogError(const char *file, int line, const char *func, const CHAR16 *fmt, va_list args)
 {
 	va_list args2;
-	CHAR16 **newerrs;
+	struct errlog_entry *e;
+	const CHAR16 *p;
+	CHAR16 type;
+	BOOLEAN islong, star, kept = TRUE;
 
-	newerrs = ReallocatePool(errs, (nerrs + 1) * sizeof(*errs),
-				       (nerrs + 3) * sizeof(*errs));
-	if (!newerrs)
-		return EFI_OUT_OF_RESOURCES;
+	if (errlog_count == ERRLOG_ENTRIES) {
+		errlog_first = (errlog_first + 1) % ERRLOG_ENTRIES;
+		errlog_count--;
+		errlog_dropped++;
+	}
+	e = &errlog[(errlog_first + errlog_count) % ERRLOG_ENTRIES];
+	errlog_count++;
+
+	e->file = file;
+	e->line = line;
+	e->func = func;
+	e->fmt = fmt;
+	e->nargs = 0;
+	e->datalen = 0;
+	e->truncated = FALSE;
 
-	newerrs[nerrs] = PoolPrint(L"%a:%d %a() ", file, line, func);
-	if (!newerrs[nerrs])
-		return EFI_OUT_OF_RESOURCES;
 	va_copy(args2, args);
-	newerrs[nerrs+1] = VPoolPrint(fmt, args2);
-	if (!newerrs[nerrs+1])
-		return EFI_OUT_OF_RESOURCES;
-	va_end(args2);
+	for (p = fmt; kept && *p; ) {
+		if (*p != L'%') {
+			p++;
+			continue;
+		}
+		p = parse_conversion(p, &type, &islong, &star);
+		if (star) {
+			/* never used by our callers; don't try */
+			e->truncated = TRUE;
+			break;
+		}
 
-	nerrs += 2;
-	newerrs[nerrs] = NULL;
-	errs = newerrs;
+		switch (type) {
+		case L'd':
+		case L'u':
+		case L'x':
+		case L'X':
+			if (islong)
+				kept = keep_arg(e, ERRLOG_ARG_U64,
+						va_arg(args2, UINT64));
+			else
+				kept = keep_arg(e, ERRLOG_ARG_U32,
+						va_arg(args2, UINT32));
+			break;
+		case L'c':
+		case L'r':
+			kept = keep_arg(e, ERRLOG_ARG_UINTN,
+					va_arg(args2, UINTN));
+			break;
+		case L'p':
+			kept = keep_arg(e, ERRLOG_ARG_UINTN,
+					(UINTN)va_arg(args2, VOID *));
+			break;
+		case L's':
+			kept = keep_string(e, va_arg(args2, CHAR16 *), NULL);
+			break;
+		case L'a':
+			kept = keep_string(e, NULL, va_arg(args2, CHAR8 *));
+			break;
+		case L'g':
+			kept = keep_blob(e, va_arg(args2, EFI_GUID *),
+					 sizeof(EFI_GUID));
+			break;
+		case L't':
+			kept = keep_blob(e, va_arg(args2, EFI_TIME *),
+					 sizeof(EFI_TIME));
+			break;
+		default:
+			/* %%, attribute changes, and the like take nothing */
+			break;
+		}
+	}
+	va_end(args2);
 
 	return EFI_SUCCESS;
 }
 
+/*
+ * Format one argument with its own conversion, cast back to the type
+ * it was passed as.
+ */
+static UINTN
+format_arg(CHAR16 *buf, UINTN size, const CHAR16 *conv,
+	   struct errlog_entry *e, struct errlog_arg *arg)
+{
+	switch (arg->type) {
+	case ERRLOG_ARG_U32:
+		return SPrint(buf, size, conv, (UINT32)arg->value);
+	case ERRLOG_ARG_U64:
+		return SPrint(buf, size, conv, arg->value);
+	case ERRLOG_ARG_UINTN:
+		return SPrint(buf, size, conv, (UINTN)arg->value);
+	case ERRLOG_ARG_NULL:
+		return SPrint(buf, size, conv, NULL);
+	case ERRLOG_ARG_DATA:
+	default:
+		return SPrint(buf, size, conv,
+			      &e->data.chars[(UINTN)arg->value]);
+	}
+}
+
+static VOID
+print_entry(struct errlog_entry *e)
+{
+	CHAR16 out[ERRLOG_LINE_SIZE];
+	CHAR16 conv[16];
+	const CHAR16 *p, *end;
+	UINTN len = 0, n = 0;
+	CHAR16 type;
+	BOOLEAN islong, star;
+
+	for (p = e->fmt; *p && len < ERRLOG_LINE_SIZE - 1; ) {
+		if (*p != L'%') {
+			out[len++] = *p++;
+			continue;
+		}
+
+		end = parse_conversion(p, &type, &islong, &star);
+		if (type == L'%') {
+			out[len++] = L'%';
+			p = end;
+			continue;
+		}
+		if (!is_one_of(type, L"duxXcrpsagt")) {
+			/* nothing to substitute */
+			p = end;
+			continue;
+		}
+		if (n >= e->nargs || end - p >= 16) {
+			len += SPrint(&out[len], (ERRLOG_LINE_SIZE - len) *
+					sizeof(CHAR16), L"...\n");
+			break;
+		}
+
+		CopyMem(conv, p, (end - p) * sizeof(CHAR16));
+		conv[end - p] = L'\0';
+		/* %a arguments were kept as CHAR16 */
+		if (type == L'a')
+			conv[end - p - 1] = L's';
+
+		len += format_arg(&out[len],
+				  (ERRLOG_LINE_SIZE - len) * sizeof(CHAR16),
+				  conv, e, &e->args[n++]);
+		p = end;
+	}
+	if (len > ERRLOG_LINE_SIZE - 1)
+		len = ERRLOG_LINE_SIZE - 1;
+	out[len] = L'\0';
+
+	console_print(L"%a:%d %a() ", e->file, e->line, e->func);
+	console_print(L"%s", out);
+}
+
+EFI_STATUS
+vdprint_(const CHAR16 *fmt, const char *file, int line, const char *func, va_list args)
+{
+	va_list args2;
+	EFI_STATUS efi_status = EFI_SUCCESS;
+
+	if (verbose) {
+		va_copy(args2, args);
+		console_print(L"%a:%d:%a() ", file, line, func);
+		efi_status = VPrint(fmt, args2);
+		va_end(args2);
+	}
+	return efi_status;
+}
+
 EFI_STATUS
 LogError_(const char *file, int line, const char *func, const CHAR16 *fmt, ...)
 {
@@ -77,20 +342,19 @@ PrintErrors(VOID)
 	if (!verbose)
 		return;
 
-	for (i = 0; i < nerrs; i++)
-		console_print(L"%s", errs[i]);
+	if (errlog_dropped)
+		console_print(L"(%lu earlier errors dropped)\n",
+			      errlog_dropped);
+	for (i = 0; i < errlog_count; i++)
+		print_entry(&errlog[(errlog_first + i) % ERRLOG_ENTRIES]);
 }
 
 VOID
 ClearErrors(VOID)
 {
-	UINTN i;
-
-	for (i = 0; i < nerrs; i++)
-		FreePool(errs[i]);
-	FreePool(errs);
-	nerrs = 0;
-	errs = NULL;
+	errlog_first = 0;
+	errlog_count = 0;
+	errlog_dropped = 0;
 }
 
 // vim:fenc=utf-8:tw=75
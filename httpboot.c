@@ -536,19 +536,228 @@ no_event:
 	return efi_status;
 }
 
+/*
+ * How much of the body is received at a time when it can't go straight
+ * to where it belongs.  Every Response() call is a round of events and
+ * polling, so the bigger the window the fewer of those a large image
+ * costs.
+ */
+#define HTTP_RX_WINDOW	(1024 * 1024)
+
+/*
+ * A body sent with "Transfer-Encoding: chunked" reaches us the way it
+ * was sent, each chunk after a line with its size in hex, and the
+ * framing has to be taken back out here.
+ */
+typedef enum {
+	CHUNK_SIZE,		/* reading a chunk's size */
+	CHUNK_EXTENSION,	/* skipping the rest of the size line */
+	CHUNK_DATA,
+	CHUNK_DATA_END,		/* the line break after a chunk's data */
+	CHUNK_TRAILER,		/* at the start of a trailer line */
+	CHUNK_TRAILER_LINE,	/* skipping a trailer line */
+	CHUNK_DONE
+} chunk_state_t;
+
+/*
+ * The body of a response as it comes in, handed to a sink a piece at a
+ * time.
+ */
+struct http_body {
+	httpboot_sink_t sink;
+	VOID *ctx;
+	UINT64 size;		/* from Content-Length, or 0 if unknown */
+	UINT64 got;
+	BOOLEAN chunked;
+	chunk_state_t chunk_state;
+	UINT64 chunk_left;	/* of this chunk, or its size so far */
+	BOOLEAN chunk_digits;	/* whether the size line had any */
+};
+
+/* Header names and the chunked coding aren't case sensitive */
+static BOOLEAN
+equal_nocase (CONST CHAR8 *a, CONST CHAR8 *b)
+{
+	CHAR8 c, d;
+
+	do {
+		c = *a++;
+		d = *b++;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (d >= 'A' && d <= 'Z')
+			d += 'a' - 'A';
+		if (c != d)
+			return FALSE;
+	} while (c);
+
+	return TRUE;
+}
+
+static INTN
+hex_value (CHAR8 c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Take the next len bytes of the body proper.
+ */
+static EFI_STATUS
+http_body_put (struct http_body *b, char *data, UINTN len)
+{
+	EFI_STATUS efi_status;
+
+	if (b->size && len > b->size - b->got) {
+		perror(L"Received more than Content-Length\n");
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	efi_status = b->sink(b->ctx, b->size, data, len);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	b->got += len;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+http_body_dechunk (struct http_body *b, char *data, UINTN len)
+{
+	EFI_STATUS efi_status;
+	UINTN n;
+	INTN v;
+	CHAR8 c;
+
+	while (len) {
+		if (b->chunk_state == CHUNK_DATA) {
+			n = min((UINT64)len, b->chunk_left);
+			efi_status = http_body_put(b, data, n);
+			if (EFI_ERROR(efi_status))
+				return efi_status;
+			data += n;
+			len -= n;
+			b->chunk_left -= n;
+			if (!b->chunk_left)
+				b->chunk_state = CHUNK_DATA_END;
+			continue;
+		}
+
+		c = *data++;
+		len--;
+		switch (b->chunk_state) {
+		case CHUNK_SIZE:
+			v = hex_value(c);
+			if (v >= 0) {
+				if (b->chunk_left >> 60)
+					goto bad;
+				b->chunk_left = (b->chunk_left << 4) | v;
+				b->chunk_digits = TRUE;
+				break;
+			}
+			if (c == ';' || c == ' ' || c == '\t') {
+				b->chunk_state = CHUNK_EXTENSION;
+				break;
+			}
+			if (c != '\r' && c != '\n')
+				goto bad;
+			/* fall through */
+		case CHUNK_EXTENSION:
+			if (c != '\n')
+				break;
+			if (!b->chunk_digits)
+				goto bad;
+			/* a chunk of size 0 is the last one */
+			b->chunk_state = b->chunk_left ? CHUNK_DATA
+						       : CHUNK_TRAILER;
+			break;
+		case CHUNK_DATA_END:
+			if (c == '\r')
+				break;
+			if (c != '\n')
+				goto bad;
+			b->chunk_state = CHUNK_SIZE;
+			b->chunk_digits = FALSE;
+			break;
+		case CHUNK_TRAILER:
+			if (c == '\r')
+				break;
+			b->chunk_state = c == '\n' ? CHUNK_DONE
+						   : CHUNK_TRAILER_LINE;
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (c == '\n')
+				b->chunk_state = CHUNK_TRAILER;
+			break;
+		default:
+			perror(L"Data after the end of a chunked HTTP body\n");
+			return EFI_PROTOCOL_ERROR;
+		}
+	}
+
+	return EFI_SUCCESS;
+
+bad:
+	perror(L"Malformed chunked HTTP body\n");
+	return EFI_PROTOCOL_ERROR;
+}
+
+static EFI_STATUS
+http_body_add (struct http_body *b, char *data, UINTN len)
+{
+	if (b->chunked)
+		return http_body_dechunk(b, data, len);
+	return http_body_put(b, data, len);
+}
+
+static BOOLEAN
+http_body_done (struct http_body *b)
+{
+	if (b->chunked)
+		return b->chunk_state == CHUNK_DONE;
+	return b->size && b->got == b->size;
+}
+
+/*
+ * Receive the body of the response, handing each piece of it to sink as
+ * it comes in.  Where place says a piece has somewhere to go, it's
+ * received right there; otherwise, and always when there's chunking to
+ * undo, it comes in through a large window.  *received is set to how
+ * much of the body there was.
+ *
+ * Without a Content-Length, a chunked body ends with its last chunk, and
+ * any other when the server closes the connection.  The sink is then
+ * told the body's size is 0.
+ */
 static EFI_STATUS
-receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
+receive_http_response(EFI_HTTP_PROTOCOL *http, httpboot_sink_t sink,
+		      httpboot_place_t place, VOID *ctx, UINT64 *received)
 {
 	EFI_HTTP_TOKEN rx_token;
 	EFI_HTTP_MESSAGE rx_message;
 	EFI_HTTP_RESPONSE_DATA response;
 	EFI_HTTP_STATUS_CODE http_status;
 	BOOLEAN response_done;
-	UINTN i, downloaded;
+	BOOLEAN have_length = FALSE;
+	struct http_body body;
+	UINTN i;
 	CHAR8 rx_buffer[9216];
+	CHAR8 *window = NULL;
+	UINTN window_size = 0;
+	UINTN len;
 	EFI_STATUS efi_status;
 	EFI_STATUS event_status;
 
+	ZeroMem(&body, sizeof(body));
+	body.sink = sink;
+	body.ctx = ctx;
+
 	/* Initialize the rx message and buffer */
 	response.StatusCode = HTTP_STATUS_UNSUPPORTED_STATUS;
 	rx_message.Data.Response = &response;
@@ -596,38 +805,77 @@ receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
 		goto error;
 	}
 
-	/* Check the length of the file */
+	/* Find out how the body is being sent */
 	for (i = 0; i < rx_message.HeaderCount; i++) {
-		if (!strcmpa(rx_message.Headers[i].FieldName, (CHAR8 *)"Content-Length")) {
-			*buf_size = ascii_to_int(rx_message.Headers[i].FieldValue);
+		CHAR8 *name = rx_message.Headers[i].FieldName;
+		CHAR8 *value = rx_message.Headers[i].FieldValue;
+
+		if (equal_nocase(name, (CHAR8 *)"Content-Length")) {
+			body.size = ascii_to_int(value);
+			have_length = TRUE;
+		} else if (equal_nocase(name, (CHAR8 *)"Transfer-Encoding")) {
+			if (!equal_nocase(value, (CHAR8 *)"chunked")) {
+				perror(L"Unsupported Transfer-Encoding: %a\n",
+				       value);
+				efi_status = EFI_UNSUPPORTED;
+				goto error;
+			}
+			body.chunked = TRUE;
 		}
 	}
 
-	if (*buf_size == 0) {
-		perror(L"Failed to get Content-Lenght\n");
+	/* chunking overrides any Content-Length */
+	if (body.chunked) {
+		body.size = 0;
+	} else if (have_length && body.size == 0) {
+		perror(L"HTTP response is empty\n");
+		efi_status = EFI_BAD_BUFFER_SIZE;
 		goto error;
 	}
+	if (!body.size)
+		dprint(L"No Content-Length, reading %a body to its end\n",
+		       body.chunked ? "chunked" : "whole");
 
-	*buffer = AllocatePool(*buf_size);
-	if (!*buffer) {
-		perror(L"Failed to allocate new rx buffer\n");
+	efi_status = http_body_add(&body, rx_buffer, rx_message.BodyLength);
+	if (EFI_ERROR(efi_status))
 		goto error;
-	}
-
-	downloaded = rx_message.BodyLength;
-
-	CopyMem(*buffer, rx_buffer, downloaded);
 
 	/* Retreive the rest of the message */
-	while (downloaded < *buf_size) {
+	while (!http_body_done(&body)) {
 		if (rx_message.Headers) {
 			FreePool(rx_message.Headers);
 		}
 		rx_message.Headers = NULL;
 		rx_message.HeaderCount = 0;
 		rx_message.Data.Response = NULL;
-		rx_message.BodyLength = sizeof(rx_buffer);
-		rx_message.Body = rx_buffer;
+
+		/*
+		 * Receive the next piece right where it belongs if it has
+		 * somewhere to go, and only as much of it as has.
+		 */
+		len = 0;
+		rx_message.Body = NULL;
+		if (place && !body.chunked)
+			rx_message.Body = place(ctx, &len);
+		if (!rx_message.Body) {
+			if (!window) {
+				window_size = HTTP_RX_WINDOW;
+				if (body.size)
+					window_size = min(body.size - body.got,
+							  (UINT64)window_size);
+				window = AllocatePool(window_size);
+				if (!window) {
+					window = rx_buffer;
+					window_size = sizeof(rx_buffer);
+				}
+			}
+			rx_message.Body = window;
+			if (!len || len > window_size)
+				len = window_size;
+		}
+		if (body.size)
+			len = min(body.size - body.got, (UINT64)len);
+		rx_message.BodyLength = len;
 
 		rx_token.Status = EFI_NOT_READY;
 		response_done = FALSE;
@@ -641,23 +889,47 @@ receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
 		while (!response_done)
 			http->Poll(http);
 
+		/*
+		 * A body that comes with neither a length nor chunks ends
+		 * when the server closes the connection; the firmware may
+		 * also hand back an empty body once it's seen all of it.
+		 */
+		if (!body.size && !body.chunked &&
+		    (rx_token.Status == EFI_CONNECTION_FIN ||
+		     (!EFI_ERROR(rx_token.Status) && !rx_message.BodyLength)))
+			break;
+
 		if (EFI_ERROR(rx_token.Status)) {
 			perror(L"HTTP response: %r\n", rx_token.Status);
 			efi_status = rx_token.Status;
 			goto error;
 		}
 
-		if (rx_message.BodyLength + downloaded > *buf_size) {
-			efi_status = EFI_BAD_BUFFER_SIZE;
+		if (!rx_message.BodyLength) {
+			perror(L"HTTP body ended early\n");
+			efi_status = EFI_ABORTED;
 			goto error;
 		}
 
-		CopyMem(*buffer + downloaded, rx_buffer, rx_message.BodyLength);
+		efi_status = http_body_add(&body, rx_message.Body,
+					   rx_message.BodyLength);
+		if (EFI_ERROR(efi_status))
+			goto error;
+	}
 
-		downloaded += rx_message.BodyLength;
+	if (!body.got) {
+		perror(L"HTTP response is empty\n");
+		efi_status = EFI_BAD_BUFFER_SIZE;
+		goto error;
 	}
 
+	*received = body.got;
+	efi_status = EFI_SUCCESS;
+
 error:
+	if (window && window != rx_buffer)
+		FreePool(window);
+
 	event_status = gBS->CloseEvent(rx_token.Event);
 	if (EFI_ERROR(event_status)) {
 		perror(L"Failed to close Event for HTTP response: %r\n",
@@ -665,16 +937,14 @@ error:
 	}
 
 no_event:
-	if (EFI_ERROR(efi_status) && *buffer)
-		FreePool(*buffer);
-
 	return efi_status;
 }
 
 static EFI_STATUS
 http_fetch (EFI_HANDLE image, EFI_HANDLE device,
 	    CHAR8 *hostname, CHAR8 *uri, BOOLEAN is_ip6,
-	    VOID **buffer, UINT64 *buf_size)
+	    httpboot_sink_t sink, httpboot_place_t place, VOID *ctx,
+	    UINT64 *received)
 {
 	EFI_SERVICE_BINDING *service;
 	EFI_HANDLE http_handle;
@@ -682,8 +952,7 @@ http_fetch (EFI_HANDLE image, EFI_HANDLE device,
 	EFI_STATUS efi_status;
 	EFI_STATUS child_status;
 
-	*buffer = NULL;
-	*buf_size = 0;
+	*received = 0;
 
 	/* Open HTTP Service Binding Protocol */
 	efi_status = gBS->OpenProtocol(device, &EFI_HTTP_BINDING_GUID,
@@ -721,7 +990,7 @@ http_fetch (EFI_HANDLE image, EFI_HANDLE device,
 		goto error;
 	}
 
-	efi_status = receive_http_response(http, buffer, buf_size);
+	efi_status = receive_http_response(http, sink, place, ctx, received);
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Failed to receive HTTP response: %r\n", efi_status);
 		goto error;
@@ -738,14 +1007,21 @@ error:
 	return EFI_SUCCESS;
 }
 
+/*
+ * Fetch the next loader without keeping it, handing it to sink a piece
+ * at a time instead, and receiving each piece where place says it goes.
+ */
 EFI_STATUS
-httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size)
+httpboot_fetch_stream (EFI_HANDLE image, httpboot_sink_t sink,
+		       httpboot_place_t place, VOID *ctx)
 {
 	EFI_STATUS efi_status;
 	EFI_HANDLE nic;
 	CHAR8 next_loader[sizeof DEFAULT_LOADER_CHAR];
 	CHAR8 *next_uri = NULL;
 	CHAR8 *hostname = NULL;
+	UINT64 received = 0;
+	UINT64 perf_start_time;
 
 	if (!uri)
 		return EFI_NOT_READY;
@@ -787,8 +1063,11 @@ httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size)
 	}
 
 	/* Use HTTP protocl to fetch the remote file */
+	perf_start_time = perf_start();
 	efi_status = http_fetch (image, nic, hostname, next_uri, is_ip6,
-				 buffer, buf_size);
+				 sink, place, ctx, &received);
+	perf_stop(PERF_NET_FETCH, perf_start_time,
+		  EFI_ERROR(efi_status) ? 0 : received);
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Failed to fetch image: %r\n", efi_status);
 		goto error;
@@ -0,0 +1,53 @@
+#ifndef SHIM_BUNDLE_H
+#define SHIM_BUNDLE_H
+
+/*
+ * A bundle is one file holding the binaries shim can start (the second
+ * stage, MokManager and fallback), so they can all be found with a
+ * single open and a single small read of its index.  It sits next to
+ * shim as BUNDLE.  Each member is an ordinary signed PE binary, and is
+ * verified on its own when it's started, so the bundle itself isn't
+ * signed; a member that's been tampered with fails verification just
+ * as a separate file would.
+ *
+ * The format, all little-endian:
+ *
+ *   struct bundle_header
+ *   struct bundle_entry[count]
+ *   member data, anywhere after the index
+ *
+ * Starting each member on a 4KiB boundary keeps the reads of it aligned
+ * to the disk's blocks.
+ *
+ * Members are named as they would be as separate files, without any
+ * directory ("grubx64.efi"), and matched without regard to case.
+ *
+ * A separate file always takes precedence: the bundle is only looked in
+ * for a binary that isn't there on its own, so installing a new grub
+ * next to an old bundle boots the new grub.  A member is recorded in
+ * the loaded image, and measured, as BUNDLE's path followed by the
+ * member's name.
+ */
+#define BUNDLE L"\\bundle" EFI_ARCH L".bin"
+
+#define BUNDLE_MAGIC		"ShimBndl"
+#define BUNDLE_VERSION		1
+#define BUNDLE_MAX_MEMBERS	64
+#define BUNDLE_NAME_MAX		32
+
+struct bundle_header {
+	UINT8 magic[8];
+	UINT32 version;
+	UINT32 count;
+};
+
+struct bundle_entry {
+	CHAR16 name[BUNDLE_NAME_MAX];	/* NUL padded */
+	UINT64 offset;
+	UINT64 size;
+};
+
+extern EFI_STATUS bundle_find(EFI_HANDLE device, CHAR16 *path, CHAR16 *name,
+			      EFI_FILE **file, UINTN *offset, UINTN *size);
+
+#endif /* SHIM_BUNDLE_H */
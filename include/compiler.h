@@ -88,6 +88,11 @@
 #define unlikely(x)	__builtin_expect(!!(x), 0)
 #endif
 
+/* Hint that memory at x is about to be written */
+#ifndef prefetchw
+#define prefetchw(x)	__builtin_prefetch((x), 1)
+#endif
+
 /* Are two types/vars the same type (ignoring qualifiers)? */
 #ifndef __same_type
 #define __same_type(a, b) __builtin_types_compatible_p(typeof(a), typeof(b))
@@ -9,5 +9,8 @@
 #ifndef EFI_SECURITY_VIOLATION
 #define EFI_SECURITY_VIOLATION		EFIERR(26)
 #endif
+#ifndef EFI_CONNECTION_FIN
+#define EFI_CONNECTION_FIN		EFIERR(104)
+#endif
 
 #endif /* SHIM_ERRORS_H */
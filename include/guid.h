@@ -12,6 +12,7 @@ extern EFI_GUID PKCS7_GUID;
 extern EFI_GUID IMAGE_PROTOCOL;
 extern EFI_GUID EFI_FILE_INFO_GUID;
 extern EFI_GUID EFI_FILE_SYSTEM_INFO_GUID;
+extern EFI_GUID EFI_BLOCK_IO_GUID;
 extern EFI_GUID EFI_CERT_RSA2048_GUID;
 extern EFI_GUID EFI_CERT_SHA1_GUID;
 extern EFI_GUID EFI_CERT_SHA256_GUID;
@@ -27,6 +28,7 @@ extern EFI_GUID EFI_HTTP_PROTOCOL_GUID;
 extern EFI_GUID EFI_IP4_CONFIG2_GUID;
 extern EFI_GUID EFI_IP6_CONFIG_GUID;
 extern EFI_GUID EFI_LOADED_IMAGE_GUID;
+extern EFI_GUID EFI_MP_SERVICES_GUID;
 extern EFI_GUID EFI_TPM_GUID;
 extern EFI_GUID EFI_TPM2_GUID;
 extern EFI_GUID EFI_SECURE_BOOT_DB_GUID;
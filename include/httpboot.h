@@ -35,7 +35,26 @@
 #define SHIM_HTTPBOOT_H
 
 extern BOOLEAN find_httpboot(EFI_HANDLE device);
-extern EFI_STATUS httpboot_fetch_buffer(EFI_HANDLE image, VOID **buffer,
-					UINT64 *buf_size);
+
+/*
+ * Called with each piece of the body as it arrives, in order, along with
+ * the size of the whole thing, or 0 if the server didn't say.
+ */
+typedef EFI_STATUS (*httpboot_sink_t)(VOID *ctx, UINT64 size, VOID *data,
+				      UINTN len);
+
+/*
+ * Asked before each piece of the body is received where it should go:
+ * returns where the next *len bytes belong, so they can be received
+ * right there and not copied.  Or, if they have to go somewhere else
+ * first, returns NULL, with *len set to how many of them that's true of,
+ * or 0 if there's no telling.  Either way they're then handed to the
+ * sink as usual.
+ */
+typedef VOID *(*httpboot_place_t)(VOID *ctx, UINTN *len);
+
+extern EFI_STATUS httpboot_fetch_stream(EFI_HANDLE image,
+					httpboot_sink_t sink,
+					httpboot_place_t place, VOID *ctx);
 
 #endif /* SHIM_HTTPBOOT_H */
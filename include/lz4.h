@@ -0,0 +1,77 @@
+#ifndef SHIM_LZ4_H
+#define SHIM_LZ4_H
+
+/*
+ * Decompressing an LZ4 frame as it arrives, a piece at a time, and
+ * passing what comes out of it on.  Built only with ENABLE_LZ4.
+ *
+ * Only frames that carry the size of their content are accepted (lz4
+ * --content-size), since whatever takes the output needs to know how
+ * much is coming before the first byte of it.  Data that doesn't start
+ * with an LZ4 frame is passed on unchanged.
+ */
+#define LZ4_FRAME_MAGIC		0x184D2204
+
+/*
+ * Called with each piece of output, in order, along with the size of
+ * the whole thing.
+ */
+typedef EFI_STATUS (*lz4_sink_t)(VOID *ctx, UINT64 size, VOID *data,
+				 UINTN len);
+
+/*
+ * Asked where the next *len bytes of output would best be put, or NULL
+ * if it doesn't matter; it may be NULL itself.
+ */
+typedef VOID *(*lz4_place_t)(VOID *ctx, UINTN *len);
+
+typedef enum {
+	LZ4_MAGIC,		/* working out whether this is a frame */
+	LZ4_FLAGS,		/* reading FLG and BD */
+	LZ4_DESCRIPTOR,		/* reading the rest of the frame descriptor */
+	LZ4_BLOCK_SIZE,
+	LZ4_BLOCK,
+	LZ4_CHECKSUM,		/* the content checksum after the end mark */
+	LZ4_DONE,
+	LZ4_PASSTHROUGH		/* not a frame, just copying */
+} lz4_state_t;
+
+struct lz4_stream {
+	lz4_state_t state;
+	lz4_sink_t sink;
+	lz4_place_t place;
+	VOID *ctx;
+	UINT64 insize;		/* of the whole input, as we were told */
+
+	UINT8 hdr[19];		/* magic and frame descriptor */
+	UINT8 *dest;		/* where the bytes being collected go */
+	UINTN have, need;
+
+	UINT8 flags, bd;
+	UINTN block_max;
+	UINT64 content_size;
+	UINT64 produced;
+
+	BOOLEAN compressed;	/* whether the block being read is */
+	UINT8 *in;		/* block_max + a checksum */
+	UINT8 *out;		/* history, then block_max */
+	UINTN history;
+};
+
+#ifdef ENABLE_LZ4
+extern BOOLEAN lz4_is_frame(VOID *data, UINTN size);
+extern void lz4_stream_init(struct lz4_stream *s, lz4_sink_t sink,
+			    lz4_place_t place, VOID *ctx);
+extern EFI_STATUS lz4_stream_write(VOID *ctx, UINT64 size, VOID *data,
+				   UINTN len);
+extern VOID *lz4_stream_place(VOID *ctx, UINTN *len);
+extern EFI_STATUS lz4_stream_finish(struct lz4_stream *s);
+extern void lz4_stream_free(struct lz4_stream *s);
+#else
+static inline BOOLEAN lz4_is_frame(VOID *data UNUSED, UINTN size UNUSED)
+{
+	return FALSE;
+}
+#endif
+
+#endif /* SHIM_LZ4_H */
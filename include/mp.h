@@ -0,0 +1,44 @@
+#ifndef SHIM_MP_H
+#define SHIM_MP_H
+
+/*
+ * Running a piece of work on another processor while the boot processor
+ * gets on with something else.  Built only with ENABLE_MP_HASH, and only
+ * used when the firmware has the PI MP Services protocol and an enabled
+ * application processor; otherwise mp_start() fails and the caller does
+ * the work itself.
+ *
+ * Work run like this can't use any boot services, so no allocations,
+ * console output or perf counters.
+ */
+typedef void (*mp_work_t)(void *arg);
+
+struct mp_task {
+	mp_work_t fn;
+	void *arg;
+	volatile BOOLEAN done;
+};
+
+#ifdef ENABLE_MP_HASH
+extern BOOLEAN mp_available(void);
+extern EFI_STATUS mp_start(struct mp_task *task, mp_work_t fn, void *arg);
+extern EFI_STATUS mp_wait(struct mp_task *task);
+#else
+static inline BOOLEAN mp_available(void)
+{
+	return FALSE;
+}
+
+static inline EFI_STATUS mp_start(struct mp_task *task UNUSED,
+				  mp_work_t fn UNUSED, void *arg UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static inline EFI_STATUS mp_wait(struct mp_task *task UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+#endif
+
+#endif /* SHIM_MP_H */
@@ -0,0 +1,69 @@
+#ifndef SHIM_PERF_H
+#define SHIM_PERF_H
+
+/*
+ * Optional cycle counters around the expensive parts of loading and
+ * verifying an image, and a tally of the memory the loader has in use.
+ * Built only with ENABLE_SHIM_PERF; otherwise all of this compiles away.
+ */
+typedef enum {
+	PERF_GENERATE_HASH,
+	PERF_VERIFY_SIGNATURES,
+	PERF_CHECK_DB_HASH,
+	PERF_CHECK_DB_CERT,
+	PERF_RELOCATE_COFF,
+	PERF_MIRROR_MOK_DB,
+	PERF_READ_FILE,
+	PERF_READ_WAIT,
+	PERF_HASH_UPDATE,
+	PERF_MP_WAIT,
+	PERF_NET_FETCH,
+	PERF_MAX
+} perf_counter_t;
+
+#ifdef ENABLE_SHIM_PERF
+static inline UINT64 perf_start(void)
+{
+	return read_counter();
+}
+
+extern void perf_stop(perf_counter_t counter, UINT64 start, UINTN bytes);
+extern void perf_mem_alloc(UINTN bytes);
+extern void perf_mem_free(UINTN bytes);
+extern void perf_report(void);
+#else
+static inline UINT64 perf_start(void)
+{
+	return 0;
+}
+
+static inline void perf_stop(perf_counter_t counter UNUSED,
+			     UINT64 start UNUSED, UINTN bytes UNUSED)
+{
+}
+
+static inline void perf_mem_alloc(UINTN bytes UNUSED)
+{
+}
+
+static inline void perf_mem_free(UINTN bytes UNUSED)
+{
+}
+
+static inline void perf_report(void)
+{
+}
+#endif
+
+/*
+ * Evaluate a call and charge the time it took, and the number of bytes
+ * it worked on, to one counter.
+ */
+#define perf_time(counter, bytes, expr) ({				\
+		UINT64 __perf_start = perf_start();			\
+		__typeof__(expr) __perf_ret = (expr);			\
+		perf_stop((counter), __perf_start, (bytes));		\
+		__perf_ret;						\
+	})
+
+#endif /* SHIM_PERF_H */
@@ -0,0 +1,73 @@
+#ifndef SHIM_SIGDB_H
+#define SHIM_SIGDB_H
+
+#include <efi.h>
+
+typedef enum {
+	DATA_FOUND,
+	DATA_NOT_FOUND,
+	VAR_NOT_FOUND
+} CHECK_STATUS;
+
+/*
+ * The signature databases shim consults when verifying an image.  The
+ * first four come from UEFI variables, the vendor ones are built in.
+ */
+typedef enum {
+	SIGDB_DB,
+	SIGDB_DBX,
+	SIGDB_MOK,
+	SIGDB_MOKX,
+	SIGDB_VENDOR_DB,
+	SIGDB_VENDOR_DBX,
+	SIGDB_MAX
+} sigdb_id_t;
+
+/*
+ * Bumped every time an index is (re)built or dropped, so anything that
+ * caches a verification result can tell whether it is still valid.
+ */
+extern UINTN sigdb_generation;
+
+extern EFI_STATUS sigdb_init(void);
+extern void sigdb_fini(void);
+extern void sigdb_invalidate(CHAR16 *name, EFI_GUID *guid);
+
+extern CHECK_STATUS sigdb_check_hash(sigdb_id_t id, UINT8 *hash,
+				     UINTN hashsize, EFI_GUID *certtype);
+
+/*
+ * One X509 trust anchor out of a signature database.  The certificate
+ * is vetted and turned into a reusable store the first time a
+ * signature is checked against it, and kept until the database is
+ * dropped.
+ */
+#define SIGDB_KEYID_MAX	32
+
+struct sigdb_keyid {
+	UINTN len;
+	UINT8 id[SIGDB_KEYID_MAX];
+};
+
+typedef enum {
+	ANCHOR_UNCHECKED,
+	ANCHOR_USABLE,
+	ANCHOR_UNUSABLE
+} sigdb_anchor_state_t;
+
+struct sigdb_anchor {
+	UINT8 *cert;
+	UINTN certsize;
+	sigdb_anchor_state_t state;
+	VOID *store;
+	UINT32 subject_hash;		/* X509_NAME_hash() of the subject */
+	struct sigdb_keyid keyid;	/* SubjectKeyIdentifier, if any */
+};
+
+extern void sigdb_anchor_free(struct sigdb_anchor *anchor);
+extern CHECK_STATUS sigdb_get_anchors(sigdb_id_t id,
+				      struct sigdb_anchor **anchors,
+				      UINTN *nanchors, CHAR16 **dbname,
+				      EFI_GUID **guid);
+
+#endif /* SHIM_SIGDB_H */
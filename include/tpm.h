@@ -13,6 +13,7 @@ EFI_STATUS fallback_should_prefer_reset(void);
 EFI_STATUS tpm_log_pe(EFI_PHYSICAL_ADDRESS buf, UINTN size,
 		      EFI_PHYSICAL_ADDRESS addr, EFI_DEVICE_PATH *path,
 		      UINT8 *sha1hash, UINT8 pcr);
+BOOLEAN tpm_log_pe_needs_file(void);
 
 EFI_STATUS tpm_measure_variable(CHAR16 *dbname, EFI_GUID guid, UINTN size, void *data);
 
@@ -0,0 +1,28 @@
+#ifndef SHIM_VERIFYCACHE_H
+#define SHIM_VERIFYCACHE_H
+
+#include <efi.h>
+
+/*
+ * The certificate that authorized an image, as it was measured into the
+ * TPM.  cert is NULL if nothing was measured.
+ */
+struct verify_authority {
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINTN size;
+	void *cert;
+};
+
+/*
+ * Images this shim has already verified successfully, keyed by their
+ * Authenticode SHA-256 together with their certificate table.
+ */
+extern BOOLEAN verify_cache_key(UINT8 *sha256hash, char *certs,
+				UINTN certsize, UINT8 *key);
+extern BOOLEAN verify_cache_lookup(UINT8 *key, verification_method_t *method,
+				   struct verify_authority *authority);
+extern void verify_cache_record(UINT8 *key, verification_method_t method,
+				struct verify_authority *authority);
+
+#endif /* SHIM_VERIFYCACHE_H */
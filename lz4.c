@@ -0,0 +1,403 @@
+/*
+ * lz4.c - streaming LZ4 frame decompression
+ *
+ * With ENABLE_LZ4, the second stage may be an LZ4 frame wrapping the
+ * signed PE, so there are fewer bytes to pull off slow media or the
+ * network.  It's decompressed as it arrives and passed straight on to
+ * be hashed and loaded, so what's verified is still the original PE.
+ *
+ * Nothing here is trusted: every length comes from the input, and is
+ * checked before it's used.  The frame's header, block and content
+ * checksums are skipped rather than checked; they only guard against
+ * corruption, and the Authenticode signature of the output already
+ * covers that.
+ *
+ * See https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md and
+ * lz4_Block_format.md for the formats.
+ */
+
+#include "shim.h"
+
+#ifdef ENABLE_LZ4
+
+#define FLG_VERSION_MASK	0xc0
+#define FLG_VERSION		0x40
+#define FLG_BLOCK_INDEP		0x20
+#define FLG_BLOCK_CHECKSUM	0x10
+#define FLG_CONTENT_SIZE	0x08
+#define FLG_CONTENT_CHECKSUM	0x04
+#define FLG_RESERVED		0x02
+#define FLG_DICT_ID		0x01
+
+#define BD_BLOCK_MAX_MASK	0x70
+#define BD_RESERVED		0x8f
+
+#define BLOCK_UNCOMPRESSED	0x80000000U
+
+/* how far back a match can reach */
+#define LZ4_WINDOW		(64 * 1024)
+#define LZ4_MIN_MATCH		4
+
+static UINT32 get_le32(UINT8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT64 get_le64(UINT8 *p)
+{
+	return get_le32(p) | ((UINT64)get_le32(p + 4) << 32);
+}
+
+BOOLEAN lz4_is_frame(VOID *data, UINTN size)
+{
+	return size >= 4 && get_le32(data) == LZ4_FRAME_MAGIC;
+}
+
+void lz4_stream_init(struct lz4_stream *s, lz4_sink_t sink,
+		     lz4_place_t place, VOID *ctx)
+{
+	ZeroMem(s, sizeof(*s));
+	s->sink = sink;
+	s->place = place;
+	s->ctx = ctx;
+	s->state = LZ4_MAGIC;
+	s->dest = s->hdr;
+	s->need = 4;
+}
+
+void lz4_stream_free(struct lz4_stream *s)
+{
+	if (s->in) {
+		FreePool(s->in);
+		perf_mem_free(s->block_max + 4);
+	}
+	if (s->out) {
+		FreePool(s->out);
+		perf_mem_free(LZ4_WINDOW + s->block_max);
+	}
+	s->in = s->out = NULL;
+}
+
+static void lz4_collect(struct lz4_stream *s, UINT8 *dest, UINTN need)
+{
+	s->dest = dest;
+	s->have = 0;
+	s->need = need;
+}
+
+/*
+ * Decompress one block of srclen bytes to out + history, which has room
+ * for max bytes.  The history before it is what matches may refer back
+ * to.
+ */
+static EFI_STATUS lz4_decode_block(UINT8 *src, UINTN srclen, UINT8 *out,
+				   UINTN history, UINTN max, UINTN *outlen)
+{
+	UINT8 *ip = src, *iend = src + srclen;
+	UINT8 *op = out + history, *oend = out + history + max;
+	UINTN lit, mlen, offset;
+	UINT8 token, b;
+
+	for (;;) {
+		if (ip >= iend)
+			goto corrupt;
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					goto corrupt;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > (UINTN)(iend - ip) || lit > (UINTN)(oend - op))
+			goto corrupt;
+		CopyMem(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* the last sequence is only literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			goto corrupt;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (UINTN)(op - out))
+			goto corrupt;
+
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					goto corrupt;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ4_MIN_MATCH;
+		if (mlen > (UINTN)(oend - op))
+			goto corrupt;
+
+		/* the match may overlap what it's making, so go a byte at a time */
+		while (mlen--) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	*outlen = op - (out + history);
+	return EFI_SUCCESS;
+
+corrupt:
+	perror(L"LZ4 block is corrupt\n");
+	return EFI_COMPROMISED_DATA;
+}
+
+/*
+ * The magic and frame descriptor are all in; check we can handle the
+ * frame, and get ready for its blocks.
+ */
+static EFI_STATUS lz4_frame_start(struct lz4_stream *s)
+{
+	s->flags = s->hdr[4];
+	s->bd = s->hdr[5];
+
+	if ((s->flags & FLG_VERSION_MASK) != FLG_VERSION ||
+	    (s->flags & FLG_RESERVED) || (s->bd & BD_RESERVED) ||
+	    ((s->bd & BD_BLOCK_MAX_MASK) >> 4) < 4) {
+		perror(L"Unsupported LZ4 frame descriptor 0x%02x 0x%02x\n",
+		       s->flags, s->bd);
+		return EFI_UNSUPPORTED;
+	}
+	if (s->flags & FLG_DICT_ID) {
+		perror(L"LZ4 frames with a dictionary are not supported\n");
+		return EFI_UNSUPPORTED;
+	}
+	if (!(s->flags & FLG_CONTENT_SIZE)) {
+		perror(L"LZ4 frame has no content size\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	s->content_size = get_le64(s->hdr + 6);
+	s->block_max = 1UL << (8 + 2 * ((s->bd & BD_BLOCK_MAX_MASK) >> 4));
+
+	s->in = AllocatePool(s->block_max + 4);
+	s->out = AllocatePool(LZ4_WINDOW + s->block_max);
+	if (!s->in || !s->out) {
+		perror(L"Unable to allocate LZ4 buffers\n");
+		if (s->in)
+			FreePool(s->in);
+		if (s->out)
+			FreePool(s->out);
+		s->in = s->out = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+	perf_mem_alloc(s->block_max + 4);
+	perf_mem_alloc(LZ4_WINDOW + s->block_max);
+
+	dprint(L"LZ4 frame of 0x%lx bytes, in blocks of up to 0x%lx\n",
+	       s->content_size, s->block_max);
+
+	s->state = LZ4_BLOCK_SIZE;
+	lz4_collect(s, s->hdr, 4);
+	return EFI_SUCCESS;
+}
+
+/*
+ * A block is all in; decompress it, pass it on and keep as much of it
+ * as the next block might refer to.
+ */
+static EFI_STATUS lz4_block_done(struct lz4_stream *s, UINTN size)
+{
+	EFI_STATUS efi_status;
+	UINT8 *block = s->out + s->history;
+	UINTN len, keep;
+
+	if (s->compressed) {
+		efi_status = lz4_decode_block(s->in, size, s->out, s->history,
+					      s->block_max, &len);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	} else {
+		CopyMem(block, s->in, size);
+		len = size;
+	}
+
+	if (len > s->content_size - s->produced) {
+		perror(L"LZ4 frame is bigger than it says\n");
+		return EFI_COMPROMISED_DATA;
+	}
+	s->produced += len;
+
+	efi_status = s->sink(s->ctx, s->content_size, block, len);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	if (!(s->flags & FLG_BLOCK_INDEP)) {
+		keep = min(s->history + len, (UINTN)LZ4_WINDOW);
+		CopyMem(s->out, block + len - keep, keep);
+		s->history = keep;
+	}
+
+	s->state = LZ4_BLOCK_SIZE;
+	lz4_collect(s, s->hdr, 4);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Everything asked for by the last lz4_collect() has arrived; see what
+ * comes next.
+ */
+static EFI_STATUS lz4_advance(struct lz4_stream *s)
+{
+	UINT32 size;
+	UINTN len;
+
+	switch (s->state) {
+	case LZ4_MAGIC:
+		s->state = LZ4_FLAGS;
+		lz4_collect(s, s->hdr + 4, 2);
+		return EFI_SUCCESS;
+
+	case LZ4_FLAGS:
+		/* they say how long the rest of the descriptor is */
+		len = 1;
+		if (s->hdr[4] & FLG_CONTENT_SIZE)
+			len += 8;
+		if (s->hdr[4] & FLG_DICT_ID)
+			len += 4;
+		s->state = LZ4_DESCRIPTOR;
+		lz4_collect(s, s->hdr + 6, len);
+		return EFI_SUCCESS;
+
+	case LZ4_DESCRIPTOR:
+		return lz4_frame_start(s);
+
+	case LZ4_BLOCK_SIZE:
+		size = get_le32(s->hdr);
+		if (size == 0) {
+			if (s->produced != s->content_size) {
+				perror(L"LZ4 frame is smaller than it says\n");
+				return EFI_COMPROMISED_DATA;
+			}
+			if (s->flags & FLG_CONTENT_CHECKSUM) {
+				s->state = LZ4_CHECKSUM;
+				lz4_collect(s, s->hdr, 4);
+			} else {
+				s->state = LZ4_DONE;
+			}
+			return EFI_SUCCESS;
+		}
+
+		s->compressed = !(size & BLOCK_UNCOMPRESSED);
+		size &= ~BLOCK_UNCOMPRESSED;
+		if (size > s->block_max) {
+			perror(L"LZ4 block of 0x%x bytes is too big\n", size);
+			return EFI_COMPROMISED_DATA;
+		}
+		s->state = LZ4_BLOCK;
+		lz4_collect(s, s->in, size + (s->flags & FLG_BLOCK_CHECKSUM ? 4 : 0));
+		return EFI_SUCCESS;
+
+	case LZ4_BLOCK:
+		len = s->have;
+		if (s->flags & FLG_BLOCK_CHECKSUM)
+			len -= 4;
+		return lz4_block_done(s, len);
+
+	case LZ4_CHECKSUM:
+		s->state = LZ4_DONE;
+		return EFI_SUCCESS;
+
+	default:
+		return EFI_SUCCESS;
+	}
+}
+
+/*
+ * Take the next len bytes of the input, which is size bytes long.  This
+ * is an lz4_sink_t itself, so decompression can be put in front of
+ * anything that takes one.
+ */
+EFI_STATUS lz4_stream_write(VOID *ctx, UINT64 size, VOID *data, UINTN len)
+{
+	struct lz4_stream *s = ctx;
+	UINT8 *p = data;
+	EFI_STATUS efi_status;
+	UINTN n;
+
+	s->insize = size;
+
+	while (len) {
+		if (s->state == LZ4_PASSTHROUGH)
+			return s->sink(s->ctx, s->insize, p, len);
+
+		if (s->state == LZ4_DONE) {
+			perror(L"Unexpected data after the LZ4 frame\n");
+			return EFI_COMPROMISED_DATA;
+		}
+
+		n = min(len, s->need - s->have);
+		CopyMem(s->dest + s->have, p, n);
+		s->have += n;
+		p += n;
+		len -= n;
+		if (s->have < s->need)
+			break;
+
+		if (s->state == LZ4_MAGIC &&
+		    get_le32(s->hdr) != LZ4_FRAME_MAGIC) {
+			s->state = LZ4_PASSTHROUGH;
+			efi_status = s->sink(s->ctx, s->insize, s->hdr, 4);
+		} else {
+			efi_status = lz4_advance(s);
+		}
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Where the next input should go.  Compressed input has to come through
+ * here, but anything being passed on unchanged can go wherever the sink
+ * wants it.  This is an lz4_place_t itself.
+ */
+VOID *lz4_stream_place(VOID *ctx, UINTN *len)
+{
+	struct lz4_stream *s = ctx;
+
+	if (s->state == LZ4_PASSTHROUGH && s->place)
+		return s->place(s->ctx, len);
+	*len = 0;
+	return NULL;
+}
+
+/*
+ * The input has all been written; make sure the frame was complete.
+ */
+EFI_STATUS lz4_stream_finish(struct lz4_stream *s)
+{
+	switch (s->state) {
+	case LZ4_DONE:
+	case LZ4_PASSTHROUGH:
+		return EFI_SUCCESS;
+	case LZ4_MAGIC:
+		/* too short to be a frame, so it isn't one */
+		if (s->have)
+			return s->sink(s->ctx, s->insize, s->hdr, s->have);
+		return EFI_SUCCESS;
+	default:
+		perror(L"LZ4 frame is truncated\n");
+		return EFI_COMPROMISED_DATA;
+	}
+}
+
+#endif /* ENABLE_LZ4 */
+
+// vim:fenc=utf-8:tw=75:noet
@@ -29,6 +29,7 @@ static BOOLEAN check_var(CHAR16 *varname)
 
 #define SetVariable(name, guid, attrs, varsz, var) ({			\
 	EFI_STATUS efi_status_;						\
+	sigdb_invalidate(name, guid);					\
 	efi_status_ = gRT->SetVariable(name, guid, attrs, varsz, var);	\
 	dprint_(L"%a:%d:%a() SetVariable(\"%s\", ... varsz=0x%llx) = %r\n",\
 		 __FILE__, __LINE__, __func__,				\
@@ -729,9 +730,10 @@ mirror_one_mok_variable(struct mok_state_variable *v,
 	if (FullDataSize && v->flags & MOK_MIRROR_KEYDB) {
 		dprint(L"calling mirror_mok_db(\"%s\",  datasz=%lu)\n",
 		       v->rtname, FullDataSize);
-		efi_status = mirror_mok_db(v->rtname, (CHAR8 *)v->rtname8, v->guid,
-					   attrs, FullData, FullDataSize,
-					   only_first);
+		efi_status = perf_time(PERF_MIRROR_MOK_DB, FullDataSize,
+				mirror_mok_db(v->rtname, (CHAR8 *)v->rtname8,
+					      v->guid, attrs, FullData,
+					      FullDataSize, only_first));
 		dprint(L"mirror_mok_db(\"%s\",  datasz=%lu) returned %r\n",
 		       v->rtname, FullDataSize, efi_status);
 	} else if (FullDataSize && only_first) {
@@ -867,6 +869,7 @@ EFI_STATUS import_one_mok_state(struct mok_state_variable *v,
 	}
 	if (delete == TRUE) {
 		perror(L"Deleting bad variable %s\n", v->name);
+		sigdb_invalidate(v->name, v->guid);
 		efi_status = LibDeleteVariable(v->name, v->guid);
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Failed to erase %s\n", v->name);
@@ -0,0 +1,206 @@
+/*
+ * mp.c - run work on an application processor
+ *
+ * Everything shim does normally happens on the boot processor while the
+ * others sit idle.  With ENABLE_MP_HASH, work that doesn't need boot
+ * services can be handed to one application processor with the PI MP
+ * Services protocol's StartupThisAP(), in its non-blocking mode, and
+ * collected later.  When the firmware doesn't have the protocol, or has
+ * no enabled and healthy AP, or won't start one, mp_start() fails and
+ * the caller is expected to do the work itself.
+ */
+
+#include "shim.h"
+#include "include/MpService.h"
+
+#ifdef ENABLE_MP_HASH
+
+static EFI_MP_SERVICES_PROTOCOL *mp_services;
+static UINTN mp_ap;
+static BOOLEAN mp_probed;
+static BOOLEAN mp_usable;
+
+/*
+ * StartupThisAP() has to be given an event to run without blocking,
+ * and signals it when it notices the AP is done, which can be a good
+ * while after the work actually finished; EDK2 only looks every 100ms.
+ * So we don't wait on it, but on the task's done flag, and the event is
+ * only used to tell whether the AP is free to start something else.
+ * It can't be closed while the firmware might still signal it, so the
+ * one event is kept for as long as shim runs.
+ */
+static EFI_EVENT mp_event;
+static BOOLEAN mp_busy;
+
+/*
+ * How long mp_wait() will wait, and how often it looks, in microseconds.
+ * Hashing even a large image takes well under a second.
+ */
+#define MP_WAIT_TIMEOUT	(10 * 1000 * 1000)
+#define MP_WAIT_STEP	1
+
+/*
+ * Find an AP we can use: any one other than ourselves that's enabled
+ * and hasn't been marked as faulty.
+ */
+static BOOLEAN mp_probe(void)
+{
+	EFI_PROCESSOR_INFORMATION info;
+	EFI_STATUS efi_status;
+	UINTN self, count, enabled, i;
+	const UINT32 wanted = PROCESSOR_ENABLED_BIT |
+			      PROCESSOR_HEALTH_STATUS_BIT;
+
+	efi_status = LibLocateProtocol(&EFI_MP_SERVICES_GUID,
+				       (VOID **)&mp_services);
+	if (EFI_ERROR(efi_status) || !mp_services) {
+		dprint(L"No MP services, not using other processors\n");
+		return FALSE;
+	}
+
+	efi_status = mp_services->WhoAmI(mp_services, &self);
+	if (EFI_ERROR(efi_status))
+		return FALSE;
+
+	efi_status = mp_services->GetNumberOfProcessors(mp_services, &count,
+							&enabled);
+	if (EFI_ERROR(efi_status) || enabled < 2)
+		return FALSE;
+
+	for (i = 0; i < count; i++) {
+		if (i == self)
+			continue;
+
+		ZeroMem(&info, sizeof(info));
+		efi_status = mp_services->GetProcessorInfo(mp_services, i,
+							   &info);
+		if (EFI_ERROR(efi_status))
+			continue;
+		if ((info.StatusFlag & wanted) != wanted ||
+		    (info.StatusFlag & PROCESSOR_AS_BSP_BIT))
+			continue;
+
+		efi_status = gBS->CreateEvent(0, 0, NULL, NULL, &mp_event);
+		if (EFI_ERROR(efi_status))
+			return FALSE;
+
+		dprint(L"Using processor %lu of %lu for hashing\n", i, count);
+		mp_ap = i;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+BOOLEAN mp_available(void)
+{
+	if (!mp_probed) {
+		mp_probed = TRUE;
+		mp_usable = mp_probe();
+	}
+	return mp_usable;
+}
+
+static VOID EFIAPI mp_run(VOID *arg)
+{
+	struct mp_task *task = arg;
+
+	task->fn(task->arg);
+
+	/*
+	 * Make sure everything fn did is visible before the boot
+	 * processor sees we're done; after this, task isn't ours.
+	 */
+	__sync_synchronize();
+	task->done = TRUE;
+}
+
+/*
+ * Start fn(arg) on the AP.  Until mp_wait() has returned successfully,
+ * the task, arg and everything fn uses have to be left alone.
+ */
+EFI_STATUS mp_start(struct mp_task *task, mp_work_t fn, void *arg)
+{
+	EFI_STATUS efi_status;
+
+	if (!mp_available())
+		return EFI_UNSUPPORTED;
+
+	/* the last thing we started may not have been noticed as done yet */
+	if (mp_busy) {
+		if (gBS->CheckEvent(mp_event) != EFI_SUCCESS)
+			return EFI_UNSUPPORTED;
+		mp_busy = FALSE;
+	}
+
+	task->fn = fn;
+	task->arg = arg;
+	task->done = FALSE;
+	__sync_synchronize();
+
+	efi_status = mp_services->StartupThisAP(mp_services, mp_run, mp_ap,
+						mp_event, 0, task, NULL);
+	if (EFI_ERROR(efi_status)) {
+		dprint(L"Could not start processor %lu: %r\n", mp_ap,
+		       efi_status);
+		/*
+		 * Busy is worth trying again later; anything else (like not
+		 * supporting non-blocking calls) won't get any better.
+		 */
+		if (efi_status != EFI_NOT_READY)
+			mp_usable = FALSE;
+		return EFI_UNSUPPORTED;
+	}
+
+	mp_busy = TRUE;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Spin without hammering the memory the AP is writing to.  (pause() in
+ * asm.h is wfi on aarch64, which waits for an interrupt; that's not
+ * what we want here.)
+ */
+static inline void mp_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(__i686__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Wait for the work started by mp_start() to finish, for up to
+ * MP_WAIT_TIMEOUT microseconds.  If the AP hangs, or the firmware never
+ * gets around to starting it, this gives up with EFI_TIMEOUT and no
+ * more work is handed out.  The AP may still be running fn after that,
+ * so the caller mustn't touch, reuse or free the task, arg or anything
+ * fn writes to; those have to be left to leak.
+ */
+EFI_STATUS mp_wait(struct mp_task *task)
+{
+	UINT64 perf_start_time = perf_start();
+	UINTN waited = 0;
+
+	while (!task->done) {
+		if (waited >= MP_WAIT_TIMEOUT) {
+			perror(L"Processor %lu did not finish in time\n",
+			       mp_ap);
+			mp_usable = FALSE;
+			perf_stop(PERF_MP_WAIT, perf_start_time, 0);
+			return EFI_TIMEOUT;
+		}
+		mp_relax();
+		gBS->Stall(MP_WAIT_STEP);
+		waited += MP_WAIT_STEP;
+	}
+	__sync_synchronize();
+
+	perf_stop(PERF_MP_WAIT, perf_start_time, 0);
+	return EFI_SUCCESS;
+}
+
+#endif /* ENABLE_MP_HASH */
+
+// vim:fenc=utf-8:tw=75:noet
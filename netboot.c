@@ -43,6 +43,8 @@
 static EFI_PXE_BASE_CODE *pxe;
 static EFI_IP_ADDRESS tftp_addr;
 static CHAR8 *full_path;
+static EFI_PXE_BASE_CODE_MTFTP_INFO mtftp_info;
+static BOOLEAN use_mtftp;
 
 
 typedef struct {
@@ -254,6 +256,110 @@ static EFI_STATUS parseDhcp6()
 	return EFI_SUCCESS;
 }
 
+/*
+ * PXE servers that run multicast TFTP say so in the PXE vendor options
+ * (DHCP option 43, see the PXE specification): sub-options 1 to 3 give
+ * the multicast address and the client and server ports, 4 and 5 the
+ * listen and retransmit timeouts in seconds.  Without an address and
+ * both ports there is no multicast session to join.
+ */
+#define DHCP4_OPT_PAD		0
+#define DHCP4_OPT_VENDOR	43
+#define DHCP4_OPT_CLASS_ID	60
+#define DHCP4_OPT_END		255
+
+#define PXE_OPT_MTFTP_IP	1
+#define PXE_OPT_MTFTP_CPORT	2
+#define PXE_OPT_MTFTP_SPORT	3
+#define PXE_OPT_MTFTP_TMOUT	4
+#define PXE_OPT_MTFTP_DELAY	5
+
+static UINT8 *find_dhcp4_option(EFI_PXE_BASE_CODE_DHCPV4_PACKET *pkt,
+				UINT8 code, UINT8 *len)
+{
+	UINT8 *optr = pkt->DhcpOptions;
+	/* the options run on past DhcpOptions[] to the end of the packet */
+	UINT8 *end = (UINT8 *)pkt + sizeof(EFI_PXE_BASE_CODE_PACKET);
+
+	while (optr < end && *optr != DHCP4_OPT_END) {
+		if (*optr == DHCP4_OPT_PAD) {
+			optr++;
+			continue;
+		}
+		if (optr + 2 > end || optr + 2 + optr[1] > end)
+			break;
+		if (*optr == code) {
+			*len = optr[1];
+			return optr + 2;
+		}
+		optr += 2 + optr[1];
+	}
+
+	return NULL;
+}
+
+static BOOLEAN get_v4_mtftp_info(EFI_PXE_BASE_CODE_DHCPV4_PACKET *pkt)
+{
+	UINT8 *opts, *optr, *end;
+	UINT8 len;
+	BOOLEAN ip = FALSE, cport = FALSE, sport = FALSE;
+	UINT16 port;
+
+	opts = find_dhcp4_option(pkt, DHCP4_OPT_CLASS_ID, &len);
+	if (!opts || len < 9 || memcmp(opts, "PXEClient", 9))
+		return FALSE;
+
+	opts = find_dhcp4_option(pkt, DHCP4_OPT_VENDOR, &len);
+	if (!opts)
+		return FALSE;
+
+	memset(&mtftp_info, 0, sizeof(mtftp_info));
+	mtftp_info.ListenTimeout = 1;
+	mtftp_info.TransmitTimeout = 1;
+
+	end = opts + len;
+	for (optr = opts; optr < end && *optr != DHCP4_OPT_END;) {
+		if (*optr == DHCP4_OPT_PAD) {
+			optr++;
+			continue;
+		}
+		if (optr + 2 > end || optr + 2 + optr[1] > end)
+			break;
+		switch (optr[0]) {
+		case PXE_OPT_MTFTP_IP:
+			if (optr[1] != 4)
+				break;
+			memcpy(&mtftp_info.MCastIp.v4, optr + 2, 4);
+			ip = TRUE;
+			break;
+		case PXE_OPT_MTFTP_CPORT:
+		case PXE_OPT_MTFTP_SPORT:
+			if (optr[1] != 2)
+				break;
+			memcpy(&port, optr + 2, 2);
+			if (optr[0] == PXE_OPT_MTFTP_CPORT) {
+				mtftp_info.CPort = ntohs(port);
+				cport = TRUE;
+			} else {
+				mtftp_info.SPort = ntohs(port);
+				sport = TRUE;
+			}
+			break;
+		case PXE_OPT_MTFTP_TMOUT:
+			if (optr[1] == 1 && optr[2])
+				mtftp_info.ListenTimeout = optr[2];
+			break;
+		case PXE_OPT_MTFTP_DELAY:
+			if (optr[1] == 1 && optr[2])
+				mtftp_info.TransmitTimeout = optr[2];
+			break;
+		}
+		optr += 2 + optr[1];
+	}
+
+	return ip && cport && sport;
+}
+
 static EFI_STATUS parseDhcp4()
 {
 	CHAR8 template[sizeof DEFAULT_LOADER_CHAR];
@@ -307,6 +413,15 @@ static EFI_STATUS parseDhcp4()
 	strcata(full_path, template + template_ofs);
 	memcpy(&tftp_addr.v4, pkt_v4->BootpSiAddr, 4);
 
+	use_mtftp = get_v4_mtftp_info(pkt_v4);
+	if (use_mtftp)
+		dprint(L"MTFTP session at %d.%d.%d.%d ports %d/%d\n",
+		       mtftp_info.MCastIp.v4.Addr[0],
+		       mtftp_info.MCastIp.v4.Addr[1],
+		       mtftp_info.MCastIp.v4.Addr[2],
+		       mtftp_info.MCastIp.v4.Addr[3],
+		       mtftp_info.CPort, mtftp_info.SPort);
+
 	return EFI_SUCCESS;
 }
 
@@ -331,28 +446,164 @@ EFI_STATUS parseNetbootinfo(EFI_HANDLE image_handle)
 	return efi_status;
 }
 
+/*
+ * How big a buffer to start with if the server won't tell us the size
+ * of the file
+ */
+#define TFTP_GUESS_SIZE		(4096 * 1024)
+
+/*
+ * Anything the server says is bigger than the loader will take (its
+ * size is an int) is taken to be nonsense
+ */
+#define TFTP_MAX_FILE_SIZE	0x7fffffffULL
+
+/*
+ * TFTP block sizes (RFC 2348).  Without the option, blocks are 512
+ * bytes, and each one is a round trip.  The default asks for blocks that
+ * fill a standard 1500 byte Ethernet frame, less the IP, UDP and TFTP
+ * headers; SHIM_TFTP_BLKSIZE can ask for something else, up to the
+ * largest the RFC allows, for networks with bigger frames.
+ */
+#define TFTP_MIN_BLKSIZE	512
+#define TFTP_DEFAULT_BLKSIZE	1468
+#define TFTP_MAX_BLKSIZE	65464
+
+static UINTN tftp_blksize(void)
+{
+	EFI_STATUS efi_status;
+	UINT8 *data = NULL;
+	UINTN datasize = 0;
+	UINTN blksz = TFTP_DEFAULT_BLKSIZE;
+
+	efi_status = get_variable(L"SHIM_TFTP_BLKSIZE", &data, &datasize,
+				  SHIM_LOCK_GUID);
+	if (EFI_ERROR(efi_status))
+		return blksz;
+
+	if (datasize == sizeof(UINT16))
+		blksz = *(UINT16 *)data;
+	else if (datasize == sizeof(UINT32))
+		blksz = *(UINT32 *)data;
+	else
+		dprint(L"Ignoring SHIM_TFTP_BLKSIZE of %lu bytes\n", datasize);
+	FreePool(data);
+
+	if (blksz < TFTP_MIN_BLKSIZE)
+		blksz = TFTP_MIN_BLKSIZE;
+	if (blksz > TFTP_MAX_BLKSIZE)
+		blksz = TFTP_MAX_BLKSIZE;
+	return blksz;
+}
+
+/*
+ * Ask the server how big the file is (the tsize option), so it can be
+ * fetched into a buffer of the right size the first time.  Returns 0 if
+ * it won't say, or says something we can't believe.
+ */
+static UINT64 tftp_file_size(void)
+{
+	EFI_STATUS efi_status;
+	UINT64 size = 0;
+
+	efi_status = pxe->Mtftp(pxe, EFI_PXE_BASE_CODE_TFTP_GET_FILE_SIZE,
+				NULL, FALSE, &size, NULL, &tftp_addr,
+				(UINT8 *)full_path, NULL, FALSE);
+	if (EFI_ERROR(efi_status)) {
+		dprint(L"TFTP server did not report the file size: %r\n",
+		       efi_status);
+		return 0;
+	}
+	if (size > TFTP_MAX_FILE_SIZE) {
+		dprint(L"Ignoring TFTP file size of %lu bytes\n", size);
+		return 0;
+	}
+
+	dprint(L"TFTP file size is %lu bytes\n", size);
+	return size;
+}
+
 EFI_STATUS FetchNetbootimage(EFI_HANDLE image_handle, VOID **buffer, UINT64 *bufsiz)
 {
 	EFI_STATUS efi_status;
 	EFI_PXE_BASE_CODE_TFTP_OPCODE read = EFI_PXE_BASE_CODE_TFTP_READ_FILE;
+	EFI_PXE_BASE_CODE_MTFTP_INFO *info = NULL;
 	BOOLEAN overwrite = FALSE;
 	BOOLEAN nobuffer = FALSE;
-	UINTN blksz = 512;
+	UINTN blksz = tftp_blksize();
+	UINTN *blkszp = &blksz;
+	UINT64 size, perf_start_time;
 
 	console_print(L"Fetching Netboot Image\n");
 	if (*buffer == NULL) {
-		*buffer = AllocatePool(4096 * 1024);
+		size = tftp_file_size();
+		if (size == 0)
+			size = TFTP_GUESS_SIZE;
+		*buffer = AllocatePool(size);
+		/*
+		 * If the size was made up, or there just isn't that much
+		 * memory, the guess and growing it as we go may still work
+		 */
+		if (!*buffer && size != TFTP_GUESS_SIZE) {
+			size = TFTP_GUESS_SIZE;
+			*buffer = AllocatePool(size);
+		}
 		if (!*buffer)
 			return EFI_OUT_OF_RESOURCES;
-		*bufsiz = 4096 * 1024;
+		*bufsiz = size;
+	}
+
+	/*
+	 * When a whole rack boots at once, joining the multicast session
+	 * means the server sends the file once rather than once per client.
+	 */
+	if (use_mtftp) {
+		read = EFI_PXE_BASE_CODE_MTFTP_READ_FILE;
+		info = &mtftp_info;
 	}
 
 try_again:
-	efi_status = pxe->Mtftp(pxe, read, *buffer, overwrite, bufsiz, &blksz,
-			      &tftp_addr, (UINT8 *)full_path, NULL, nobuffer);
+	size = *bufsiz;
+	perf_start_time = perf_start();
+	efi_status = pxe->Mtftp(pxe, read, *buffer, overwrite, bufsiz,
+			      info ? NULL : blkszp, &tftp_addr,
+			      (UINT8 *)full_path, info, nobuffer);
+	perf_stop(PERF_NET_FETCH, perf_start_time,
+		  EFI_ERROR(efi_status) ? 0 : *bufsiz);
+	if (EFI_ERROR(efi_status) && efi_status != EFI_BUFFER_TOO_SMALL &&
+	    info) {
+		/*
+		 * Plenty of firmware doesn't implement MTFTP at all; the
+		 * file is still there over unicast
+		 */
+		dprint(L"MTFTP failed: %r, falling back to TFTP\n",
+		       efi_status);
+		read = EFI_PXE_BASE_CODE_TFTP_READ_FILE;
+		info = NULL;
+		*bufsiz = size;
+		goto try_again;
+	}
+	if (EFI_ERROR(efi_status) && efi_status != EFI_BUFFER_TOO_SMALL &&
+	    blkszp) {
+		/*
+		 * Some servers (and firmware) choke on the blksize option
+		 * rather than ignoring it; do without
+		 */
+		dprint(L"TFTP with %lu byte blocks failed: %r, retrying with the default\n",
+		       blksz, efi_status);
+		blkszp = NULL;
+		*bufsiz = size;
+		goto try_again;
+	}
 	if (efi_status == EFI_BUFFER_TOO_SMALL) {
-		/* try again, doubling buf size */
-		*bufsiz *= 2;
+		/*
+		 * Try again, doubling buf size, or more if the firmware
+		 * says it got further into the file than that
+		 */
+		if (*bufsiz < size * 2)
+			*bufsiz = size * 2;
+		dprint(L"TFTP buffer of %lu bytes was too small, trying %lu\n",
+		       size, *bufsiz);
 		FreePool(*buffer);
 		*buffer = AllocatePool(*bufsiz);
 		if (!*buffer)
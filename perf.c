@@ -0,0 +1,118 @@
+/*
+ * perf.c - cycle counters for the image loading and verification paths
+ *
+ * When shim is built with ENABLE_SHIM_PERF, network fetches and the
+ * hashing, verification, relocation and MokList mirroring paths are
+ * timed with the CPU's cycle counter, and the big buffers used to load
+ * an image (the file, the image itself, read buffers) are counted, so
+ * the peak amount of memory the loader needed is known.  The totals are
+ * printed with the other debug output just before the next stage is
+ * started, and are also left in the volatile
+ * "ShimPerf" variable, so they can be read from the booted OS:
+ *
+ *   hexdump -C /sys/firmware/efi/efivars/ShimPerf-605dab50-e046-4300-abb6-3dd810dd8b23
+ *
+ * The variable holds a struct perf_table (after the 4 byte attribute
+ * header efivarfs adds): the memory counts, then one struct perf_entry
+ * per perf_counter_t.
+ */
+
+#include "shim.h"
+
+#ifdef ENABLE_SHIM_PERF
+
+#define PERF_TABLE_VERSION	2
+
+struct perf_entry {
+	UINT64 calls;
+	UINT64 cycles;
+	UINT64 bytes;
+};
+
+struct perf_table {
+	UINT32 version;
+	UINT32 count;
+	UINT64 mem_in_use;	/* bytes, when the table was written */
+	UINT64 mem_peak;
+	struct perf_entry entries[PERF_MAX];
+};
+
+static struct perf_table perf_table = {
+	.version = PERF_TABLE_VERSION,
+	.count = PERF_MAX,
+};
+
+static const CHAR16 * const perf_names[PERF_MAX] = {
+	[PERF_GENERATE_HASH] = L"generate_hash",
+	[PERF_VERIFY_SIGNATURES] = L"verify_signatures",
+	[PERF_CHECK_DB_HASH] = L"check_db_hash",
+	[PERF_CHECK_DB_CERT] = L"check_db_cert",
+	[PERF_RELOCATE_COFF] = L"relocate_coff",
+	[PERF_MIRROR_MOK_DB] = L"mirror_mok_db",
+	[PERF_READ_FILE] = L"read_file",
+	[PERF_READ_WAIT] = L"read_wait",
+	[PERF_HASH_UPDATE] = L"image_hash_update",
+	[PERF_MP_WAIT] = L"mp_wait",
+	[PERF_NET_FETCH] = L"net_fetch",
+};
+
+void
+perf_stop(perf_counter_t counter, UINT64 start, UINTN bytes)
+{
+	UINT64 now = read_counter();
+	struct perf_entry *entry;
+
+	if (counter >= PERF_MAX)
+		return;
+
+	entry = &perf_table.entries[counter];
+	entry->calls += 1;
+	entry->cycles += now - start;
+	entry->bytes += bytes;
+}
+
+void
+perf_mem_alloc(UINTN bytes)
+{
+	perf_table.mem_in_use += bytes;
+	if (perf_table.mem_in_use > perf_table.mem_peak)
+		perf_table.mem_peak = perf_table.mem_in_use;
+}
+
+void
+perf_mem_free(UINTN bytes)
+{
+	if (bytes > perf_table.mem_in_use)
+		bytes = perf_table.mem_in_use;
+	perf_table.mem_in_use -= bytes;
+}
+
+void
+perf_report(void)
+{
+	EFI_STATUS efi_status;
+	UINTN i;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		struct perf_entry *entry = &perf_table.entries[i];
+
+		if (!entry->calls)
+			continue;
+		dprint(L"perf: %s: %lu calls %lu cycles %lu bytes\n",
+		       perf_names[i], entry->calls, entry->cycles,
+		       entry->bytes);
+	}
+	dprint(L"perf: loader memory: %lu bytes in use, %lu at peak\n",
+	       perf_table.mem_in_use, perf_table.mem_peak);
+
+	efi_status = gRT->SetVariable(L"ShimPerf", &SHIM_LOCK_GUID,
+				      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+				      EFI_VARIABLE_RUNTIME_ACCESS,
+				      sizeof(perf_table), &perf_table);
+	if (EFI_ERROR(efi_status))
+		dprint(L"Could not set ShimPerf: %r\n", efi_status);
+}
+
+#endif /* ENABLE_SHIM_PERF */
+
+// vim:fenc=utf-8:tw=75:noet
@@ -84,8 +84,13 @@ UINT8 *vendor_deauthorized = NULL;
 #if defined(ENABLE_SHIM_CERT)
 UINT32 build_cert_size;
 UINT8 *build_cert;
+static struct sigdb_anchor build_cert_anchor;
 #endif /* defined(ENABLE_SHIM_CERT) */
 
+#if defined(VENDOR_CERT_FILE)
+static struct sigdb_anchor vendor_cert_anchor;
+#endif /* defined(VENDOR_CERT_FILE) */
+
 /*
  * indicator of how an image has been verified
  */
@@ -97,12 +102,6 @@ int loader_is_participating;
 UINT8 user_insecure_mode;
 UINT8 ignore_db;
 
-typedef enum {
-	DATA_FOUND,
-	DATA_NOT_FOUND,
-	VAR_NOT_FOUND
-} CHECK_STATUS;
-
 typedef struct {
 	UINT32 MokSize;
 	UINT8 *Mok;
@@ -225,22 +224,85 @@ image_is_loadable(EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr)
 	return 0;
 }
 
+/*
+ * Apply one run of relocations of the same type to the page at
+ * FixupBase.  Each type gets a loop of its own, so nothing has to be
+ * decided per entry but where the fixup goes.  The caller has made
+ * sure every fixup lands inside the image.
+ */
+static void relocate_run(UINT16 type, UINT16 *Reloc, UINT16 *RelocEnd,
+			 char *FixupBase, UINT64 Adjust)
+{
+	UINT16 *Fixup16;
+	UINT32 *Fixup32;
+	UINT64 *Fixup64;
+
+	switch (type) {
+	case EFI_IMAGE_REL_BASED_HIGH:
+		for (; Reloc < RelocEnd; Reloc++) {
+			Fixup16 = (UINT16 *)(FixupBase + (*Reloc & 0xFFF));
+			*Fixup16 = (UINT16) (*Fixup16 + ((UINT16) ((UINT32) Adjust >> 16)));
+		}
+		break;
+
+	case EFI_IMAGE_REL_BASED_LOW:
+		for (; Reloc < RelocEnd; Reloc++) {
+			Fixup16 = (UINT16 *)(FixupBase + (*Reloc & 0xFFF));
+			*Fixup16 = (UINT16) (*Fixup16 + (UINT16) Adjust);
+		}
+		break;
+
+	case EFI_IMAGE_REL_BASED_HIGHLOW:
+		for (; Reloc < RelocEnd; Reloc++) {
+			Fixup32 = (UINT32 *)(FixupBase + (*Reloc & 0xFFF));
+			*Fixup32 = *Fixup32 + (UINT32) Adjust;
+		}
+		break;
+
+	case EFI_IMAGE_REL_BASED_DIR64:
+		for (; Reloc < RelocEnd; Reloc++) {
+			Fixup64 = (UINT64 *)(FixupBase + (*Reloc & 0xFFF));
+			*Fixup64 = *Fixup64 + (UINT64) Adjust;
+		}
+		break;
+
+	default:	/* EFI_IMAGE_REL_BASED_ABSOLUTE is just padding */
+		break;
+	}
+}
+
+static UINTN reloc_width(UINT16 type)
+{
+	switch (type) {
+	case EFI_IMAGE_REL_BASED_ABSOLUTE:
+		return 0;
+	case EFI_IMAGE_REL_BASED_HIGH:
+	case EFI_IMAGE_REL_BASED_LOW:
+		return sizeof(UINT16);
+	case EFI_IMAGE_REL_BASED_HIGHLOW:
+		return sizeof(UINT32);
+	case EFI_IMAGE_REL_BASED_DIR64:
+		return sizeof(UINT64);
+	default:
+		return (UINTN)-1;
+	}
+}
+
 /*
  * Perform the actual relocation
  */
 static EFI_STATUS relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
 				 EFI_IMAGE_SECTION_HEADER *Section,
-				 void *orig, void *data)
+				 void *reloc, UINTN relocsize, void *data)
 {
-	EFI_IMAGE_BASE_RELOCATION *RelocBase, *RelocBaseEnd;
+	EFI_IMAGE_BASE_RELOCATION *RelocBase, *RelocBaseEnd, *Next;
 	UINT64 Adjust;
-	UINT16 *Reloc, *RelocEnd;
-	char *Fixup, *FixupBase;
-	UINT16 *Fixup16;
-	UINT32 *Fixup32;
-	UINT64 *Fixup64;
-	int size = context->ImageSize;
-	void *ImageEnd = (char *)orig + size;
+	UINT16 *Reloc, *RelocEnd, *Run;
+	UINT16 type;
+	char *FixupBase, *NextBase;
+	UINTN size = context->ImageSize;
+	UINTN width, room;
+	void *RelocDataEnd = (char *)reloc + relocsize;
 	int n = 0;
 
 	/* Alright, so here's how this works:
@@ -267,17 +329,17 @@ static EFI_STATUS relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
 	 * them.  The SizeOfBlock field of this structure includes the
 	 * structure itself, and adding it to that structure's address will
 	 * yield the next entry in the array.
+	 *
+	 * reloc points to the file's data from the file address on, and
+	 * relocsize is how much of it we have.
 	 */
-	RelocBase = ImageAddress(orig, size, Section->PointerToRawData);
+	RelocBase = reloc;
 	/* RelocBaseEnd here is the address of the first entry /past/ the
 	 * table.  */
-	RelocBaseEnd = ImageAddress(orig, size, Section->PointerToRawData +
-						Section->Misc.VirtualSize);
-
-	if (!RelocBase && !RelocBaseEnd)
-		return EFI_SUCCESS;
+	RelocBaseEnd = ImageAddress(reloc, relocsize,
+				    Section->Misc.VirtualSize);
 
-	if (!RelocBase || !RelocBaseEnd) {
+	if (!RelocBaseEnd) {
 		perror(L"Reloc table overflows binary\n");
 		return EFI_UNSUPPORTED;
 	}
@@ -287,6 +349,13 @@ static EFI_STATUS relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
 	if (Adjust == 0)
 		return EFI_SUCCESS;
 
+	/*
+	 * Everything about a block is checked once, up front: its size,
+	 * that it's inside the table, and where its page is.  If the whole
+	 * page and the widest fixup past its end are inside the image, none
+	 * of its entries need checking at all; otherwise each run is checked
+	 * against what's left of the image.
+	 */
 	while (RelocBase < RelocBaseEnd) {
 		Reloc = (UINT16 *) ((char *) RelocBase + sizeof (EFI_IMAGE_BASE_RELOCATION));
 
@@ -302,7 +371,7 @@ static EFI_STATUS relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
 		}
 
 		RelocEnd = (UINT16 *) ((char *) RelocBase + RelocBase->SizeOfBlock);
-		if ((void *)RelocEnd < orig || (void *)RelocEnd > ImageEnd) {
+		if ((void *)RelocEnd < reloc || (void *)RelocEnd > RelocDataEnd) {
 			perror(L"Reloc %d entry overflows binary\n", n);
 			return EFI_UNSUPPORTED;
 		}
@@ -312,38 +381,46 @@ static EFI_STATUS relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
 			perror(L"Reloc %d Invalid fixupbase\n", n);
 			return EFI_UNSUPPORTED;
 		}
+		room = size - RelocBase->VirtualAddress;
 
-		while (Reloc < RelocEnd) {
-			Fixup = FixupBase + (*Reloc & 0xFFF);
-			switch ((*Reloc) >> 12) {
-			case EFI_IMAGE_REL_BASED_ABSOLUTE:
-				break;
-
-			case EFI_IMAGE_REL_BASED_HIGH:
-				Fixup16   = (UINT16 *) Fixup;
-				*Fixup16 = (UINT16) (*Fixup16 + ((UINT16) ((UINT32) Adjust >> 16)));
-				break;
+		/*
+		 * Get the next block's page on its way into the cache while
+		 * this one is worked on.
+		 */
+		Next = (EFI_IMAGE_BASE_RELOCATION *)RelocEnd;
+		if (Next + 1 <= RelocBaseEnd &&
+		    (void *)(Next + 1) <= RelocDataEnd) {
+			NextBase = ImageAddress(data, size, Next->VirtualAddress);
+			if (NextBase)
+				prefetchw(NextBase);
+		}
 
-			case EFI_IMAGE_REL_BASED_LOW:
-				Fixup16   = (UINT16 *) Fixup;
-				*Fixup16  = (UINT16) (*Fixup16 + (UINT16) Adjust);
-				break;
+		while (Reloc < RelocEnd) {
+			type = *Reloc >> 12;
+			width = reloc_width(type);
+			if (width == (UINTN)-1) {
+				perror(L"Reloc %d Unknown relocation\n", n);
+				return EFI_UNSUPPORTED;
+			}
 
-			case EFI_IMAGE_REL_BASED_HIGHLOW:
-				Fixup32   = (UINT32 *) Fixup;
-				*Fixup32  = *Fixup32 + (UINT32) Adjust;
-				break;
+			for (Run = Reloc + 1;
+			     Run < RelocEnd && (*Run >> 12) == type; Run++)
+				;
 
-			case EFI_IMAGE_REL_BASED_DIR64:
-				Fixup64 = (UINT64 *) Fixup;
-				*Fixup64 = *Fixup64 + (UINT64) Adjust;
-				break;
+			if (room < 0x1000 + sizeof(UINT64)) {
+				UINT16 *r;
 
-			default:
-				perror(L"Reloc %d Unknown relocation\n", n);
-				return EFI_UNSUPPORTED;
+				for (r = Reloc; r < Run; r++) {
+					if ((UINTN)(*r & 0xFFF) + width > room) {
+						perror(L"Reloc %d fixup is outside the image\n",
+						       n);
+						return EFI_UNSUPPORTED;
+					}
+				}
 			}
-			Reloc += 1;
+
+			relocate_run(type, Reloc, Run, FixupBase, Adjust);
+			Reloc = Run;
 		}
 		RelocBase = (EFI_IMAGE_BASE_RELOCATION *) RelocEnd;
 		n++;
@@ -390,229 +467,362 @@ static BOOLEAN verify_x509(UINT8 *Cert, UINTN CertSize)
 	return TRUE;
 }
 
-static BOOLEAN verify_eku(UINT8 *Cert, UINTN CertSize)
+static BOOLEAN verify_eku(X509 *x509)
 {
-	X509 *x509;
-	CONST UINT8 *Temp = Cert;
 	EXTENDED_KEY_USAGE *eku;
 	ASN1_OBJECT *module_signing;
+	BOOLEAN ret = TRUE;
 
         module_signing = OBJ_nid2obj(OBJ_create(OID_EKU_MODSIGN,
                                                 "modsign-eku",
                                                 "modsign-eku"));
 
-	x509 = d2i_X509 (NULL, &Temp, (long) CertSize);
-	if (x509 != NULL) {
-		eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
+	eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
 
-		if (eku) {
-			int i = 0;
-			for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++) {
-				ASN1_OBJECT *key_usage = sk_ASN1_OBJECT_value(eku, i);
+	if (eku) {
+		int i = 0;
+		for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++) {
+			ASN1_OBJECT *key_usage = sk_ASN1_OBJECT_value(eku, i);
 
-				if (OBJ_cmp(module_signing, key_usage) == 0)
-					return FALSE;
+			if (OBJ_cmp(module_signing, key_usage) == 0) {
+				ret = FALSE;
+				break;
 			}
-			EXTENDED_KEY_USAGE_free(eku);
 		}
-
-		X509_free(x509);
+		EXTENDED_KEY_USAGE_free(eku);
 	}
 
 	OBJ_cleanup();
 
-	return TRUE;
+	return ret;
 }
 
-static CHECK_STATUS check_db_cert_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize,
-					 WIN_CERTIFICATE_EFI_PKCS *data,
-					 UINT8 *hash, CHAR16 *dbname,
-					 EFI_GUID guid)
-{
-	EFI_SIGNATURE_DATA *Cert;
-	UINTN CertSize;
-	BOOLEAN IsFound = FALSE;
-	int i = 0;
-
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		if (CompareGuid (&CertList->SignatureType, &EFI_CERT_TYPE_X509_GUID) == 0) {
-			Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-			CertSize = CertList->SignatureSize - sizeof(EFI_GUID);
-			dprint(L"trying to verify cert %d (%s)\n", i++, dbname);
-			if (verify_x509(Cert->SignatureData, CertSize)) {
-				if (verify_eku(Cert->SignatureData, CertSize)) {
-					drain_openssl_errors();
-					IsFound = AuthenticodeVerify (data->CertData,
-								      data->Hdr.dwLength - sizeof(data->Hdr),
-								      Cert->SignatureData,
-								      CertSize,
-								      hash, SHA256_DIGEST_SIZE);
-					if (IsFound) {
-						dprint(L"AuthenticodeVerify() succeeded: %d\n", IsFound);
-						tpm_measure_variable(dbname, guid, CertSize, Cert->SignatureData);
-						drain_openssl_errors();
-						return DATA_FOUND;
-					} else {
-						LogError(L"AuthenticodeVerify(): %d\n", IsFound);
-					}
-				}
-			} else if (verbose) {
-				console_print(L"Not a DER encoded x.509 Certificate");
-				dprint(L"cert:\n");
-				dhexdumpat(Cert->SignatureData, CertSize, 0);
-			}
-		}
+static void set_keyid(struct sigdb_keyid *keyid, ASN1_OCTET_STRING *os)
+{
+	keyid->len = os->length;
+	CopyMem(keyid->id, os->data, min(keyid->len, (UINTN)SIGDB_KEYID_MAX));
+}
 
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
-	}
+static BOOLEAN keyid_equal(struct sigdb_keyid *a, struct sigdb_keyid *b)
+{
+	if (a->len == 0 || a->len != b->len)
+		return FALSE;
+	return CompareMem(a->id, b->id, min(a->len, (UINTN)SIGDB_KEYID_MAX)) == 0;
+}
+
+/*
+ * What an Authenticode signature says about where its chain can end:
+ * the subject and issuer names and the key identifiers of every
+ * certificate it carries.  A trust anchor whose subject and key
+ * identifier match none of those can't terminate the chain, so there's
+ * no point running a full verification against it.
+ */
+#define CHAIN_MAX_CERTS	16
 
-	return DATA_NOT_FOUND;
+struct chain_hints {
+	BOOLEAN valid;
+	UINTN nnames;
+	UINT32 names[CHAIN_MAX_CERTS * 2];
+	UINTN nkeyids;
+	struct sigdb_keyid keyids[CHAIN_MAX_CERTS * 2];
+};
+
+static void get_chain_hints(VOID *auth, struct chain_hints *hints)
+{
+	STACK_OF(X509) *certs;
+	int i;
+
+	ZeroMem(hints, sizeof(*hints));
+
+	/* these are the signature's own, from when it was parsed */
+	certs = AuthenticodeGetCertificates(auth);
+	if (!certs || sk_X509_num(certs) <= 0 ||
+	    sk_X509_num(certs) > CHAIN_MAX_CERTS)
+		return;
+
+	for (i = 0; i < sk_X509_num(certs); i++) {
+		X509 *x509 = sk_X509_value(certs, i);
+		ASN1_OCTET_STRING *skid;
+		AUTHORITY_KEYID *akid;
+
+		hints->names[hints->nnames++] = X509_subject_name_hash(x509);
+		hints->names[hints->nnames++] = X509_issuer_name_hash(x509);
+
+		skid = X509_get_ext_d2i(x509, NID_subject_key_identifier,
+					NULL, NULL);
+		if (skid) {
+			set_keyid(&hints->keyids[hints->nkeyids++], skid);
+			ASN1_OCTET_STRING_free(skid);
+		}
+		akid = X509_get_ext_d2i(x509, NID_authority_key_identifier,
+					NULL, NULL);
+		if (akid) {
+			if (akid->keyid)
+				set_keyid(&hints->keyids[hints->nkeyids++],
+					  akid->keyid);
+			AUTHORITY_KEYID_free(akid);
+		}
+	}
+	hints->valid = TRUE;
+	dprint(L"signature carries %d certificates\n", sk_X509_num(certs));
+	drain_openssl_errors();
 }
 
-static CHECK_STATUS check_db_cert(CHAR16 *dbname, EFI_GUID guid,
-				  WIN_CERTIFICATE_EFI_PKCS *data, UINT8 *hash)
+/*
+ * An Authenticode signature from an image, decoded once and then
+ * checked against as many trust anchors as it takes.
+ */
+struct signature {
+	WIN_CERTIFICATE_EFI_PKCS *data;
+	VOID *auth;		/* AuthenticodeParse() handle, NULL if malformed */
+	struct chain_hints hints;
+	BOOLEAN blacklisted;
+};
+
+static void parse_signature(struct signature *sig,
+			    WIN_CERTIFICATE_EFI_PKCS *data)
 {
-	CHECK_STATUS rc;
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	sig->data = data;
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-	if (EFI_ERROR(efi_status))
-		return VAR_NOT_FOUND;
+	drain_openssl_errors();
+	sig->auth = AuthenticodeParse(data->CertData,
+				      data->Hdr.dwLength - sizeof(data->Hdr));
+	if (!sig->auth) {
+		dprint(L"Could not parse the Authenticode signature\n");
+		drain_openssl_errors();
+		return;
+	}
+	get_chain_hints(sig->auth, &sig->hints);
+}
 
-	CertList = (EFI_SIGNATURE_LIST *)db;
+static void free_signature(struct signature *sig)
+{
+	AuthenticodeFree(sig->auth);
+	sig->auth = NULL;
+}
 
-	rc = check_db_cert_in_ram(CertList, dbsize, data, hash, dbname, guid);
+/*
+ * Without usable hints every anchor is a candidate, which is the old
+ * exhaustive search.
+ */
+static BOOLEAN anchor_in_chain(struct chain_hints *hints,
+			       struct sigdb_anchor *anchor)
+{
+	UINTN i;
 
-	FreePool(db);
+	if (!hints || !hints->valid)
+		return TRUE;
 
-	return rc;
+	for (i = 0; i < hints->nnames; i++) {
+		if (hints->names[i] == anchor->subject_hash)
+			return TRUE;
+	}
+	for (i = 0; i < hints->nkeyids; i++) {
+		if (keyid_equal(&hints->keyids[i], &anchor->keyid))
+			return TRUE;
+	}
+	return FALSE;
 }
 
 /*
- * Check a hash against an EFI_SIGNATURE_LIST in a buffer
+ * Vet a database certificate and build its store the first time it's
+ * used as a trust anchor; the result is kept with the anchor, so each
+ * certificate is only decoded once however many signatures it checks.
  */
-static CHECK_STATUS check_db_hash_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize, UINT8 *data,
-					 int SignatureSize, EFI_GUID CertType,
-					 CHAR16 *dbname, EFI_GUID guid)
+static BOOLEAN prepare_anchor(struct sigdb_anchor *anchor)
 {
-	EFI_SIGNATURE_DATA *Cert;
-	UINTN CertCount, Index;
-	BOOLEAN IsFound = FALSE;
+	ASN1_OCTET_STRING *skid;
+	CONST UINT8 *Temp;
+	X509 *x509;
 
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		CertCount = (CertList->SignatureListSize -sizeof (EFI_SIGNATURE_LIST) - CertList->SignatureHeaderSize) / CertList->SignatureSize;
-		Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-		if (CompareGuid(&CertList->SignatureType, &CertType) == 0) {
-			for (Index = 0; Index < CertCount; Index++) {
-				if (CompareMem (Cert->SignatureData, data, SignatureSize) == 0) {
-					//
-					// Find the signature in database.
-					//
-					IsFound = TRUE;
-					tpm_measure_variable(dbname, guid, SignatureSize, data);
-					break;
-				}
+	if (anchor->state != ANCHOR_UNCHECKED)
+		return anchor->state == ANCHOR_USABLE;
 
-				Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) Cert + CertList->SignatureSize);
-			}
-			if (IsFound) {
-				break;
-			}
+	anchor->state = ANCHOR_UNUSABLE;
+	if (!verify_x509(anchor->cert, anchor->certsize)) {
+		if (verbose) {
+			console_print(L"Not a DER encoded x.509 Certificate");
+			dprint(L"cert:\n");
+			dhexdumpat(anchor->cert, anchor->certsize, 0);
 		}
+		return FALSE;
+	}
+	Temp = anchor->cert;
+	x509 = d2i_X509(NULL, &Temp, (long)anchor->certsize);
+	if (!x509) {
+		drain_openssl_errors();
+		return FALSE;
+	}
+	if (!verify_eku(x509)) {
+		X509_free(x509);
+		return FALSE;
+	}
+
+	anchor->subject_hash = X509_subject_name_hash(x509);
+	skid = X509_get_ext_d2i(x509, NID_subject_key_identifier, NULL, NULL);
+	if (skid) {
+		set_keyid(&anchor->keyid, skid);
+		ASN1_OCTET_STRING_free(skid);
+	}
+	X509_free(x509);
+
+	anchor->store = Pkcs7CertStoreNew(anchor->cert, anchor->certsize);
+	if (!anchor->store) {
+		dprint(L"Could not build a certificate store\n");
+		return FALSE;
+	}
+	anchor->state = ANCHOR_USABLE;
+	return TRUE;
+}
 
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
+#if defined(ENABLE_SHIM_CERT) || defined(VENDOR_CERT_FILE)
+/*
+ * The built-in certificates are trusted as they are, without the checks
+ * applied to database entries.
+ */
+static struct sigdb_anchor *builtin_anchor(struct sigdb_anchor *anchor,
+					   UINT8 *cert, UINTN certsize)
+{
+	if (anchor->state == ANCHOR_UNCHECKED) {
+		anchor->cert = cert;
+		anchor->certsize = certsize;
+		anchor->store = Pkcs7CertStoreNew(cert, certsize);
+		anchor->state = anchor->store ? ANCHOR_USABLE : ANCHOR_UNUSABLE;
 	}
+	return anchor->state == ANCHOR_USABLE ? anchor : NULL;
+}
+#endif
 
-	if (IsFound)
-		return DATA_FOUND;
+static BOOLEAN verify_with_anchor(struct signature *sig, UINT8 *hash,
+				  struct sigdb_anchor *anchor)
+{
+	if (!anchor || !sig->auth)
+		return FALSE;
 
-	return DATA_NOT_FOUND;
+	drain_openssl_errors();
+	return AuthenticodeVerifyParsed(sig->auth, anchor->store, hash,
+					SHA256_DIGEST_SIZE);
 }
 
 /*
- * Check a hash against an EFI_SIGNATURE_LIST in a UEFI variable
+ * The certificate that let the image being verified through, as it was
+ * measured; a cached verification measures the same one again.
  */
-static CHECK_STATUS check_db_hash(CHAR16 *dbname, EFI_GUID guid, UINT8 *data,
-				  int SignatureSize, EFI_GUID CertType)
+static struct verify_authority authority;
+
+static void measure_authority(CHAR16 *name, EFI_GUID guid, UINTN size,
+			      void *cert)
 {
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	authority.name = name;
+	authority.guid = guid;
+	authority.size = size;
+	authority.cert = cert;
+	tpm_measure_variable(name, guid, size, cert);
+}
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-	if (EFI_ERROR(efi_status)) {
+/*
+ * Check a signature against the certificates in one of the signature
+ * databases
+ */
+static CHECK_STATUS check_db_cert(sigdb_id_t id, struct signature *sig,
+				  UINT8 *hash)
+{
+	struct sigdb_anchor *anchors;
+	UINTN nanchors = 0, i;
+	CHAR16 *dbname;
+	EFI_GUID *guid;
+	UINT64 perf_start_time;
+	CHECK_STATUS status = DATA_NOT_FOUND;
+
+	if (sigdb_get_anchors(id, &anchors, &nanchors, &dbname, &guid)
+			!= DATA_FOUND)
 		return VAR_NOT_FOUND;
-	}
 
-	CertList = (EFI_SIGNATURE_LIST *)db;
+	perf_start_time = perf_start();
 
-	CHECK_STATUS rc = check_db_hash_in_ram(CertList, dbsize, data,
-					       SignatureSize, CertType,
-					       dbname, guid);
-	FreePool(db);
-	return rc;
+	for (i = 0; i < nanchors; i++) {
+		if (!prepare_anchor(&anchors[i]) ||
+		    !anchor_in_chain(&sig->hints, &anchors[i]))
+			continue;
+		dprint(L"trying to verify cert %lu (%s)\n", i, dbname);
+
+		if (verify_with_anchor(sig, hash, &anchors[i])) {
+			dprint(L"AuthenticodeVerify() succeeded\n");
+			measure_authority(dbname, *guid, anchors[i].certsize,
+					  anchors[i].cert);
+			drain_openssl_errors();
+			status = DATA_FOUND;
+			break;
+		}
+		LogError(L"AuthenticodeVerify() failed\n");
+	}
 
+	perf_stop(PERF_CHECK_DB_CERT, perf_start_time, 0);
+	return status;
 }
 
 /*
- * Check whether the binary signature or hash are present in dbx or the
- * built-in blacklist
+ * Check a hash against the index of one of the signature databases
  */
-static EFI_STATUS check_blacklist (WIN_CERTIFICATE_EFI_PKCS *cert,
-				   UINT8 *sha256hash, UINT8 *sha1hash)
+static CHECK_STATUS check_db_hash(sigdb_id_t id, UINT8 *data,
+				  int SignatureSize, EFI_GUID CertType)
 {
-	EFI_SIGNATURE_LIST *dbx = (EFI_SIGNATURE_LIST *)vendor_deauthorized;
+	return perf_time(PERF_CHECK_DB_HASH, 0,
+			 sigdb_check_hash(id, data, SignatureSize, &CertType));
+}
 
-	if (check_db_hash_in_ram(dbx, vendor_deauthorized_size, sha256hash,
-			SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID, L"dbx",
-			EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
+/*
+ * Check whether the binary hash is present in dbx or the built-in
+ * blacklist
+ */
+static EFI_STATUS check_blacklist (UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	if (check_db_hash(SIGDB_VENDOR_DBX, sha256hash, SHA256_DIGEST_SIZE,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash_in_ram(dbx, vendor_deauthorized_size, sha1hash,
-				 SHA1_DIGEST_SIZE, EFI_CERT_SHA1_GUID, L"dbx",
-				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
+	if (check_db_hash(SIGDB_VENDOR_DBX, sha1hash, SHA1_DIGEST_SIZE,
+			  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
-	    check_db_cert_in_ram(dbx, vendor_deauthorized_size, cert, sha256hash, L"dbx",
-				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
-		LogError(L"cert sha256hash found in vendor dbx\n");
-		return EFI_SECURITY_VIOLATION;
-	}
-	if (check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (check_db_hash(SIGDB_DBX, sha256hash, SHA256_DIGEST_SIZE,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha1hash,
-			  SHA1_DIGEST_SIZE, EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+	if (check_db_hash(SIGDB_DBX, sha1hash, SHA1_DIGEST_SIZE,
+			  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
-	    check_db_cert(L"dbx", EFI_SECURE_BOOT_DB_GUID,
-			  cert, sha256hash) == DATA_FOUND) {
-		LogError(L"cert sha256hash found in system dbx\n");
+	if (check_db_hash(SIGDB_MOKX, sha256hash, SHA256_DIGEST_SIZE,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+		LogError(L"binary sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"MokListX", SHIM_LOCK_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID) == DATA_FOUND) {
-		LogError(L"binary sha256hash found in Mok dbx\n");
+
+	drain_openssl_errors();
+	return EFI_SUCCESS;
+}
+
+/*
+ * Check whether the binary signature comes from a certificate in dbx or
+ * the built-in blacklist
+ */
+static EFI_STATUS check_blacklist_cert (struct signature *sig,
+					UINT8 *sha256hash)
+{
+	if (check_db_cert(SIGDB_VENDOR_DBX, sig, sha256hash) == DATA_FOUND) {
+		LogError(L"cert sha256hash found in vendor dbx\n");
+		return EFI_SECURITY_VIOLATION;
+	}
+	if (check_db_cert(SIGDB_DBX, sig, sha256hash) == DATA_FOUND) {
+		LogError(L"cert sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
-	    check_db_cert(L"MokListX", SHIM_LOCK_GUID,
-			  cert, sha256hash) == DATA_FOUND) {
+	if (check_db_cert(SIGDB_MOKX, sig, sha256hash) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
@@ -628,79 +838,47 @@ static void update_verification_method(verification_method_t method)
 }
 
 /*
- * Check whether the binary signature or hash are present in db or MokList
+ * Check whether the binary hash is present in db or MokList
  */
-static EFI_STATUS check_whitelist (WIN_CERTIFICATE_EFI_PKCS *cert,
-				   UINT8 *sha256hash, UINT8 *sha1hash)
+static EFI_STATUS check_whitelist (UINT8 *sha256hash, UINT8 *sha1hash)
 {
 	if (!ignore_db) {
-		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha256hash, SHA256_DIGEST_SIZE,
-					EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+		if (check_db_hash(SIGDB_DB, sha256hash, SHA256_DIGEST_SIZE,
+				  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 			update_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
 			LogError(L"check_db_hash(db, sha256hash) != DATA_FOUND\n");
 		}
-		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha1hash, SHA1_DIGEST_SIZE,
-					EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+		if (check_db_hash(SIGDB_DB, sha1hash, SHA1_DIGEST_SIZE,
+				  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 			verification_method = VERIFIED_BY_HASH;
 			update_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
 			LogError(L"check_db_hash(db, sha1hash) != DATA_FOUND\n");
 		}
-		if (cert && check_db_cert(L"db", EFI_SECURE_BOOT_DB_GUID, cert, sha256hash)
-					== DATA_FOUND) {
-			verification_method = VERIFIED_BY_CERT;
-			update_verification_method(VERIFIED_BY_CERT);
-			return EFI_SUCCESS;
-		} else if (cert) {
-			LogError(L"check_db_cert(db, sha256hash) != DATA_FOUND\n");
-		}
 	}
 
 #if defined(VENDOR_DB_FILE)
-	EFI_SIGNATURE_LIST *db = (EFI_SIGNATURE_LIST *)vendor_db;
-
-	if (check_db_hash_in_ram(db, vendor_db_size,
-				 sha256hash, SHA256_DIGEST_SIZE,
-				 EFI_CERT_SHA256_GUID, L"vendor_db",
-				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
+	if (check_db_hash(SIGDB_VENDOR_DB, sha256hash, SHA256_DIGEST_SIZE,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		verification_method = VERIFIED_BY_HASH;
 		update_verification_method(VERIFIED_BY_HASH);
 		return EFI_SUCCESS;
 	} else {
 		LogError(L"check_db_hash(vendor_db, sha256hash) != DATA_FOUND\n");
 	}
-	if (cert &&
-	    check_db_cert_in_ram(db, vendor_db_size,
-				 cert, sha256hash, L"vendor_db",
-				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
-		verification_method = VERIFIED_BY_CERT;
-		update_verification_method(VERIFIED_BY_CERT);
-		return EFI_SUCCESS;
-	} else if (cert) {
-		LogError(L"check_db_cert(vendor_db, sha256hash) != DATA_FOUND\n");
-	}
 #endif
 
-	if (check_db_hash(L"MokList", SHIM_LOCK_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID)
-				== DATA_FOUND) {
+	if (check_db_hash(SIGDB_MOK, sha256hash, SHA256_DIGEST_SIZE,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		verification_method = VERIFIED_BY_HASH;
 		update_verification_method(VERIFIED_BY_HASH);
 		return EFI_SUCCESS;
 	} else {
 		LogError(L"check_db_hash(MokList, sha256hash) != DATA_FOUND\n");
 	}
-	if (cert && check_db_cert(L"MokList", SHIM_LOCK_GUID, cert, sha256hash)
-			== DATA_FOUND) {
-		verification_method = VERIFIED_BY_CERT;
-		update_verification_method(VERIFIED_BY_CERT);
-		return EFI_SUCCESS;
-	} else if (cert) {
-		LogError(L"check_db_cert(MokList, sha256hash) != DATA_FOUND\n");
-	}
 
 	update_verification_method(VERIFIED_BY_NOTHING);
 	return EFI_NOT_FOUND;
@@ -759,29 +937,163 @@ static BOOLEAN secure_mode (void)
 #define check_size(d,ds,h,hs) check_size_line(d,ds,h,hs,__LINE__)
 
 /*
- * Calculate the SHA1 and SHA256 hashes of a binary
+ * Everything about the layout of a PE file that the later stages need,
+ * worked out and checked once: the sections in file order, the byte
+ * ranges of the file that go into its Authenticode hash, the relocation
+ * section and the section holding the entry point.  The pointers are
+ * into the image headers the layout was built from, so those have to
+ * stay where they are while it's in use.
+ */
+struct hash_region {
+	UINTN offset;
+	UINTN size;
+};
+
+struct image_layout {
+	EFI_IMAGE_SECTION_HEADER **sections;	/* by PointerToRawData */
+	UINTN nsections;
+	struct hash_region *regions;		/* in the order they're hashed */
+	UINTN nregions;
+	EFI_IMAGE_SECTION_HEADER *RelocSection;
+	BOOLEAN extra_reloc;		/* a .reloc after RelocSection */
+	EFI_IMAGE_SECTION_HEADER *EntrySection;
+	UINTN entry_sections;		/* sections claiming the entry point */
+};
+
+static void image_layout_free(struct image_layout *layout)
+{
+	if (layout->sections)
+		FreePool(layout->sections);
+	if (layout->regions)
+		FreePool(layout->regions);
+	ZeroMem(layout, sizeof(*layout));
+}
+
+static void add_hash_region(struct image_layout *layout, UINTN offset,
+			    UINTN size)
+{
+	layout->regions[layout->nregions].offset = offset;
+	layout->regions[layout->nregions].size = size;
+	layout->nregions++;
+}
+
+typedef BOOLEAN (*section_order_t)(EFI_IMAGE_SECTION_HEADER *a,
+				   EFI_IMAGE_SECTION_HEADER *b);
+
+static BOOLEAN file_order(EFI_IMAGE_SECTION_HEADER *a,
+			  EFI_IMAGE_SECTION_HEADER *b)
+{
+	return a->PointerToRawData < b->PointerToRawData;
+}
+
+static BOOLEAN address_order(EFI_IMAGE_SECTION_HEADER *a,
+			     EFI_IMAGE_SECTION_HEADER *b)
+{
+	return a->VirtualAddress < b->VirtualAddress;
+}
+
+/*
+ * Merge sort n sections, using tmp (room for n more) as scratch space.
+ * It's stable, so sections that compare equal stay in header order,
+ * which is what the Authenticode hash expects.
+ */
+static void sort_sections(EFI_IMAGE_SECTION_HEADER **sections,
+			  EFI_IMAGE_SECTION_HEADER **tmp, UINTN n,
+			  section_order_t before)
+{
+	EFI_IMAGE_SECTION_HEADER **from = sections, **to = tmp, **swap;
+	UINTN width, lo, mid, hi, i, j, k;
+
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = min(lo + width, n);
+			hi = min(lo + 2 * width, n);
+			i = lo;
+			j = mid;
+			for (k = lo; k < hi; k++) {
+				if (i < mid && (j >= hi || !before(from[j], from[i])))
+					to[k] = from[i++];
+				else
+					to[k] = from[j++];
+			}
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != sections)
+		CopyMem(sections, from, n * sizeof(*sections));
+}
+
+/*
+ * Note the relocation section and the section the entry point is in.
+ * This only records what's there; check_sections() decides whether
+ * that's good enough to load.
  */
+static void find_special_sections(struct image_layout *layout,
+				  PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				  EFI_IMAGE_SECTION_HEADER *Section)
+{
+	UINT64 RelocBase, RelocEnd, base, end;
 
-static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
-				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
-				 UINT8 *sha256hash, UINT8 *sha1hash)
+	/* Don't look at discardable sections with zero size */
+	if ((Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE) &&
+	    !Section->Misc.VirtualSize)
+		return;
+
+	if (Section->VirtualAddress <= context->EntryPoint &&
+	    (Section->VirtualAddress + Section->SizeOfRawData - 1)
+	    > context->EntryPoint) {
+		layout->EntrySection = Section;
+		layout->entry_sections++;
+	}
+
+	if (CompareMem(Section->Name, ".reloc\0\0", 8) != 0)
+		return;
+	if (layout->RelocSection) {
+		layout->extra_reloc = TRUE;
+		return;
+	}
+
+	/*
+	 * If it has nonzero sizes, and it's inside the image, and the VA
+	 * and size match RelocDir's versions, then we believe in this
+	 * section table.  These are relative virtual addresses, so they're
+	 * checked against the image size, not the data size.
+	 */
+	RelocBase = context->RelocDir->VirtualAddress;
+	RelocEnd = (UINT32)(context->RelocDir->VirtualAddress +
+			    context->RelocDir->Size - 1);
+	base = Section->VirtualAddress;
+	end = (UINT32)(Section->VirtualAddress + Section->Misc.VirtualSize - 1);
+	if (Section->SizeOfRawData && Section->Misc.VirtualSize &&
+	    base <= context->ImageSize && end <= context->ImageSize &&
+	    base == RelocBase && end == RelocEnd)
+		layout->RelocSection = Section;
+}
 
+/*
+ * Work out the layout of an image.  data holds at least the image
+ * headers, and datasize is how much of it there is; filesize is the
+ * size of the whole file.
+ */
+static EFI_STATUS image_layout_init(struct image_layout *layout, char *data,
+				    unsigned int datasize,
+				    unsigned int filesize,
+				    PE_COFF_LOADER_IMAGE_CONTEXT *context)
 {
-	unsigned int sha256ctxsize, sha1ctxsize;
-	unsigned int size = datasize_in;
-	void *sha256ctx = NULL, *sha1ctx = NULL;
 	char *hashbase;
 	unsigned int hashsize;
 	unsigned int SumOfBytesHashed, SumOfSectionBytes;
-	unsigned int index, pos;
-	unsigned int datasize;
+	unsigned int index, nsections;
 	EFI_IMAGE_SECTION_HEADER  *Section;
-	EFI_IMAGE_SECTION_HEADER  *SectionHeader = NULL;
+	EFI_IMAGE_SECTION_HEADER **tmp = NULL;
 	EFI_STATUS efi_status = EFI_SUCCESS;
 	EFI_IMAGE_DOS_HEADER *DosHdr = (void *)data;
 	unsigned int PEHdr_offset = 0;
 
-	size = datasize = datasize_in;
+	ZeroMem(layout, sizeof(*layout));
 
 	if (datasize <= sizeof (*DosHdr) ||
 	    DosHdr->e_magic != EFI_IMAGE_DOS_SIGNATURE) {
@@ -789,20 +1101,15 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 		return EFI_INVALID_PARAMETER;
 	}
 	PEHdr_offset = DosHdr->e_lfanew;
-
-	sha256ctxsize = Sha256GetContextSize();
-	sha256ctx = AllocatePool(sha256ctxsize);
-
-	sha1ctxsize = Sha1GetContextSize();
-	sha1ctx = AllocatePool(sha1ctxsize);
-
-	if (!sha256ctx || !sha1ctx) {
-		perror(L"Unable to allocate memory for hash context\n");
-		return EFI_OUT_OF_RESOURCES;
-	}
-
-	if (!Sha256Init(sha256ctx) || !Sha1Init(sha1ctx)) {
-		perror(L"Unable to initialise hash\n");
+	nsections = context->PEHdr->Pe32.FileHeader.NumberOfSections;
+
+	layout->regions = AllocatePool(sizeof(*layout->regions) *
+				       (nsections + 4));
+	layout->sections = AllocatePool(sizeof(*layout->sections) *
+					(nsections + 1));
+	tmp = AllocatePool(sizeof(*tmp) * (nsections + 1));
+	if (!layout->regions || !layout->sections || !tmp) {
+		perror(L"Unable to allocate memory for image layout\n");
 		efi_status = EFI_OUT_OF_RESOURCES;
 		goto done;
 	}
@@ -811,51 +1118,32 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 	hashbase = data;
 	hashsize = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum -
 		hashbase;
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	check_size(data, datasize, hashbase, hashsize);
+	add_hash_region(layout, hashbase - data, hashsize);
 
 	/* Hash post-checksum to start of certificate table */
 	hashbase = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum +
 		sizeof (int);
 	hashsize = (char *)context->SecDir - hashbase;
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	check_size(data, datasize, hashbase, hashsize);
+	add_hash_region(layout, hashbase - data, hashsize);
 
 	/* Hash end of certificate table to end of image header */
 	EFI_IMAGE_DATA_DIRECTORY *dd = context->SecDir + 1;
 	hashbase = (char *)dd;
 	hashsize = context->SizeOfHeaders - (unsigned long)((char *)dd - data);
-	if (hashsize > datasize_in) {
+	if (hashsize > datasize) {
 		perror(L"Data Directory size %d is invalid\n", hashsize);
 		efi_status = EFI_INVALID_PARAMETER;
 		goto done;
 	}
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	check_size(data, datasize, hashbase, hashsize);
+	add_hash_region(layout, hashbase - data, hashsize);
 
-	/* Sort sections */
 	SumOfBytesHashed = context->SizeOfHeaders;
 
 	/* Validate section locations and sizes */
-	for (index = 0, SumOfSectionBytes = 0; index < context->PEHdr->Pe32.FileHeader.NumberOfSections; index++) {
+	for (index = 0, SumOfSectionBytes = 0; index < nsections; index++) {
 		EFI_IMAGE_SECTION_HEADER  *SectionPtr;
 
 		/* Validate SectionPtr is within image */
@@ -865,14 +1153,15 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 			sizeof (EFI_IMAGE_FILE_HEADER) +
 			context->PEHdr->Pe32.FileHeader.SizeOfOptionalHeader +
 			(index * sizeof(*SectionPtr)));
-		if (!SectionPtr) {
+		if (!SectionPtr ||
+		    (char *)(SectionPtr + 1) > data + datasize) {
 			perror(L"Malformed section %d\n", index);
 			efi_status = EFI_INVALID_PARAMETER;
 			goto done;
 		}
 		/* Validate section size is within image. */
 		if (SectionPtr->SizeOfRawData >
-		    datasize - SumOfBytesHashed - SumOfSectionBytes) {
+		    filesize - SumOfBytesHashed - SumOfSectionBytes) {
 			perror(L"Malformed section %d size\n", index);
 			efi_status = EFI_INVALID_PARAMETER;
 			goto done;
@@ -880,13 +1169,6 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 		SumOfSectionBytes += SectionPtr->SizeOfRawData;
 	}
 
-	SectionHeader = (EFI_IMAGE_SECTION_HEADER *) AllocateZeroPool (sizeof (EFI_IMAGE_SECTION_HEADER) * context->PEHdr->Pe32.FileHeader.NumberOfSections);
-	if (SectionHeader == NULL) {
-		perror(L"Unable to allocate section header\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
 	/* Already validated above */
 	Section = ImageAddress(data, datasize,
 		PEHdr_offset +
@@ -902,108 +1184,186 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 			+ context->PEHdr->Pe32.FileHeader.SizeOfOptionalHeader;
 		perror(L"Malformed file header.\n");
 		perror(L"Image address for Section 0 is 0x%016llx\n", addr);
-		perror(L"File size is 0x%016llx\n", datasize);
+		perror(L"File size is 0x%016llx\n", filesize);
 		efi_status = EFI_INVALID_PARAMETER;
 		goto done;
 	}
 
-	/* Sort the section headers */
-	for (index = 0; index < context->PEHdr->Pe32.FileHeader.NumberOfSections; index++) {
-		pos = index;
-		while ((pos > 0) && (Section->PointerToRawData < SectionHeader[pos - 1].PointerToRawData)) {
-			CopyMem (&SectionHeader[pos], &SectionHeader[pos - 1], sizeof (EFI_IMAGE_SECTION_HEADER));
-			pos--;
-		}
-		CopyMem (&SectionHeader[pos], Section, sizeof (EFI_IMAGE_SECTION_HEADER));
-		Section += 1;
-	}
+	for (index = 0; index < nsections; index++, Section++) {
+		if (Section->SizeOfRawData != 0) {
+			if (Section->PointerToRawData > filesize) {
+				perror(L"Malformed section header\n");
+				efi_status = EFI_INVALID_PARAMETER;
+				goto done;
+			}
 
-	/* Hash the sections */
-	for (index = 0; index < context->PEHdr->Pe32.FileHeader.NumberOfSections; index++) {
-		Section = &SectionHeader[index];
-		if (Section->SizeOfRawData == 0) {
-			continue;
+			/* Verify hashsize within image. */
+			if (Section->SizeOfRawData >
+			    filesize - Section->PointerToRawData) {
+				perror(L"Malformed section raw size %d\n",
+				       index);
+				efi_status = EFI_INVALID_PARAMETER;
+				goto done;
+			}
 		}
-		hashbase  = ImageAddress(data, size, Section->PointerToRawData);
 
-		if (!hashbase) {
-			perror(L"Malformed section header\n");
-			efi_status = EFI_INVALID_PARAMETER;
-			goto done;
-		}
+		find_special_sections(layout, context, Section);
+		layout->sections[layout->nsections++] = Section;
+	}
 
-		/* Verify hashsize within image. */
-		if (Section->SizeOfRawData >
-		    datasize - Section->PointerToRawData) {
-			perror(L"Malformed section raw size %d\n", index);
-			efi_status = EFI_INVALID_PARAMETER;
-			goto done;
-		}
-		hashsize  = (unsigned int) Section->SizeOfRawData;
-		check_size(data, datasize_in, hashbase, hashsize);
+	/*
+	 * The sections are hashed in the order their data appears in the
+	 * file, and that's also the order they're best read in.
+	 */
+	sort_sections(layout->sections, tmp, layout->nsections, file_order);
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+	for (index = 0; index < layout->nsections; index++) {
+		Section = layout->sections[index];
+		if (Section->SizeOfRawData == 0)
+			continue;
+		add_hash_region(layout, Section->PointerToRawData,
+				Section->SizeOfRawData);
 		SumOfBytesHashed += Section->SizeOfRawData;
 	}
 
 	/* Hash all remaining data up to SecDir if SecDir->Size is not 0 */
-	if (datasize > SumOfBytesHashed && context->SecDir->Size) {
-		hashbase = data + SumOfBytesHashed;
-		hashsize = datasize - context->SecDir->Size - SumOfBytesHashed;
+	if (filesize > SumOfBytesHashed && context->SecDir->Size) {
+		hashsize = filesize - context->SecDir->Size - SumOfBytesHashed;
 
-		if ((datasize - SumOfBytesHashed < context->SecDir->Size) ||
+		if ((filesize - SumOfBytesHashed < context->SecDir->Size) ||
 		    (SumOfBytesHashed + hashsize != context->SecDir->VirtualAddress)) {
 			perror(L"Malformed binary after Attribute Certificate Table\n");
 			console_print(L"datasize: %u SumOfBytesHashed: %u SecDir->Size: %lu\n",
-				      datasize, SumOfBytesHashed, context->SecDir->Size);
+				      filesize, SumOfBytesHashed, context->SecDir->Size);
 			console_print(L"hashsize: %u SecDir->VirtualAddress: 0x%08lx\n",
 				      hashsize, context->SecDir->VirtualAddress);
 			efi_status = EFI_INVALID_PARAMETER;
 			goto done;
 		}
-		check_size(data, datasize_in, hashbase, hashsize);
+		add_hash_region(layout, SumOfBytesHashed, hashsize);
+	}
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+done:
+	if (tmp)
+		FreePool(tmp);
+	if (EFI_ERROR(efi_status))
+		image_layout_free(layout);
+	return efi_status;
+}
+
+/*
+ * Whether the hash regions can be fed from a single front-to-back read
+ * of the file: they have to be in file order and must not overlap.
+ */
+static BOOLEAN image_layout_is_sequential(struct image_layout *layout)
+{
+	UINTN i;
+
+	for (i = 1; i < layout->nregions; i++) {
+		if (layout->regions[i].offset <
+		    layout->regions[i - 1].offset + layout->regions[i - 1].size)
+			return FALSE;
+	}
+	return TRUE;
+}
 
-#if 1
+/*
+ * The Authenticode hash of an image, computed as its file is fed in, all
+ * at once or as it's read.
+ */
+struct image_hash {
+	struct image_layout *layout;
+	UINTN next;		/* first region not completely hashed */
+	UINTN done;		/* bytes of regions[next] already hashed */
+	void *hashctx;
+};
+
+static void image_hash_free(struct image_hash *ih)
+{
+	if (ih->hashctx)
+		FreePool(ih->hashctx);
+	ZeroMem(ih, sizeof(*ih));
+}
+
+static EFI_STATUS image_hash_init(struct image_hash *ih,
+				  struct image_layout *layout)
+{
+	ZeroMem(ih, sizeof(*ih));
+	ih->layout = layout;
+
+	/*
+	 * Both digests are computed in a single pass over the image, so
+	 * each region only has to be pulled through the cache once.
+	 */
+	ih->hashctx = AllocatePool(MultiHashGetContextSize());
+	if (!ih->hashctx) {
+		perror(L"Unable to allocate memory for hash context\n");
+		return EFI_OUT_OF_RESOURCES;
 	}
-#else // we have to migrate to doing this later :/
-		SumOfBytesHashed += hashsize;
+
+	if (!MultiHashInit(ih->hashctx, MULTI_HASH_SHA1 | MULTI_HASH_SHA256)) {
+		perror(L"Unable to initialise hash\n");
+		image_hash_free(ih);
+		return EFI_OUT_OF_RESOURCES;
 	}
 
-	/* Hash all remaining data */
-	if (datasize > SumOfBytesHashed) {
-		hashbase = data + SumOfBytesHashed;
-		hashsize = datasize - SumOfBytesHashed;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Hash whatever parts of the hash regions fall in the size bytes of the
+ * file at offset.  Everything before offset has to have been passed in
+ * already.
+ */
+static EFI_STATUS image_hash_update(struct image_hash *ih, UINTN offset,
+				    char *data, UINTN size)
+{
+	EFI_STATUS efi_status = EFI_SUCCESS;
+	UINT64 perf_start_time = perf_start();
+	UINTN hashed = 0;
+
+	while (ih->next < ih->layout->nregions) {
+		struct hash_region *r = &ih->layout->regions[ih->next];
+		UINTN start = r->offset + ih->done;
+		UINTN len;
 
-		check_size(data, datasize_in, hashbase, hashsize);
+		if (start < offset) {
+			perror(L"Hash region at 0x%lx was skipped\n", start);
+			efi_status = EFI_INVALID_PARAMETER;
+			break;
+		}
+		if (start >= offset + size)
+			break;
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
+		len = min(r->size - ih->done, offset + size - start);
+		if (!MultiHashUpdate(ih->hashctx, data + (start - offset), len)) {
 			perror(L"Unable to generate hash\n");
 			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
+			break;
 		}
+		hashed += len;
+		ih->done += len;
+		if (ih->done == r->size) {
+			ih->next++;
+			ih->done = 0;
+		}
+	}
+
+	perf_stop(PERF_HASH_UPDATE, perf_start_time, hashed);
+	return efi_status;
+}
 
-		SumOfBytesHashed += hashsize;
+static EFI_STATUS image_hash_final(struct image_hash *ih,
+				   UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	if (ih->next != ih->layout->nregions) {
+		perror(L"Image ended before it was completely hashed\n");
+		return EFI_INVALID_PARAMETER;
 	}
-#endif
 
-	if (!(Sha256Final(sha256ctx, sha256hash)) ||
-	    !(Sha1Final(sha1ctx, sha1hash))) {
+	if (!(MultiHashFinal(ih->hashctx, sha1hash, sha256hash))) {
 		perror(L"Unable to finalise hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
+		return EFI_OUT_OF_RESOURCES;
 	}
 
 	dprint(L"sha1 authenticode hash:\n");
@@ -1011,196 +1371,301 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 	dprint(L"sha256 authenticode hash:\n");
 	dhexdumpat(sha256hash, SHA256_DIGEST_SIZE, 0);
 
-done:
-	if (SectionHeader)
-		FreePool(SectionHeader);
-	if (sha1ctx)
-		FreePool(sha1ctx);
-	if (sha256ctx)
-		FreePool(sha256ctx);
+	return EFI_SUCCESS;
+}
 
-	return efi_status;
+/*
+ * One digest of all of an image's hash regions, worked out on whichever
+ * processor is given it.  This can run on an AP, so it mustn't use boot
+ * services, perror() included.
+ */
+struct region_hash {
+	struct image_layout *layout;
+	char *data;
+	VOID *hashctx;
+	BOOLEAN ok;
+};
+
+static void hash_regions(void *arg)
+{
+	struct region_hash *rh = arg;
+	struct hash_region *r;
+	UINTN i;
+
+	rh->ok = TRUE;
+	for (i = 0; i < rh->layout->nregions && rh->ok; i++) {
+		r = &rh->layout->regions[i];
+		rh->ok = MultiHashUpdate(rh->hashctx, rh->data + r->offset,
+					 r->size);
+	}
 }
 
-static EFI_STATUS
-verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
-		     UINT8 *sha256hash, UINT8 *sha1hash)
+/*
+ * What the other processor works on.  It's allocated rather than on our
+ * stack, so that if the processor never finishes it can be left to it.
+ */
+struct region_hash_task {
+	struct mp_task task;
+	struct region_hash rh;
+};
+
+/*
+ * Hash an image with the SHA-1 digest done on another processor while
+ * this one does SHA-256.  Authenticode needs each digest taken in order,
+ * but the two are independent of each other.  Returns EFI_UNSUPPORTED,
+ * without having done anything, if no other processor can be had.
+ */
+static EFI_STATUS hash_image_mp(char *data, unsigned int datasize,
+				struct image_layout *layout,
+				UINT8 *sha256hash, UINT8 *sha1hash)
 {
-	EFI_STATUS efi_status;
+	struct region_hash_task *ap = NULL;
+	struct region_hash sha256;
+	EFI_STATUS efi_status = EFI_UNSUPPORTED;
+	UINTN i;
 
-	/*
-	 * Ensure that the binary isn't blacklisted
-	 */
-	drain_openssl_errors();
-	efi_status = check_blacklist(sig, sha256hash, sha1hash);
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Binary is blacklisted: %r\n", efi_status);
-		PrintErrors();
-		ClearErrors();
-		crypterr(efi_status);
-		return efi_status;
+	if (!mp_available())
+		return EFI_UNSUPPORTED;
+
+	for (i = 0; i < layout->nregions; i++) {
+		if (layout->regions[i].offset > datasize ||
+		    layout->regions[i].size > datasize - layout->regions[i].offset)
+			return EFI_UNSUPPORTED;
 	}
 
-	/*
-	 * Check whether the binary is whitelisted in any of the firmware
-	 * databases
-	 */
-	drain_openssl_errors();
-	efi_status = check_whitelist(sig, sha256hash, sha1hash);
+	ZeroMem(&sha256, sizeof(sha256));
+	sha256.layout = layout;
+	sha256.data = data;
+	sha256.hashctx = AllocatePool(MultiHashGetContextSize());
+	ap = AllocateZeroPool(sizeof(*ap));
+	if (!sha256.hashctx || !ap)
+		goto done;
+	ap->rh.layout = layout;
+	ap->rh.data = data;
+	ap->rh.hashctx = AllocatePool(MultiHashGetContextSize());
+	if (!ap->rh.hashctx ||
+	    !MultiHashInit(ap->rh.hashctx, MULTI_HASH_SHA1) ||
+	    !MultiHashInit(sha256.hashctx, MULTI_HASH_SHA256))
+		goto done;
+
+	efi_status = mp_start(&ap->task, hash_regions, &ap->rh);
+	if (EFI_ERROR(efi_status))
+		goto done;
+	hash_regions(&sha256);
+	efi_status = mp_wait(&ap->task);
 	if (EFI_ERROR(efi_status)) {
-		if (efi_status != EFI_NOT_FOUND) {
-			dprint(L"check_whitelist(): %r\n", efi_status);
-			PrintErrors();
-			ClearErrors();
-			crypterr(efi_status);
-		}
-	} else {
-		drain_openssl_errors();
-		return efi_status;
+		/*
+		 * The other processor may yet write to its task and hash
+		 * context, so they're never freed.  Nor can we just hash
+		 * it here instead; it has to fail.
+		 */
+		perror(L"Unable to generate hash: %r\n", efi_status);
+		ap = NULL;
+		efi_status = EFI_ABORTED;
+		goto done;
 	}
 
-	efi_status = EFI_NOT_FOUND;
-#if defined(ENABLE_SHIM_CERT)
-	/*
-	 * Check against the shim build key
-	 */
-	drain_openssl_errors();
-	if (build_cert && build_cert_size) {
-		dprint("verifying against shim cert\n");
-	}
-	if (build_cert && build_cert_size &&
-	    AuthenticodeVerify(sig->CertData,
-		       sig->Hdr.dwLength - sizeof(sig->Hdr),
-		       build_cert, build_cert_size, sha256hash,
-		       SHA256_DIGEST_SIZE)) {
-		dprint(L"AuthenticodeVerify(shim_cert) succeeded\n");
-		update_verification_method(VERIFIED_BY_CERT);
-		tpm_measure_variable(L"Shim", SHIM_LOCK_GUID,
-				     build_cert_size, build_cert);
-		efi_status = EFI_SUCCESS;
-		drain_openssl_errors();
-		return efi_status;
-	} else {
-		dprint(L"AuthenticodeVerify(shim_cert) failed\n");
-		PrintErrors();
-		ClearErrors();
-		crypterr(EFI_NOT_FOUND);
+	if (!ap->rh.ok || !sha256.ok ||
+	    !MultiHashFinal(ap->rh.hashctx, sha1hash, NULL) ||
+	    !MultiHashFinal(sha256.hashctx, NULL, sha256hash)) {
+		perror(L"Unable to generate hash\n");
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto done;
 	}
-#endif /* defined(ENABLE_SHIM_CERT) */
 
-#if defined(VENDOR_CERT_FILE)
-	/*
-	 * And finally, check against shim's built-in key
-	 */
-	drain_openssl_errors();
-	if (vendor_cert_size) {
-		dprint("verifying against vendor_cert\n");
+	dprint(L"sha1 authenticode hash:\n");
+	dhexdumpat(sha1hash, SHA1_DIGEST_SIZE, 0);
+	dprint(L"sha256 authenticode hash:\n");
+	dhexdumpat(sha256hash, SHA256_DIGEST_SIZE, 0);
+
+done:
+	if (ap) {
+		if (ap->rh.hashctx)
+			FreePool(ap->rh.hashctx);
+		FreePool(ap);
 	}
-	if (vendor_cert_size &&
-	    AuthenticodeVerify(sig->CertData,
-			       sig->Hdr.dwLength - sizeof(sig->Hdr),
-			       vendor_cert, vendor_cert_size,
-			       sha256hash, SHA256_DIGEST_SIZE)) {
-		dprint(L"AuthenticodeVerify(vendor_cert) succeeded\n");
-		update_verification_method(VERIFIED_BY_CERT);
-		tpm_measure_variable(L"Shim", SHIM_LOCK_GUID,
-				     vendor_cert_size, vendor_cert);
-		efi_status = EFI_SUCCESS;
-		drain_openssl_errors();
+	if (sha256.hashctx)
+		FreePool(sha256.hashctx);
+	return efi_status;
+}
+
+/*
+ * Calculate the SHA1 and SHA256 hashes of a binary whose layout is known
+ */
+static EFI_STATUS hash_image(char *data, unsigned int datasize,
+			     struct image_layout *layout,
+			     UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	struct image_hash ih;
+	EFI_STATUS efi_status;
+	UINT64 perf_start_time = perf_start();
+
+	efi_status = hash_image_mp(data, datasize, layout, sha256hash,
+				   sha1hash);
+	if (efi_status != EFI_UNSUPPORTED) {
+		perf_stop(PERF_GENERATE_HASH, perf_start_time, datasize);
 		return efi_status;
-	} else {
-		dprint(L"AuthenticodeVerify(vendor_cert) failed\n");
-		PrintErrors();
-		ClearErrors();
-		crypterr(EFI_NOT_FOUND);
 	}
-#endif /* defined(VENDOR_CERT_FILE) */
 
+	efi_status = image_hash_init(&ih, layout);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = image_hash_update(&ih, 0, data, datasize);
+	if (!EFI_ERROR(efi_status))
+		efi_status = image_hash_final(&ih, sha256hash, sha1hash);
+
+	image_hash_free(&ih);
+	perf_stop(PERF_GENERATE_HASH, perf_start_time, datasize);
 	return efi_status;
 }
 
 /*
- * Check that the signature is valid and matches the binary
+ * Calculate the SHA1 and SHA256 hashes of a binary
  */
-static EFI_STATUS verify_buffer (char *data, int datasize,
+
+static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
 				 UINT8 *sha256hash, UINT8 *sha1hash)
+
 {
-	EFI_STATUS ret_efi_status;
-	size_t size = datasize;
-	size_t offset = 0;
-	unsigned int i = 0;
+	struct image_layout layout;
+	EFI_STATUS efi_status;
 
-	if (datasize < 0)
-		return EFI_INVALID_PARAMETER;
+	efi_status = image_layout_init(&layout, data, datasize_in,
+				       datasize_in, context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
 
-	/*
-	 * Clear OpenSSL's error log, because we get some DSO unimplemented
-	 * errors during its intialization, and we don't want those to look
-	 * like they're the reason for validation failures.
-	 */
-	drain_openssl_errors();
+	efi_status = hash_image(data, datasize_in, &layout, sha256hash,
+				sha1hash);
 
-	ret_efi_status = generate_hash(data, datasize, context, sha256hash, sha1hash);
-	if (EFI_ERROR(ret_efi_status)) {
-		dprint(L"generate_hash: %r\n", ret_efi_status);
-		PrintErrors();
-		ClearErrors();
-		crypterr(ret_efi_status);
-		return ret_efi_status;
-	}
+	image_layout_free(&layout);
+	return efi_status;
+}
 
-	/*
-	 * Ensure that the binary isn't blacklisted by hash
-	 */
-	drain_openssl_errors();
-	ret_efi_status = check_blacklist(NULL, sha256hash, sha1hash);
-	if (EFI_ERROR(ret_efi_status)) {
-		perror(L"Binary is blacklisted\n");
-		dprint(L"Binary is blacklisted: %r\n", ret_efi_status);
-		PrintErrors();
-		ClearErrors();
-		crypterr(ret_efi_status);
-		return ret_efi_status;
-	}
+/*
+ * The places a signature can be trusted from, in the order they're
+ * tried.  Nearly everything we boot is signed by the vendor key, so
+ * that goes first; the firmware and MOK databases follow in their
+ * usual order.
+ */
+typedef enum {
+	TRUST_VENDOR_CERT,
+	TRUST_DB,
+	TRUST_VENDOR_DB,
+	TRUST_MOKLIST,
+	TRUST_BUILD_CERT,
+	TRUST_MAX
+} trust_source_t;
+
+static BOOLEAN check_trust_source(trust_source_t source,
+				  struct signature *sig, UINT8 *sha256hash)
+{
+	switch (source) {
+	case TRUST_VENDOR_CERT:
+#if defined(VENDOR_CERT_FILE)
+		if (!vendor_cert_size)
+			return FALSE;
+		dprint("verifying against vendor_cert\n");
+		if (verify_with_anchor(sig, sha256hash,
+				       builtin_anchor(&vendor_cert_anchor,
+						      vendor_cert,
+						      vendor_cert_size))) {
+			dprint(L"AuthenticodeVerify(vendor_cert) succeeded\n");
+			update_verification_method(VERIFIED_BY_CERT);
+			measure_authority(L"Shim", SHIM_LOCK_GUID,
+					  vendor_cert_size, vendor_cert);
+			return TRUE;
+		}
+		dprint(L"AuthenticodeVerify(vendor_cert) failed\n");
+#endif /* defined(VENDOR_CERT_FILE) */
+		return FALSE;
 
-	/*
-	 * Check whether the binary is whitelisted by hash in any of the
-	 * firmware databases
-	 */
-	drain_openssl_errors();
-	ret_efi_status = check_whitelist(NULL, sha256hash, sha1hash);
-	if (EFI_ERROR(ret_efi_status)) {
-		dprint(L"check_whitelist: %r\n", ret_efi_status);
-		if (ret_efi_status != EFI_NOT_FOUND) {
-			dprint(L"check_whitelist(): %r\n", ret_efi_status);
-			PrintErrors();
-			ClearErrors();
-			crypterr(ret_efi_status);
-			return ret_efi_status;
+	case TRUST_DB:
+		if (ignore_db)
+			return FALSE;
+		if (check_db_cert(SIGDB_DB, sig, sha256hash) == DATA_FOUND) {
+			verification_method = VERIFIED_BY_CERT;
+			update_verification_method(VERIFIED_BY_CERT);
+			return TRUE;
 		}
-	} else {
-		drain_openssl_errors();
-		return ret_efi_status;
-	}
+		LogError(L"check_db_cert(db, sha256hash) != DATA_FOUND\n");
+		return FALSE;
 
-	if (context->SecDir->Size == 0) {
-		dprint(L"No signatures found\n");
-		return EFI_SECURITY_VIOLATION;
-	}
+	case TRUST_VENDOR_DB:
+#if defined(VENDOR_DB_FILE)
+		if (check_db_cert(SIGDB_VENDOR_DB, sig, sha256hash)
+				== DATA_FOUND) {
+			verification_method = VERIFIED_BY_CERT;
+			update_verification_method(VERIFIED_BY_CERT);
+			return TRUE;
+		}
+		LogError(L"check_db_cert(vendor_db, sha256hash) != DATA_FOUND\n");
+#endif
+		return FALSE;
 
-	if (context->SecDir->Size >= size) {
-		perror(L"Certificate Database size is too large\n");
-		return EFI_INVALID_PARAMETER;
+	case TRUST_MOKLIST:
+		if (check_db_cert(SIGDB_MOK, sig, sha256hash) == DATA_FOUND) {
+			verification_method = VERIFIED_BY_CERT;
+			update_verification_method(VERIFIED_BY_CERT);
+			return TRUE;
+		}
+		LogError(L"check_db_cert(MokList, sha256hash) != DATA_FOUND\n");
+		return FALSE;
+
+	case TRUST_BUILD_CERT:
+#if defined(ENABLE_SHIM_CERT)
+		if (!build_cert || !build_cert_size)
+			return FALSE;
+		dprint("verifying against shim cert\n");
+		if (verify_with_anchor(sig, sha256hash,
+				       builtin_anchor(&build_cert_anchor,
+						      build_cert,
+						      build_cert_size))) {
+			dprint(L"AuthenticodeVerify(shim_cert) succeeded\n");
+			update_verification_method(VERIFIED_BY_CERT);
+			measure_authority(L"Shim", SHIM_LOCK_GUID,
+					  build_cert_size, build_cert);
+			return TRUE;
+		}
+		dprint(L"AuthenticodeVerify(shim_cert) failed\n");
+#endif /* defined(ENABLE_SHIM_CERT) */
+		return FALSE;
+
+	default:
+		return FALSE;
 	}
+}
+
+static void free_signatures(struct signature *sigs, UINTN nsigs)
+{
+	UINTN i;
+
+	for (i = 0; i < nsigs; i++)
+		free_signature(&sigs[i]);
+	if (sigs)
+		FreePool(sigs);
+}
+
+/*
+ * Gather the PKCS#7 signatures from the security directory, parsing
+ * each one once.  Byte-for-byte duplicates are dropped; they can't
+ * verify any differently than the first copy did.
+ */
+static EFI_STATUS collect_signatures(char *certs,
+				     PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				     struct signature **sigsp, UINTN *nsigsp)
+{
+	struct signature *sigs = NULL, *newsigs;
+	UINTN nsigs = 0, i;
+	size_t offset = 0;
 
-	ret_efi_status = EFI_NOT_FOUND;
 	do {
 		WIN_CERTIFICATE_EFI_PKCS *sig = NULL;
 		size_t sz;
 
-		sig = ImageAddress(data, size,
-				   context->SecDir->VirtualAddress + offset);
+		sig = ImageAddress(certs, context->SecDir->Size, offset);
 		if (!sig)
 			break;
 
@@ -1208,37 +1673,50 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 		     + sizeof(sig->Hdr.dwLength);
 		if (sz > context->SecDir->Size) {
 			perror(L"Certificate size is too large for secruity database");
-			return EFI_INVALID_PARAMETER;
+			goto invalid;
 		}
 
 		sz = sig->Hdr.dwLength;
 		if (sz > context->SecDir->Size - offset) {
 			perror(L"Certificate size is too large for secruity database");
-			return EFI_INVALID_PARAMETER;
+			goto invalid;
 		}
 
 		if (sz < sizeof(sig->Hdr)) {
 			perror(L"Certificate size is too small for certificate data");
-			return EFI_INVALID_PARAMETER;
+			goto invalid;
 		}
 
 		if (sig->Hdr.wCertificateType == WIN_CERT_TYPE_PKCS_SIGNED_DATA) {
-			EFI_STATUS efi_status;
-
-			dprint(L"Attempting to verify signature %d:\n", i++);
-
-			efi_status = verify_one_signature(sig, sha256hash, sha1hash);
-
-			/*
-			 * If we didn't get EFI_SECURITY_VIOLATION from
-			 * checking the hashes above, then any dbx entries are
-			 * for a certificate, not this individual binary.
-			 *
-			 * So don't clobber successes with security violation
-			 * here; that just means it isn't a success.
-			 */
-			if (ret_efi_status != EFI_SUCCESS)
-				ret_efi_status = efi_status;
+			for (i = 0; i < nsigs; i++) {
+				if (sigs[i].data->Hdr.dwLength == sz &&
+				    CompareMem(sigs[i].data, sig, sz) == 0)
+					break;
+			}
+			if (i < nsigs) {
+				dprint(L"Skipping duplicate of signature %lu\n",
+				       i);
+			} else {
+				/*
+				 * Not ReallocatePool(), which frees the old
+				 * array even when it fails, and we still need
+				 * it to free the signatures in it.
+				 */
+				newsigs = AllocatePool((nsigs + 1) *
+						       sizeof(*sigs));
+				if (!newsigs) {
+					free_signatures(sigs, nsigs);
+					return EFI_OUT_OF_RESOURCES;
+				}
+				if (sigs) {
+					CopyMem(newsigs, sigs,
+						nsigs * sizeof(*sigs));
+					FreePool(sigs);
+				}
+				sigs = newsigs;
+				ZeroMem(&sigs[nsigs], sizeof(*sigs));
+				parse_signature(&sigs[nsigs++], sig);
+			}
 		} else {
 			perror(L"Unsupported certificate type %x\n",
 				sig->Hdr.wCertificateType);
@@ -1246,12 +1724,161 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 		offset = ALIGN_VALUE(offset + sz, 8);
 	} while (offset < context->SecDir->Size);
 
+	*sigsp = sigs;
+	*nsigsp = nsigs;
+	return EFI_SUCCESS;
+
+invalid:
+	free_signatures(sigs, nsigs);
+	return EFI_INVALID_PARAMETER;
+}
+
+/*
+ * Check that the signature is valid and matches the binary
+ *
+ * The image's Authenticode hashes have already been computed; certs is
+ * its certificate table, as described by context->SecDir, and size is
+ * the size of the whole file.
+ *
+ * The cheap checks go first: the hash lookups are done exactly once,
+ * then each distinct signature is checked against the certificate
+ * blacklists, and only then do we start the full chain verifications,
+ * most likely trust source first, stopping at the first one that works.
+ */
+static EFI_STATUS verify_signatures (char *certs, size_t size,
+				     PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				     UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	EFI_STATUS ret_efi_status;
+	struct signature *sigs = NULL;
+	UINTN nsigs = 0, nusable = 0, i;
+	trust_source_t source;
+	verification_method_t method;
+	UINT8 cachekey[SHA256_DIGEST_SIZE];
+	BOOLEAN cached;
+
+	/*
+	 * Clear OpenSSL's error log, because we get some DSO unimplemented
+	 * errors during its intialization, and we don't want those to look
+	 * like they're the reason for validation failures.
+	 */
+	drain_openssl_errors();
+
+	/*
+	 * Ensure that the binary isn't blacklisted by hash
+	 */
+	ret_efi_status = check_blacklist(sha256hash, sha1hash);
+	if (EFI_ERROR(ret_efi_status)) {
+		perror(L"Binary is blacklisted\n");
+		dprint(L"Binary is blacklisted: %r\n", ret_efi_status);
+		PrintErrors();
+		ClearErrors();
+		crypterr(ret_efi_status);
+		return ret_efi_status;
+	}
+
+	/*
+	 * Check whether the binary is whitelisted by hash in any of the
+	 * firmware databases
+	 */
+	drain_openssl_errors();
+	ret_efi_status = check_whitelist(sha256hash, sha1hash);
+	if (EFI_ERROR(ret_efi_status)) {
+		dprint(L"check_whitelist: %r\n", ret_efi_status);
+		if (ret_efi_status != EFI_NOT_FOUND) {
+			dprint(L"check_whitelist(): %r\n", ret_efi_status);
+			PrintErrors();
+			ClearErrors();
+			crypterr(ret_efi_status);
+			return ret_efi_status;
+		}
+	} else {
+		drain_openssl_errors();
+		return ret_efi_status;
+	}
+
+	if (context->SecDir->Size == 0) {
+		dprint(L"No signatures found\n");
+		return EFI_SECURITY_VIOLATION;
+	}
+
+	if (context->SecDir->Size >= size ||
+	    context->SecDir->VirtualAddress > size - context->SecDir->Size) {
+		perror(L"Certificate Database size is too large\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/*
+	 * If we've already let this exact image, signatures and all,
+	 * through since the databases were last loaded, it goes through
+	 * again; the certificate that authorized it is measured as it
+	 * was the first time.
+	 */
+	cached = verify_cache_key(sha256hash, certs, context->SecDir->Size,
+				  cachekey);
+	if (cached && verify_cache_lookup(cachekey, &method, &authority)) {
+		dprint(L"Image was already verified\n");
+		if (authority.cert)
+			tpm_measure_variable(authority.name, authority.guid,
+					     authority.size, authority.cert);
+		update_verification_method(method);
+		drain_openssl_errors();
+		return EFI_SUCCESS;
+	}
+
+	ret_efi_status = collect_signatures(certs, context, &sigs, &nsigs);
+	if (EFI_ERROR(ret_efi_status))
+		return ret_efi_status;
+
+	/*
+	 * A signature from a blacklisted certificate can't be the one that
+	 * lets the image through, but another signature still can.
+	 */
+	for (i = 0; i < nsigs; i++) {
+		EFI_STATUS efi_status;
+
+		dprint(L"Checking signature %lu against the blacklists\n", i);
+		drain_openssl_errors();
+		efi_status = check_blacklist_cert(&sigs[i], sha256hash);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Binary is blacklisted: %r\n", efi_status);
+			PrintErrors();
+			ClearErrors();
+			crypterr(efi_status);
+			sigs[i].blacklisted = TRUE;
+			continue;
+		}
+		nusable++;
+	}
+
+	ZeroMem(&authority, sizeof(authority));
+	ret_efi_status = EFI_NOT_FOUND;
+	for (source = 0; nusable > 0 && source < TRUST_MAX; source++) {
+		for (i = 0; i < nsigs; i++) {
+			if (sigs[i].blacklisted)
+				continue;
+
+			dprint(L"Attempting to verify signature %lu:\n", i);
+			drain_openssl_errors();
+			if (check_trust_source(source, &sigs[i], sha256hash)) {
+				ret_efi_status = EFI_SUCCESS;
+				goto done;
+			}
+		}
+	}
+
+done:
+	free_signatures(sigs, nsigs);
+
 	if (ret_efi_status != EFI_SUCCESS) {
 		dprint(L"Binary is not whitelisted\n");
 		PrintErrors();
 		ClearErrors();
 		crypterr(EFI_SECURITY_VIOLATION);
 		ret_efi_status = EFI_SECURITY_VIOLATION;
+	} else if (cached) {
+		/* every trust source is a certificate */
+		verify_cache_record(cachekey, VERIFIED_BY_CERT, &authority);
 	}
 	drain_openssl_errors();
 	return ret_efi_status;
@@ -1259,9 +1886,12 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 
 /*
  * Read the binary header and grab appropriate information from it
+ *
+ * data holds the first datasize bytes of a file filesize bytes long.
  */
-static EFI_STATUS read_header(void *data, unsigned int datasize,
-			      PE_COFF_LOADER_IMAGE_CONTEXT *context)
+static EFI_STATUS parse_header(void *data, unsigned int datasize,
+			       unsigned int filesize,
+			       PE_COFF_LOADER_IMAGE_CONTEXT *context)
 {
 	EFI_IMAGE_DOS_HEADER *DosHdr = data;
 	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr = data;
@@ -1381,8 +2011,8 @@ static EFI_STATUS read_header(void *data, unsigned int datasize,
 		return EFI_UNSUPPORTED;
 	}
 
-	if (context->SecDir->VirtualAddress > datasize ||
-	    (context->SecDir->VirtualAddress == datasize &&
+	if (context->SecDir->VirtualAddress > filesize ||
+	    (context->SecDir->VirtualAddress == filesize &&
 	     context->SecDir->Size > 0)) {
 		perror(L"Malformed security header\n");
 		return EFI_INVALID_PARAMETER;
@@ -1390,71 +2020,21 @@ static EFI_STATUS read_header(void *data, unsigned int datasize,
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS read_header(void *data, unsigned int datasize,
+			      PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	return parse_header(data, datasize, datasize, context);
+}
+
 /*
- * Once the image has been loaded it needs to be validated and relocated
+ * Allocate the memory an image will be loaded into
  */
-static EFI_STATUS handle_image (void *data, unsigned int datasize,
-				EFI_LOADED_IMAGE *li,
-				EFI_IMAGE_ENTRY_POINT *entry_point,
-				EFI_PHYSICAL_ADDRESS *alloc_address,
-				UINTN *alloc_pages)
+static EFI_STATUS allocate_image(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				 EFI_PHYSICAL_ADDRESS *alloc_address,
+				 UINTN *alloc_pages, char **buffer)
 {
 	EFI_STATUS efi_status;
-	char *buffer;
-	int i;
-	EFI_IMAGE_SECTION_HEADER *Section;
-	char *base, *end;
-	PE_COFF_LOADER_IMAGE_CONTEXT context;
 	unsigned int alignment, alloc_size;
-	int found_entry_point = 0;
-	UINT8 sha1hash[SHA1_DIGEST_SIZE];
-	UINT8 sha256hash[SHA256_DIGEST_SIZE];
-
-	/*
-	 * The binary header contains relevant context and section pointers
-	 */
-	efi_status = read_header(data, datasize, &context);
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Failed to read header: %r\n", efi_status);
-		return efi_status;
-	}
-
-	/*
-	 * We only need to verify the binary if we're in secure mode
-	 */
-	efi_status = generate_hash(data, datasize, &context, sha256hash,
-				   sha1hash);
-	if (EFI_ERROR(efi_status))
-		return efi_status;
-
-	/* Measure the binary into the TPM */
-#ifdef REQUIRE_TPM
-	efi_status =
-#endif
-	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)data, datasize,
-		   (EFI_PHYSICAL_ADDRESS)(UINTN)context.ImageAddress,
-		   li->FilePath, sha1hash, 4);
-#ifdef REQUIRE_TPM
-	if (efi_status != EFI_SUCCESS) {
-		return efi_status;
-	}
-#endif
-
-	if (secure_mode ()) {
-		efi_status = verify_buffer(data, datasize, &context,
-					   sha256hash, sha1hash);
-
-		if (EFI_ERROR(efi_status)) {
-			if (verbose)
-				console_print(L"Verification failed: %r\n", efi_status);
-			else
-				console_error(L"Verification failed", efi_status);
-			return efi_status;
-		} else {
-			if (verbose)
-				console_print(L"Verification succeeded\n");
-		}
-	}
 
 	/* The spec says, uselessly, of SectionAlignment:
 	 * =====
@@ -1470,176 +2050,1692 @@ static EFI_STATUS handle_image (void *data, unsigned int datasize,
 	 *
 	 * We only support one page size, so if it's zero, nerf it to 4096.
 	 */
-	alignment = context.SectionAlignment;
+	alignment = context->SectionAlignment;
 	if (!alignment)
 		alignment = 4096;
 
-	alloc_size = ALIGN_VALUE(context.ImageSize + context.SectionAlignment,
+	alloc_size = ALIGN_VALUE(context->ImageSize + context->SectionAlignment,
 				 PAGE_SIZE);
 	*alloc_pages = alloc_size / PAGE_SIZE;
 
-	efi_status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
-					*alloc_pages, alloc_address);
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Failed to allocate image buffer\n");
+	efi_status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
+					*alloc_pages, alloc_address);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Failed to allocate image buffer\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	perf_mem_alloc(*alloc_pages * PAGE_SIZE);
+
+	*buffer = (void *)ALIGN_VALUE((unsigned long)*alloc_address, alignment);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Sections that take up room in the loaded image; everything else is
+ * only there to be hashed, or in .reloc's case, to be read once.
+ */
+static BOOLEAN section_is_loaded(EFI_IMAGE_SECTION_HEADER *Section)
+{
+	return !(Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE);
+}
+
+/*
+ * Check that every section fits where it's meant to go in the image
+ * loaded at buffer, and that the layout has what loading it needs
+ */
+static EFI_STATUS check_sections(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				 struct image_layout *layout, char *buffer)
+{
+	EFI_IMAGE_SECTION_HEADER *Section;
+	char *base, *end;
+	int i;
+
+	Section = context->FirstSection;
+	for (i = 0; i < context->NumberOfSections; i++, Section++) {
+		/* Don't try to copy discardable sections with zero size */
+		if ((Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE) &&
+		    !Section->Misc.VirtualSize)
+			continue;
+
+		base = ImageAddress (buffer, context->ImageSize,
+				     Section->VirtualAddress);
+		end = ImageAddress (buffer, context->ImageSize,
+				    Section->VirtualAddress
+				     + Section->Misc.VirtualSize - 1);
+
+		if (end < base) {
+			perror(L"Section %d has negative size\n", i);
+			return EFI_UNSUPPORTED;
+		}
+
+		/* We do want to process .reloc, but it's often marked
+		 * discardable, so we don't want to memcpy it. */
+		if (!section_is_loaded(Section))
+			continue;
+
+		if (!base) {
+			perror(L"Section %d has invalid base address\n", i);
+			return EFI_UNSUPPORTED;
+		}
+		if (!end) {
+			perror(L"Section %d has zero size\n", i);
+			return EFI_UNSUPPORTED;
+		}
+
+		if (!(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) &&
+		    (Section->VirtualAddress < context->SizeOfHeaders ||
+		     Section->PointerToRawData < context->SizeOfHeaders)) {
+			perror(L"Section %d is inside image headers\n", i);
+			return EFI_UNSUPPORTED;
+		}
+	}
+
+	if (layout->extra_reloc) {
+		perror(L"Image has multiple relocation sections\n");
+		return EFI_UNSUPPORTED;
+	}
+	if (!layout->entry_sections) {
+		perror(L"Entry point is not within sections\n");
+		return EFI_UNSUPPORTED;
+	}
+	if (layout->entry_sections > 1) {
+		perror(L"%lu sections contain entry point\n",
+		       layout->entry_sections);
+		return EFI_UNSUPPORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Copy the executable's sections to their desired offsets, and zero
+ * whatever part of them isn't in the file.  If data is NULL, the data
+ * from the file has already been put in place and only the zeroing is
+ * left to do.
+ */
+static void copy_sections(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+			  char *data, char *buffer)
+{
+	EFI_IMAGE_SECTION_HEADER *Section;
+	char *base;
+	int i;
+
+	Section = context->FirstSection;
+	for (i = 0; i < context->NumberOfSections; i++, Section++) {
+		if (!section_is_loaded(Section))
+			continue;
+
+		/* Already checked by check_sections() */
+		base = buffer + Section->VirtualAddress;
+
+		if (Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
+			ZeroMem(base, Section->Misc.VirtualSize);
+			continue;
+		}
+
+		if (data && Section->SizeOfRawData > 0)
+			CopyMem(base, data + Section->PointerToRawData,
+				Section->SizeOfRawData);
+
+		if (Section->SizeOfRawData < Section->Misc.VirtualSize)
+			ZeroMem(base + Section->SizeOfRawData,
+				Section->Misc.VirtualSize - Section->SizeOfRawData);
+	}
+}
+
+/*
+ * Relocate a verified image and point the loaded image protocol at it
+ *
+ * reloc is the relocation section's data from the file, and relocsize
+ * how many bytes of the file we have from there on.
+ */
+static EFI_STATUS finish_image(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+			       EFI_IMAGE_SECTION_HEADER *RelocSection,
+			       char *reloc, UINTN relocsize, char *buffer,
+			       EFI_LOADED_IMAGE *li)
+{
+	EFI_STATUS efi_status;
+
+	if (context->NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC) {
+		perror(L"Image has no relocation entry\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	if (context->RelocDir->Size && RelocSection) {
+		/*
+		 * Run the relocation fixups
+		 */
+		efi_status = perf_time(PERF_RELOCATE_COFF,
+				       context->RelocDir->Size,
+				       relocate_coff(context, RelocSection,
+						     reloc, relocsize,
+						     buffer));
+
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Relocation failed: %r\n", efi_status);
+			return efi_status;
+		}
+	}
+
+	/*
+	 * grub needs to know its location and size in memory, so fix up
+	 * the loaded image protocol values
+	 */
+	li->ImageBase = buffer;
+	li->ImageSize = context->ImageSize;
+
+	/* Pass the load options to the second stage loader */
+	if ( load_options ) {
+		li->LoadOptions = load_options;
+		li->LoadOptionsSize = load_options_size;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Measure, verify and load an image that's in memory and has been hashed
+ */
+static EFI_STATUS load_hashed_image (void *data, unsigned int datasize,
+				     PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				     struct image_layout *layout,
+				     UINT8 *sha256hash, UINT8 *sha1hash,
+				     EFI_LOADED_IMAGE *li,
+				     EFI_IMAGE_ENTRY_POINT *entry_point,
+				     EFI_PHYSICAL_ADDRESS *alloc_address,
+				     UINTN *alloc_pages)
+{
+	EFI_STATUS efi_status;
+	char *buffer;
+	EFI_IMAGE_SECTION_HEADER *RelocSection = layout->RelocSection;
+	char *reloc = NULL;
+	UINTN relocsize = 0;
+
+	/* Measure the binary into the TPM */
+#ifdef REQUIRE_TPM
+	efi_status =
+#endif
+	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)data, datasize,
+		   (EFI_PHYSICAL_ADDRESS)(UINTN)context->ImageAddress,
+		   li->FilePath, sha1hash, 4);
+#ifdef REQUIRE_TPM
+	if (efi_status != EFI_SUCCESS) {
+		return efi_status;
+	}
+#endif
+
+	if (secure_mode ()) {
+		efi_status = perf_time(PERF_VERIFY_SIGNATURES, datasize,
+				verify_signatures((char *)data +
+						  context->SecDir->VirtualAddress,
+						  datasize, context,
+						  sha256hash, sha1hash));
+
+		if (EFI_ERROR(efi_status)) {
+			if (verbose)
+				console_print(L"Verification failed: %r\n", efi_status);
+			else
+				console_error(L"Verification failed", efi_status);
+			return efi_status;
+		} else {
+			if (verbose)
+				console_print(L"Verification succeeded\n");
+		}
+	}
+
+	efi_status = allocate_image(context, alloc_address, alloc_pages,
+				    &buffer);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	CopyMem(buffer, data, context->SizeOfHeaders);
+
+	*entry_point = ImageAddress(buffer, context->ImageSize, context->EntryPoint);
+	if (!*entry_point) {
+		perror(L"Entry point is invalid\n");
+		efi_status = EFI_UNSUPPORTED;
+		goto err;
+	}
+
+	efi_status = check_sections(context, layout, buffer);
+	if (EFI_ERROR(efi_status))
+		goto err;
+
+	copy_sections(context, data, buffer);
+
+	if (RelocSection) {
+		/* image_layout_init() made sure this is inside the file */
+		reloc = (char *)data + RelocSection->PointerToRawData;
+		relocsize = datasize - RelocSection->PointerToRawData;
+	}
+
+	efi_status = finish_image(context, RelocSection, reloc, relocsize,
+				  buffer, li);
+	if (EFI_ERROR(efi_status))
+		goto err;
+
+	return EFI_SUCCESS;
+err:
+	gBS->FreePages(*alloc_address, *alloc_pages);
+	perf_mem_free(*alloc_pages * PAGE_SIZE);
+	return efi_status;
+}
+
+/*
+ * Once the image has been loaded it needs to be validated and relocated
+ */
+static EFI_STATUS handle_image (void *data, unsigned int datasize,
+				EFI_LOADED_IMAGE *li,
+				EFI_IMAGE_ENTRY_POINT *entry_point,
+				EFI_PHYSICAL_ADDRESS *alloc_address,
+				UINTN *alloc_pages)
+{
+	EFI_STATUS efi_status;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	struct image_layout layout;
+	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+
+	/*
+	 * The binary header contains relevant context and section pointers
+	 */
+	efi_status = read_header(data, datasize, &context);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Failed to read header: %r\n", efi_status);
+		return efi_status;
+	}
+
+	efi_status = image_layout_init(&layout, data, datasize, datasize,
+				       &context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	/*
+	 * We only need to verify the binary if we're in secure mode
+	 */
+	efi_status = hash_image(data, datasize, &layout, sha256hash,
+				sha1hash);
+	if (!EFI_ERROR(efi_status))
+		efi_status = load_hashed_image(data, datasize, &context,
+					       &layout, sha256hash, sha1hash,
+					       li, entry_point, alloc_address,
+					       alloc_pages);
+
+	image_layout_free(&layout);
+	return efi_status;
+}
+
+/*
+ * Read size bytes at offset in a file, all of them
+ */
+static EFI_STATUS read_file_at(EFI_FILE *file, UINTN offset,
+			       void *buf, UINTN size)
+{
+	EFI_STATUS efi_status;
+	UINTN len;
+	UINT64 perf_start_time = perf_start();
+	UINTN total = size;
+
+	efi_status = file->SetPosition(file, offset);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Unable to seek to 0x%lx: %r\n", offset, efi_status);
+		return efi_status;
+	}
+
+	while (size > 0) {
+		len = size;
+		efi_status = file->Read(file, &len, buf);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Unable to read 0x%lx bytes at 0x%lx: %r\n",
+			       size, offset, efi_status);
+			return efi_status;
+		}
+		if (len == 0) {
+			perror(L"File ends before 0x%lx\n", offset + size);
+			return EFI_LOAD_ERROR;
+		}
+		buf = (char *)buf + len;
+		offset += len;
+		size -= len;
+	}
+
+	perf_stop(PERF_READ_FILE, perf_start_time, total);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Reads an image file a chunk at a time, so each chunk can be hashed
+ * while it's still in the cache instead of after the whole file has
+ * been read.  Chunks are a whole number of the device's blocks and
+ * start on a chunk boundary, and the scratch buffers are aligned the
+ * way the device asks for, so the filesystem driver can read straight
+ * into our memory.
+ *
+ * If the file protocol can read asynchronously (revision 2 and
+ * ReadEx()), the next chunk is requested before the current one is
+ * hashed, so the disk and the CPU are both kept busy.  Only one read is
+ * ever outstanding, since the file has a single position to read from.
+ * Otherwise the reads are plain synchronous ones.
+ */
+#define READ_CHUNK_SIZE		(256 * 1024)
+
+struct image_reader {
+	EFI_FILE *file;
+	UINTN base;		/* where the image starts in the file */
+	UINTN size;		/* of the image */
+	UINTN chunk;		/* bytes per read */
+	char *scratch[2];	/* chunk bytes each, suitably aligned */
+	void *scratch_alloc;
+	UINTN scratch_size;
+	EFI_EVENT event;	/* NULL if reads are synchronous */
+	EFI_FILE_IO_TOKEN token;
+	BOOLEAN pending;	/* an asynchronous read is outstanding */
+	UINTN pending_offset;
+	UINTN pending_size;
+};
+
+static EFI_STATUS image_reader_init(struct image_reader *reader,
+				    EFI_HANDLE device, EFI_FILE *file,
+				    UINTN base, UINTN size)
+{
+	EFI_STATUS efi_status;
+	EFI_BLOCK_IO *bio = NULL;
+	UINTN blocksize = 1, align = 1;
+
+	ZeroMem(reader, sizeof(*reader));
+	reader->file = file;
+	reader->base = base;
+	reader->size = size;
+
+	efi_status = gBS->HandleProtocol(device, &EFI_BLOCK_IO_GUID,
+					 (void **)&bio);
+	if (!EFI_ERROR(efi_status) && bio && bio->Media) {
+		if (bio->Media->BlockSize)
+			blocksize = bio->Media->BlockSize;
+		if (bio->Media->IoAlign > 1)
+			align = bio->Media->IoAlign;
+	}
+
+	reader->chunk = READ_CHUNK_SIZE;
+	if (reader->chunk % blocksize)
+		reader->chunk = ALIGN_VALUE(reader->chunk, blocksize);
+	if (reader->chunk % align)
+		reader->chunk = ALIGN_VALUE(reader->chunk, align);
+
+	reader->scratch_size = reader->chunk * 2 + align - 1;
+	reader->scratch_alloc = AllocatePool(reader->scratch_size);
+	if (!reader->scratch_alloc) {
+		perror(L"Unable to allocate read buffer\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	perf_mem_alloc(reader->scratch_size);
+	reader->scratch[0] = (char *)ALIGN_VALUE((UINTN)reader->scratch_alloc,
+						 align);
+	reader->scratch[1] = reader->scratch[0] + reader->chunk;
+
+	if (file->Revision >= EFI_FILE_PROTOCOL_REVISION2) {
+		efi_status = gBS->CreateEvent(0, 0, NULL, NULL,
+					      &reader->event);
+		if (EFI_ERROR(efi_status))
+			reader->event = NULL;
+	}
+
+	dprint(L"Reading in 0x%lx byte chunks (block size %lu, alignment %lu), %s\n",
+	       reader->chunk, blocksize, align,
+	       reader->event ? L"asynchronously" : L"synchronously");
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Read size bytes of the image at offset into buf, synchronously
+ */
+static EFI_STATUS image_read_at(struct image_reader *reader, UINTN offset,
+				void *buf, UINTN size)
+{
+	return read_file_at(reader->file, reader->base + offset, buf, size);
+}
+
+/*
+ * Start reading size bytes of the image at offset into buf.  Without
+ * asynchronous reads this does the whole read before returning.
+ */
+static EFI_STATUS image_read_start(struct image_reader *reader,
+				   UINTN offset, char *buf, UINTN size)
+{
+	EFI_STATUS efi_status;
+
+	offset += reader->base;
+	if (!reader->event)
+		return read_file_at(reader->file, offset, buf, size);
+
+	efi_status = reader->file->SetPosition(reader->file, offset);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Unable to seek to 0x%lx: %r\n", offset, efi_status);
+		return efi_status;
+	}
+
+	reader->token.Event = reader->event;
+	reader->token.Status = EFI_SUCCESS;
+	reader->token.BufferSize = size;
+	reader->token.Buffer = buf;
+	efi_status = reader->file->ReadEx(reader->file, &reader->token);
+	if (EFI_ERROR(efi_status)) {
+		dprint(L"Asynchronous read failed: %r, falling back to synchronous reads\n",
+		       efi_status);
+		gBS->CloseEvent(reader->event);
+		reader->event = NULL;
+		return read_file_at(reader->file, offset, buf, size);
+	}
+
+	reader->pending = TRUE;
+	reader->pending_offset = offset;
+	reader->pending_size = size;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Wait for the read image_read_start() started, if there is one
+ */
+static EFI_STATUS image_read_wait(struct image_reader *reader)
+{
+	EFI_STATUS efi_status;
+	UINT64 perf_start_time;
+	UINTN index, got;
+	char *buf;
+
+	if (!reader->pending)
+		return EFI_SUCCESS;
+	reader->pending = FALSE;
+
+	perf_start_time = perf_start();
+	efi_status = gBS->WaitForEvent(1, &reader->event, &index);
+	perf_stop(PERF_READ_WAIT, perf_start_time, reader->pending_size);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Unable to wait for read: %r\n", efi_status);
+		return efi_status;
+	}
+
+	efi_status = reader->token.Status;
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Unable to read 0x%lx bytes at 0x%lx: %r\n",
+		       reader->pending_size, reader->pending_offset,
+		       efi_status);
+		return efi_status;
+	}
+
+	/* A short read isn't an error; get the rest the simple way */
+	got = reader->token.BufferSize;
+	if (got < reader->pending_size) {
+		buf = (char *)reader->token.Buffer + got;
+		return read_file_at(reader->file, reader->pending_offset + got,
+				    buf, reader->pending_size - got);
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void image_reader_free(struct image_reader *reader)
+{
+	image_read_wait(reader);
+	if (reader->event)
+		gBS->CloseEvent(reader->event);
+	reader->event = NULL;
+	if (reader->scratch_alloc) {
+		FreePool(reader->scratch_alloc);
+		perf_mem_free(reader->scratch_size);
+	}
+	reader->scratch_alloc = NULL;
+	reader->scratch[0] = reader->scratch[1] = NULL;
+}
+
+/*
+ * Read size bytes of the file at offset, a chunk at a time, and feed
+ * them to the image hash as they come in.  They're read into dest, or
+ * if that's NULL, through the scratch buffers and thrown away.  Nothing
+ * is left outstanding when this returns, even on errors.
+ */
+static EFI_STATUS image_read_hashed(struct image_reader *reader,
+				    struct image_hash *ih, UINTN offset,
+				    char *dest, UINTN size)
+{
+	EFI_STATUS efi_status;
+	char *buf, *next = NULL;
+	UINTN len, nextlen = 0;
+	int which = 0;
+
+	if (size == 0)
+		return EFI_SUCCESS;
+
+	len = min(size, reader->chunk - offset % reader->chunk);
+	buf = dest ? dest : reader->scratch[which];
+	efi_status = image_read_start(reader, offset, buf, len);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	while (size > 0) {
+		efi_status = image_read_wait(reader);
+		if (EFI_ERROR(efi_status))
+			goto done;
+
+		/* Get the next chunk coming before hashing this one */
+		if (size > len) {
+			which = !which;
+			nextlen = min(size - len, reader->chunk);
+			next = dest ? dest + len : reader->scratch[which];
+			efi_status = image_read_start(reader, offset + len,
+						      next, nextlen);
+			if (EFI_ERROR(efi_status))
+				goto done;
+		}
+
+		efi_status = image_hash_update(ih, offset, buf, len);
+		if (EFI_ERROR(efi_status))
+			goto done;
+
+		if (dest)
+			dest += len;
+		offset += len;
+		size -= len;
+		buf = next;
+		len = nextlen;
+	}
+
+done:
+	image_read_wait(reader);
+	return efi_status;
+}
+
+/*
+ * Parse the headers at the start of an image without having all of it.
+ * data holds the first datasize bytes of a file filesize bytes long.
+ * Returns EFI_BUFFER_TOO_SMALL, with *needed set to how much of the
+ * file the next try needs, if the headers aren't all there yet.
+ */
+static EFI_STATUS parse_partial_header(char *data, UINTN datasize,
+				       UINTN filesize, UINTN *needed,
+				       PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = (EFI_IMAGE_DOS_HEADER *)data;
+	EFI_STATUS efi_status;
+
+	*needed = datasize;
+
+	/*
+	 * parse_header() looks at the PE header before it checks whether
+	 * it's all there; make sure it is.
+	 */
+	if (datasize < sizeof(*DosHdr)) {
+		*needed = sizeof(*DosHdr);
+		goto more;
+	}
+	if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE &&
+	    (DosHdr->e_lfanew > datasize ||
+	     datasize - DosHdr->e_lfanew <
+			sizeof(EFI_IMAGE_OPTIONAL_HEADER_UNION))) {
+		*needed = (UINTN)DosHdr->e_lfanew +
+			  sizeof(EFI_IMAGE_OPTIONAL_HEADER_UNION);
+		goto more;
+	}
+
+	efi_status = parse_header(data, datasize, filesize, context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	if (context->SizeOfHeaders > datasize) {
+		*needed = context->SizeOfHeaders;
+		goto more;
+	}
+
+	return EFI_SUCCESS;
+
+more:
+	if (*needed > filesize)
+		return EFI_UNSUPPORTED;
+	return EFI_BUFFER_TOO_SMALL;
+}
+
+/*
+ * Sections are read straight into the image in file order, so their
+ * destinations must not overlap each other or the headers; if they
+ * did, the result would depend on the order they're copied in.  This
+ * is also where we make sure nothing gets written outside the image,
+ * since unlike handle_image() we write to it before it's verified.
+ */
+static UINT64 section_end(EFI_IMAGE_SECTION_HEADER *Section)
+{
+	UINT64 size = Section->Misc.VirtualSize;
+
+	if (!(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) &&
+	    Section->SizeOfRawData > size)
+		size = Section->SizeOfRawData;
+	return (UINT64)Section->VirtualAddress + size;
+}
+
+static BOOLEAN can_load_directly(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				 struct image_layout *layout)
+{
+	EFI_IMAGE_SECTION_HEADER *RelocSection = layout->RelocSection;
+	EFI_IMAGE_SECTION_HEADER **loaded = NULL, *Section;
+	UINT64 reach = 0;
+	UINTN i, n = 0;
+	BOOLEAN ok = FALSE;
+
+	if (RelocSection &&
+	    RelocSection->Misc.VirtualSize > RelocSection->SizeOfRawData)
+		return FALSE;
+
+	loaded = AllocatePool(sizeof(*loaded) * 2 * (layout->nsections + 1));
+	if (!loaded)
+		return FALSE;
+
+	for (i = 0; i < layout->nsections; i++) {
+		Section = layout->sections[i];
+		if (!section_is_loaded(Section) ||
+		    section_end(Section) == Section->VirtualAddress)
+			continue;
+		if (section_end(Section) > context->ImageSize ||
+		    Section->VirtualAddress < context->SizeOfHeaders)
+			goto done;
+		loaded[n++] = Section;
+	}
+
+	/*
+	 * In address order, a section overlaps an earlier one if it starts
+	 * before the furthest any of them reaches.
+	 */
+	sort_sections(loaded, loaded + n, n, address_order);
+	for (i = 0; i < n; i++) {
+		if (loaded[i]->VirtualAddress < reach)
+			goto done;
+		if (section_end(loaded[i]) > reach)
+			reach = section_end(loaded[i]);
+	}
+	ok = TRUE;
+
+done:
+	FreePool(loaded);
+	return ok;
+}
+
+/*
+ * An image being loaded straight into the memory it will run from,
+ * either read from its file or as it arrives over the network.  Only
+ * the relocation and certificate tables are kept outside the image;
+ * everything else in the file is hashed as it goes by and then either
+ * put where it belongs or dropped.  The headers the image was set up
+ * from have to stay put until it's finished or freed.
+ */
+struct direct_load {
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	struct image_layout layout;
+	struct image_hash ih;
+	UINTN filesize;
+	char *buffer;			/* the image */
+	EFI_PHYSICAL_ADDRESS alloc_address;
+	UINTN alloc_pages;
+	char *reloc;			/* the relocation table, as in the file */
+	UINTN relocsize;
+	char *certs;			/* the certificate table */
+	UINTN counted;			/* bytes of those two told to perf */
+	UINTN next_section;		/* first of layout.sections not yet placed */
+};
+
+static void direct_load_free(struct direct_load *dl)
+{
+	image_hash_free(&dl->ih);
+	image_layout_free(&dl->layout);
+	if (dl->buffer) {
+		gBS->FreePages(dl->alloc_address, dl->alloc_pages);
+		perf_mem_free(dl->alloc_pages * PAGE_SIZE);
+		dl->buffer = NULL;
+	}
+	if (dl->reloc)
+		FreePool(dl->reloc);
+	dl->reloc = NULL;
+	if (dl->certs)
+		FreePool(dl->certs);
+	dl->certs = NULL;
+	perf_mem_free(dl->counted);
+	dl->counted = 0;
+}
+
+/*
+ * Get ready to load an image straight into place.  headers holds the
+ * first hdrsize bytes of it, which have been parsed into context.
+ * Returns EFI_UNSUPPORTED, with nothing left allocated, if the image
+ * isn't one that can be loaded like that; it has to be read in whole
+ * and go through handle_image() instead.
+ */
+static EFI_STATUS direct_load_setup(struct direct_load *dl, char *headers,
+				    UINTN hdrsize, UINTN filesize,
+				    PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_SECTION_HEADER *RelocSection;
+	EFI_STATUS efi_status;
+
+	ZeroMem(dl, sizeof(*dl));
+	CopyMem(&dl->context, context, sizeof(dl->context));
+	context = &dl->context;
+	dl->filesize = filesize;
+
+	/*
+	 * A TPM 2.0 measures the file itself, so it has to be in memory
+	 */
+	if (tpm_log_pe_needs_file())
+		return EFI_UNSUPPORTED;
+
+	efi_status = image_layout_init(&dl->layout, headers, hdrsize,
+				       filesize, context);
+	if (EFI_ERROR(efi_status) || !image_layout_is_sequential(&dl->layout))
+		goto unsupported;
+
+	efi_status = allocate_image(context, &dl->alloc_address,
+				    &dl->alloc_pages, &dl->buffer);
+	if (EFI_ERROR(efi_status)) {
+		dl->buffer = NULL;
+		goto unsupported;
+	}
+
+	if (!ImageAddress(dl->buffer, context->ImageSize, context->EntryPoint) ||
+	    EFI_ERROR(check_sections(context, &dl->layout, dl->buffer)) ||
+	    !can_load_directly(context, &dl->layout))
+		goto unsupported;
+
+	/*
+	 * From here on, anything that goes wrong is an error rather than
+	 * a reason to load the image some other way.
+	 */
+	if (context->SecDir->Size &&
+	    context->SecDir->VirtualAddress > filesize - context->SecDir->Size) {
+		perror(L"Certificate Database size is too large\n");
+		efi_status = EFI_INVALID_PARAMETER;
+		goto err;
+	}
+
+	RelocSection = dl->layout.RelocSection;
+	if (RelocSection) {
+		dl->relocsize = RelocSection->SizeOfRawData;
+		dl->reloc = AllocatePool(dl->relocsize);
+	}
+	if (context->SecDir->Size)
+		dl->certs = AllocatePool(context->SecDir->Size);
+	if ((RelocSection && !dl->reloc) ||
+	    (context->SecDir->Size && !dl->certs)) {
+		perror(L"Unable to allocate image buffers\n");
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto err;
+	}
+	dl->counted = dl->relocsize + context->SecDir->Size;
+	perf_mem_alloc(dl->counted);
+
+	efi_status = image_hash_init(&dl->ih, &dl->layout);
+	if (EFI_ERROR(efi_status))
+		goto err;
+
+	CopyMem(dl->buffer, headers, context->SizeOfHeaders);
+	return EFI_SUCCESS;
+
+unsupported:
+	efi_status = EFI_UNSUPPORTED;
+err:
+	direct_load_free(dl);
+	return efi_status;
+}
+
+/*
+ * Once the whole file has gone by: measure, verify and relocate the
+ * image, and hand it over.  dl is freed either way.
+ */
+static EFI_STATUS direct_load_finish(struct direct_load *dl,
+				     EFI_LOADED_IMAGE *li,
+				     EFI_IMAGE_ENTRY_POINT *entry_point,
+				     EFI_PHYSICAL_ADDRESS *alloc_address,
+				     UINTN *alloc_pages)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT *context = &dl->context;
+	EFI_STATUS efi_status;
+	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+
+	efi_status = image_hash_final(&dl->ih, sha256hash, sha1hash);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	/*
+	 * Measure the binary into the TPM.  Only a TPM 1.2 can get here,
+	 * and it only uses our hash; the image it's told about is the one
+	 * we've loaded.
+	 */
+#ifdef REQUIRE_TPM
+	efi_status =
+#endif
+	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)dl->buffer, context->ImageSize,
+		   (EFI_PHYSICAL_ADDRESS)(UINTN)context->ImageAddress,
+		   li->FilePath, sha1hash, 4);
+#ifdef REQUIRE_TPM
+	if (efi_status != EFI_SUCCESS)
+		goto done;
+#endif
+
+	if (secure_mode ()) {
+		efi_status = perf_time(PERF_VERIFY_SIGNATURES, dl->filesize,
+				verify_signatures(dl->certs, dl->filesize,
+						  context, sha256hash,
+						  sha1hash));
+
+		if (EFI_ERROR(efi_status)) {
+			if (verbose)
+				console_print(L"Verification failed: %r\n", efi_status);
+			else
+				console_error(L"Verification failed", efi_status);
+			goto done;
+		} else {
+			if (verbose)
+				console_print(L"Verification succeeded\n");
+		}
+	}
+
+	copy_sections(context, NULL, dl->buffer);
+
+	efi_status = finish_image(context, dl->layout.RelocSection, dl->reloc,
+				  dl->relocsize, dl->buffer, li);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	*entry_point = ImageAddress(dl->buffer, context->ImageSize,
+				    context->EntryPoint);
+	*alloc_address = dl->alloc_address;
+	*alloc_pages = dl->alloc_pages;
+	dl->buffer = NULL;
+
+done:
+	direct_load_free(dl);
+	return efi_status;
+}
+
+/*
+ * Load an image straight from its file into the memory it will run
+ * from.  The headers are read first; after that each section's data is
+ * read directly to where it belongs, in file order, and hashed as it
+ * arrives, so the file is never staged in a buffer of its own.
+ *
+ * Images this can't be done for are left alone, with *fallback set;
+ * those have to be read in whole and go through handle_image().
+ */
+static EFI_STATUS load_image_direct(struct image_reader *reader,
+				    EFI_LOADED_IMAGE *li,
+				    EFI_IMAGE_ENTRY_POINT *entry_point,
+				    EFI_PHYSICAL_ADDRESS *alloc_address,
+				    UINTN *alloc_pages, BOOLEAN *fallback)
+{
+	EFI_STATUS efi_status;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_IMAGE_SECTION_HEADER *Section;
+	struct direct_load dl;
+	struct image_layout *layout = &dl.layout;
+	char *headers = NULL;
+	char *dest;
+	UINTN filesize = reader->size;
+	UINTN hdrsize, needed, i;
+
+	*fallback = TRUE;
+
+	/*
+	 * Read the first page, which normally holds all of the headers,
+	 * and more if they say they're bigger than that.
+	 */
+	hdrsize = min(filesize, (UINTN)PAGE_SIZE);
+	for (;;) {
+		headers = AllocatePool(hdrsize);
+		if (!headers) {
+			perror(L"Unable to allocate header buffer\n");
+			return EFI_OUT_OF_RESOURCES;
+		}
+		efi_status = image_read_at(reader, 0, headers, hdrsize);
+		if (EFI_ERROR(efi_status))
+			goto unsupported;
+
+		efi_status = parse_partial_header(headers, hdrsize, filesize,
+						  &needed, &context);
+		if (efi_status != EFI_BUFFER_TOO_SMALL)
+			break;
+
+		hdrsize = needed;
+		FreePool(headers);
+	}
+	if (EFI_ERROR(efi_status))
+		goto unsupported;
+
+	efi_status = direct_load_setup(&dl, headers, hdrsize, filesize,
+				       &context);
+	if (efi_status == EFI_UNSUPPORTED)
+		goto unsupported;
+	*fallback = FALSE;
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	dprint(L"Loading image directly from the file\n");
+
+	efi_status = image_hash_update(&dl.ih, 0, headers,
+				       dl.context.SizeOfHeaders);
+	if (EFI_ERROR(efi_status))
+		goto err;
+
+	/*
+	 * Walk the sections in the order their data appears in the file,
+	 * reading each one straight to where it goes
+	 */
+	for (i = 0; i < layout->nsections; i++) {
+		Section = layout->sections[i];
+		if (Section->SizeOfRawData == 0)
+			continue;
+
+		dest = NULL;
+		if (section_is_loaded(Section) &&
+		    !(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA))
+			dest = dl.buffer + Section->VirtualAddress;
+		else if (Section == layout->RelocSection)
+			dest = dl.reloc;
+
+		efi_status = image_read_hashed(reader, &dl.ih,
+					       Section->PointerToRawData,
+					       dest, Section->SizeOfRawData);
+		if (EFI_ERROR(efi_status))
+			goto err;
+
+		/* relocate_coff() wants the table as it is in the file */
+		if (Section == layout->RelocSection && dest != dl.reloc)
+			CopyMem(dl.reloc, dest, Section->SizeOfRawData);
+	}
+
+	/*
+	 * Hash whatever lies between the sections and the certificate
+	 * table, and read the table itself
+	 */
+	if (dl.ih.next < layout->nregions) {
+		efi_status = image_read_hashed(reader, &dl.ih,
+					       layout->regions[dl.ih.next].offset,
+					       NULL,
+					       layout->regions[dl.ih.next].size);
+		if (EFI_ERROR(efi_status))
+			goto err;
+	}
+
+	if (dl.certs) {
+		efi_status = image_read_at(reader,
+					   dl.context.SecDir->VirtualAddress,
+					   dl.certs, dl.context.SecDir->Size);
+		if (EFI_ERROR(efi_status))
+			goto err;
+	}
+
+	efi_status = direct_load_finish(&dl, li, entry_point, alloc_address,
+					alloc_pages);
+	goto done;
+
+unsupported:
+	dprint(L"Image can't be loaded directly, reading it in whole\n");
+	efi_status = EFI_SUCCESS;
+	goto done;
+err:
+	direct_load_free(&dl);
+done:
+	if (headers)
+		FreePool(headers);
+	return efi_status;
+}
+
+/*
+ * Read a whole image file into memory, hashing it as it comes in.  Each
+ * hash region is hashed as soon as all of it has arrived, so this works
+ * whatever order the sections are in, and the hash is done almost as
+ * soon as the last read is, and *layout describes the image.  If the
+ * headers don't make sense the file is only read, and *hashed is left
+ * FALSE for handle_image() to sort out the details.
+ */
+static EFI_STATUS read_image_hashed(struct image_reader *reader,
+				    void **datap,
+				    PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				    struct image_layout *layout,
+				    UINT8 *sha256hash, UINT8 *sha1hash,
+				    BOOLEAN *hashed)
+{
+	EFI_STATUS efi_status;
+	struct image_hash ih;
+	BOOLEAN hashing = FALSE, parsing = TRUE;
+	char *data;
+	UINTN got = 0, len, needed;
+
+	ZeroMem(&ih, sizeof(ih));
+	*hashed = FALSE;
+
+	data = AllocatePool(reader->size);
+	if (!data) {
+		perror(L"Unable to allocate file buffer\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	perf_mem_alloc(reader->size);
+	*datap = data;
+
+	len = min(reader->size, reader->chunk);
+	efi_status = image_read_start(reader, 0, data, len);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	while (got < reader->size) {
+		efi_status = image_read_wait(reader);
+		if (EFI_ERROR(efi_status))
+			goto done;
+		got += len;
+
+		/* Get the next chunk coming while we look at this one */
+		if (got < reader->size) {
+			len = min(reader->size - got, reader->chunk);
+			efi_status = image_read_start(reader, got, data + got,
+						      len);
+			if (EFI_ERROR(efi_status))
+				goto done;
+		}
+
+		if (parsing) {
+			efi_status = parse_partial_header(data, got,
+							  reader->size,
+							  &needed, context);
+			if (efi_status == EFI_BUFFER_TOO_SMALL)
+				continue;
+			parsing = FALSE;
+			if (EFI_ERROR(efi_status))
+				continue;
+			efi_status = image_layout_init(layout, data, got,
+						       reader->size, context);
+			if (EFI_ERROR(efi_status))
+				continue;
+			efi_status = image_hash_init(&ih, layout);
+			hashing = !EFI_ERROR(efi_status);
+		}
+
+		if (hashing) {
+			efi_status = image_hash_update(&ih, 0, data, got);
+			hashing = !EFI_ERROR(efi_status);
+		}
+	}
+
+	if (hashing) {
+		efi_status = image_hash_final(&ih, sha256hash, sha1hash);
+		*hashed = !EFI_ERROR(efi_status);
+	}
+	efi_status = EFI_SUCCESS;
+
+done:
+	image_read_wait(reader);
+	image_hash_free(&ih);
+	if (!*hashed)
+		image_layout_free(layout);
+	return efi_status;
+}
+
+/*
+ * Images that arrive a piece at a time, whether over HTTP or out of a
+ * decompressor, are loaded with an image_stream.
+ */
+#if defined(ENABLE_HTTPBOOT) || defined(ENABLE_LZ4)
+#define HAVE_IMAGE_STREAM
+#endif
+
+#if defined(HAVE_IMAGE_STREAM)
+static BOOLEAN section_has_data(EFI_IMAGE_SECTION_HEADER *Section)
+{
+	return section_is_loaded(Section) &&
+	       !(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA);
+}
+
+/*
+ * Where the file data of a section goes: into the image if it's loaded,
+ * and if it's the relocation section, where relocate_coff() will want
+ * it as well.  It may have been received in the image already.
+ */
+static void direct_load_put(struct direct_load *dl,
+			    EFI_IMAGE_SECTION_HEADER *Section,
+			    UINTN offset, char *data, UINTN size)
+{
+	char *dest = dl->buffer + Section->VirtualAddress + offset;
+
+	if (section_has_data(Section) && dest != data)
+		CopyMem(dest, data, size);
+	if (Section == dl->layout.RelocSection && dl->reloc + offset != data)
+		CopyMem(dl->reloc + offset, data, size);
+}
+
+/*
+ * Take the size bytes of the file at offset, which have to follow on
+ * from the last ones: hash them, and put whatever parts of them belong
+ * in the image or in the relocation or certificate tables there.
+ */
+static EFI_STATUS direct_load_place(struct direct_load *dl, UINTN offset,
+				    char *data, UINTN size)
+{
+	EFI_IMAGE_SECTION_HEADER *Section;
+	EFI_STATUS efi_status;
+	UINT64 start, end, from, to;
+	UINTN i;
+
+	efi_status = image_hash_update(&dl->ih, offset, data, size);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	/*
+	 * The sections are in file order and don't overlap, so only the
+	 * first unfinished one and those after it can be in here.
+	 */
+	for (i = dl->next_section; i < dl->layout.nsections; i++) {
+		Section = dl->layout.sections[i];
+		start = Section->PointerToRawData;
+		end = start + Section->SizeOfRawData;
+		if (start >= offset + size)
+			break;
+
+		from = start > offset ? start : offset;
+		to = min(end, (UINT64)offset + size);
+		if (from < to)
+			direct_load_put(dl, Section, from - start,
+					data + (from - offset), to - from);
+		if (end <= offset + size && i == dl->next_section)
+			dl->next_section++;
+	}
+
+	if (dl->certs) {
+		start = dl->context.SecDir->VirtualAddress;
+		end = start + dl->context.SecDir->Size;
+		from = start > offset ? start : offset;
+		to = min(end, (UINT64)offset + size);
+		if (from < to &&
+		    dl->certs + (from - start) != data + (from - offset))
+			CopyMem(dl->certs + (from - start),
+				data + (from - offset), to - from);
+	}
+
+	return EFI_SUCCESS;
+}
+
+#if defined(ENABLE_HTTPBOOT)
+/*
+ * Where the bytes of the file from offset on will end up, so that they
+ * can be put there to begin with: returns that, and sets *len to how
+ * many of them go there.  Those that only pass through to be hashed,
+ * like the headers or anything between sections, have nowhere to go;
+ * NULL is returned, and *len is how many of them there are, or 0 if
+ * they run to the end of the file.
+ */
+static char *direct_load_where(struct direct_load *dl, UINTN offset,
+			       UINTN *len)
+{
+	EFI_IMAGE_SECTION_HEADER *Section;
+	UINT64 start, end, limit = 0;
+	char *where = NULL;
+	UINTN i;
+
+	for (i = dl->next_section; i < dl->layout.nsections; i++) {
+		Section = dl->layout.sections[i];
+		start = Section->PointerToRawData;
+		end = start + Section->SizeOfRawData;
+		if (end <= offset)
+			continue;
+		if (start > offset) {
+			limit = start;
+			break;
+		}
+
+		/*
+		 * The relocation section is wanted in two places; it may as
+		 * well arrive in the one that's always there
+		 */
+		if (Section == dl->layout.RelocSection)
+			where = dl->reloc + (offset - start);
+		else if (section_has_data(Section))
+			where = dl->buffer + Section->VirtualAddress +
+				(offset - start);
+		limit = end;
+		break;
+	}
+
+	if (dl->certs) {
+		start = dl->context.SecDir->VirtualAddress;
+		end = start + dl->context.SecDir->Size;
+		if (offset >= start && offset < end) {
+			if (!where)
+				where = dl->certs + (offset - start);
+			if (!limit || end < limit)
+				limit = end;
+		} else if (start > offset && (!limit || start < limit)) {
+			limit = start;
+		}
+	}
+
+	*len = limit ? limit - offset : 0;
+	return where;
+}
+#endif
+
+/*
+ * An image being received from somewhere that can only hand it over
+ * from start to end, a piece at a time.  Once the headers are in, it's
+ * loaded straight into place as the rest arrives, the same as a file
+ * read by load_image_direct(); if that can't be done, it's collected
+ * in a buffer for handle_image() instead.  Whatever's sending it can ask
+ * image_stream_place() where each piece goes, and put it right there.
+ *
+ * Whatever's sending it may not know how big it is, as with a chunked
+ * HTTP response; the size is then worked out from the headers.
+ */
+typedef enum {
+	STREAM_HEADERS,		/* collecting the headers in data */
+	STREAM_PLACING,		/* loading into dl, headers still in data */
+	STREAM_BUFFERING	/* collecting the whole file in data */
+} image_stream_state_t;
+
+struct image_stream {
+	image_stream_state_t state;
+	BOOLEAN unsized;	/* filesize comes from the headers */
+	UINTN filesize;
+	UINTN got;
+	char *data;
+	UINTN datasize;		/* how much data has room for */
+	struct direct_load dl;
+};
+
+static void image_stream_free(struct image_stream *s)
+{
+	if (s->state == STREAM_PLACING)
+		direct_load_free(&s->dl);
+	if (s->data) {
+		FreePool(s->data);
+		perf_mem_free(s->datasize);
+	}
+	ZeroMem(s, sizeof(*s));
+}
+
+static EFI_STATUS image_stream_grow(struct image_stream *s, UINTN size)
+{
+	char *data;
+
+	/* the old buffer is gone whether this works or not */
+	data = ReallocatePool(s->data, s->datasize, size);
+	perf_mem_free(s->datasize);
+	if (!data) {
+		perror(L"Unable to allocate image buffer\n");
+		s->data = NULL;
+		s->datasize = 0;
 		return EFI_OUT_OF_RESOURCES;
 	}
+	perf_mem_alloc(size);
+	s->data = data;
+	s->datasize = size;
+	return EFI_SUCCESS;
+}
 
-	buffer = (void *)ALIGN_VALUE((unsigned long)*alloc_address, alignment);
+/* it ends up in a buffer with an int for its size */
+#define IMAGE_STREAM_MAX	0x7fffffff
 
-	CopyMem(buffer, data, context.SizeOfHeaders);
+/*
+ * How big the file an image came from has to be, going by its headers:
+ * a signed image ends with its certificate table, which is checked when
+ * it's hashed, and any other with the last of its section data.  Nothing
+ * after that plays any part in loading or verifying it.
+ */
+static UINTN image_file_size(PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_SECTION_HEADER *Section = context->FirstSection;
+	UINT64 size, end;
+	UINTN i;
 
-	*entry_point = ImageAddress(buffer, context.ImageSize, context.EntryPoint);
-	if (!*entry_point) {
-		perror(L"Entry point is invalid\n");
-		gBS->FreePages(*alloc_address, *alloc_pages);
-		return EFI_UNSUPPORTED;
+	if (context->SecDir->Size) {
+		size = (UINT64)context->SecDir->VirtualAddress +
+		       context->SecDir->Size;
+	} else {
+		size = context->SizeOfHeaders;
+		for (i = 0; i < context->NumberOfSections; i++, Section++) {
+			if (!Section->SizeOfRawData)
+				continue;
+			end = (UINT64)Section->PointerToRawData +
+			      Section->SizeOfRawData;
+			if (end > size)
+				size = end;
+		}
 	}
 
+	return size > IMAGE_STREAM_MAX ? 0 : size;
+}
 
-	char *RelocBase, *RelocBaseEnd;
-	/*
-	 * These are relative virtual addresses, so we have to check them
-	 * against the image size, not the data size.
-	 */
-	RelocBase = ImageAddress(buffer, context.ImageSize,
-				 context.RelocDir->VirtualAddress);
-	/*
-	 * RelocBaseEnd here is the address of the last byte of the table
-	 */
-	RelocBaseEnd = ImageAddress(buffer, context.ImageSize,
-				    context.RelocDir->VirtualAddress +
-				    context.RelocDir->Size - 1);
+/*
+ * Work out what to do with the image once the headers are in: load it
+ * straight into place if possible, and start collecting it otherwise.
+ */
+static EFI_STATUS image_stream_headers(struct image_stream *s)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_STATUS efi_status;
+	UINTN needed;
 
-	EFI_IMAGE_SECTION_HEADER *RelocSection = NULL;
+	efi_status = parse_partial_header(s->data, s->got,
+					  s->filesize ? s->filesize
+						      : IMAGE_STREAM_MAX,
+					  &needed, &context);
+	if (efi_status == EFI_BUFFER_TOO_SMALL)
+		return image_stream_grow(s, needed);
 
 	/*
-	 * Copy the executable's sections to their desired offsets
+	 * Without headers to go by there's no telling how much of an
+	 * image of unknown size to collect; it's likely not an image at
+	 * all, but something like an error page from a proxy.
 	 */
-	Section = context.FirstSection;
-	for (i = 0; i < context.NumberOfSections; i++, Section++) {
-		/* Don't try to copy discardable sections with zero size */
-		if ((Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE) &&
-		    !Section->Misc.VirtualSize)
-			continue;
-
-		base = ImageAddress (buffer, context.ImageSize,
-				     Section->VirtualAddress);
-		end = ImageAddress (buffer, context.ImageSize,
-				    Section->VirtualAddress
-				     + Section->Misc.VirtualSize - 1);
+	if (EFI_ERROR(efi_status) && !s->filesize) {
+		perror(L"Image of unknown size has no usable headers: %r\n",
+		       efi_status);
+		return EFI_LOAD_ERROR;
+	}
 
-		if (end < base) {
-			perror(L"Section %d has negative size\n", i);
-			gBS->FreePages(*alloc_address, *alloc_pages);
+	if (!s->filesize) {
+		s->filesize = image_file_size(&context);
+		if (s->filesize < s->got) {
+			perror(L"Image headers claim a size of 0x%lx\n",
+			       s->filesize);
 			return EFI_UNSUPPORTED;
 		}
+		dprint(L"Image of unknown size should be 0x%lx bytes\n",
+		       s->filesize);
+		efi_status = parse_partial_header(s->data, s->got,
+						  s->filesize, &needed,
+						  &context);
+	}
 
-		if (Section->VirtualAddress <= context.EntryPoint &&
-		    (Section->VirtualAddress + Section->SizeOfRawData - 1)
-		    > context.EntryPoint)
-			found_entry_point++;
-
-		/* We do want to process .reloc, but it's often marked
-		 * discardable, so we don't want to memcpy it. */
-		if (CompareMem(Section->Name, ".reloc\0\0", 8) == 0) {
-			if (RelocSection) {
-				perror(L"Image has multiple relocation sections\n");
-				return EFI_UNSUPPORTED;
-			}
-			/* If it has nonzero sizes, and our bounds check
-			 * made sense, and the VA and size match RelocDir's
-			 * versions, then we believe in this section table. */
-			if (Section->SizeOfRawData &&
-					Section->Misc.VirtualSize &&
-					base && end &&
-					RelocBase == base &&
-					RelocBaseEnd == end) {
-				RelocSection = Section;
-			}
+	if (!EFI_ERROR(efi_status)) {
+		efi_status = direct_load_setup(&s->dl, s->data, s->got,
+					       s->filesize, &context);
+		if (!EFI_ERROR(efi_status)) {
+			dprint(L"Loading image directly as it arrives\n");
+			s->state = STREAM_PLACING;
+			return direct_load_place(&s->dl, 0, s->data, s->got);
 		}
+		if (efi_status != EFI_UNSUPPORTED)
+			return efi_status;
+	}
 
-		if (Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE) {
-			continue;
-		}
+	dprint(L"Image can't be loaded directly, reading it in whole\n");
+	s->state = STREAM_BUFFERING;
+	return image_stream_grow(s, s->filesize);
+}
 
-		if (!base) {
-			perror(L"Section %d has invalid base address\n", i);
-			return EFI_UNSUPPORTED;
-		}
-		if (!end) {
-			perror(L"Section %d has zero size\n", i);
-			return EFI_UNSUPPORTED;
-		}
+/*
+ * Take the next len bytes of an image that's filesize bytes long, or of
+ * unknown size if filesize is 0.  This is an httpboot_sink_t, and the
+ * stream is set up by the first call.
+ */
+static EFI_STATUS image_stream_write(VOID *ctx, UINT64 filesize,
+				     VOID *buf, UINTN len)
+{
+	struct image_stream *s = ctx;
+	char *p = buf;
+	EFI_STATUS efi_status = EFI_SUCCESS;
+	UINTN n;
 
-		if (!(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) &&
-		    (Section->VirtualAddress < context.SizeOfHeaders ||
-		     Section->PointerToRawData < context.SizeOfHeaders)) {
-			perror(L"Section %d is inside image headers\n", i);
-			return EFI_UNSUPPORTED;
+	if (!s->data) {
+		if (filesize > IMAGE_STREAM_MAX) {
+			perror(L"Image size 0x%lx is not supported\n",
+			       filesize);
+			return EFI_BAD_BUFFER_SIZE;
 		}
+		s->unsized = filesize == 0;
+		s->filesize = filesize;
+		efi_status = image_stream_grow(s, s->unsized ? PAGE_SIZE :
+						  min(s->filesize,
+						      (UINTN)PAGE_SIZE));
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
 
-		if (Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
-			ZeroMem(base, Section->Misc.VirtualSize);
-		} else {
-			if (Section->PointerToRawData < context.SizeOfHeaders) {
-				perror(L"Section %d is inside image headers\n", i);
-				return EFI_UNSUPPORTED;
-			}
+	if (filesize != (s->unsized ? 0 : s->filesize)) {
+		perror(L"Image size changed from 0x%lx to 0x%lx\n",
+		       s->filesize, filesize);
+		return EFI_BAD_BUFFER_SIZE;
+	}
 
-			if (Section->SizeOfRawData > 0)
-				CopyMem(base, data + Section->PointerToRawData,
-					Section->SizeOfRawData);
+	while (len && !EFI_ERROR(efi_status)) {
+		if (s->state != STREAM_HEADERS &&
+		    len > s->filesize - s->got) {
+			perror(L"Received more of the image than expected\n");
+			return EFI_BAD_BUFFER_SIZE;
+		}
 
-			if (Section->SizeOfRawData < Section->Misc.VirtualSize)
-				ZeroMem(base + Section->SizeOfRawData,
-					Section->Misc.VirtualSize - Section->SizeOfRawData);
+		switch (s->state) {
+		case STREAM_HEADERS:
+			n = min(len, s->datasize - s->got);
+			CopyMem(s->data + s->got, p, n);
+			s->got += n;
+			p += n;
+			len -= n;
+			if (s->got == s->datasize)
+				efi_status = image_stream_headers(s);
+			break;
+		case STREAM_PLACING:
+			efi_status = direct_load_place(&s->dl, s->got, p, len);
+			s->got += len;
+			len = 0;
+			break;
+		case STREAM_BUFFERING:
+			if (p != s->data + s->got)
+				CopyMem(s->data + s->got, p, len);
+			s->got += len;
+			len = 0;
+			break;
 		}
 	}
 
-	if (context.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC) {
-		perror(L"Image has no relocation entry\n");
-		FreePool(buffer);
-		return EFI_UNSUPPORTED;
-	}
+	return efi_status;
+}
 
-	if (context.RelocDir->Size && RelocSection) {
-		/*
-		 * Run the relocation fixups
-		 */
-		efi_status = relocate_coff(&context, RelocSection, data,
-					   buffer);
+#if defined(ENABLE_HTTPBOOT)
+/*
+ * Where the next bytes of the image should be received to, so that
+ * image_stream_write() won't have to copy them.  This is an
+ * httpboot_place_t.
+ */
+static VOID *image_stream_place(VOID *ctx, UINTN *len)
+{
+	struct image_stream *s = ctx;
 
-		if (EFI_ERROR(efi_status)) {
-			perror(L"Relocation failed: %r\n", efi_status);
-			FreePool(buffer);
-			return efi_status;
-		}
+	*len = 0;
+	switch (s->state) {
+	case STREAM_HEADERS:
+		if (s->data)
+			*len = s->datasize - s->got;
+		break;
+	case STREAM_PLACING:
+		return direct_load_where(&s->dl, s->got, len);
+	case STREAM_BUFFERING:
+		if (s->got == s->filesize)
+			break;
+		*len = s->filesize - s->got;
+		return s->data + s->got;
 	}
+	return NULL;
+}
+#endif
+
+/*
+ * Once all of the image has arrived, verify it and get it ready to run.
+ */
+static EFI_STATUS image_stream_finish(struct image_stream *s,
+				      EFI_LOADED_IMAGE *li,
+				      EFI_IMAGE_ENTRY_POINT *entry_point,
+				      EFI_PHYSICAL_ADDRESS *alloc_address,
+				      UINTN *alloc_pages)
+{
+	EFI_STATUS efi_status;
 
 	/*
-	 * grub needs to know its location and size in memory, so fix up
-	 * the loaded image protocol values
+	 * An image of unknown size can end before a page of it has come
+	 * in to look at the headers in
 	 */
-	li->ImageBase = buffer;
-	li->ImageSize = context.ImageSize;
+	if (s->state == STREAM_HEADERS && s->unsized && s->got) {
+		efi_status = image_stream_headers(s);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
 
-	/* Pass the load options to the second stage loader */
-	if ( load_options ) {
-		li->LoadOptions = load_options;
-		li->LoadOptionsSize = load_options_size;
+	if (!s->data || s->got != s->filesize) {
+		perror(L"Image is truncated\n");
+		return EFI_LOAD_ERROR;
 	}
 
-	if (!found_entry_point) {
-		perror(L"Entry point is not within sections\n");
-		return EFI_UNSUPPORTED;
+	if (s->state == STREAM_PLACING)
+		return direct_load_finish(&s->dl, li, entry_point,
+					  alloc_address, alloc_pages);
+
+	return handle_image(s->data, s->filesize, li, entry_point,
+			    alloc_address, alloc_pages);
+}
+#endif
+
+#if defined(ENABLE_LZ4)
+/*
+ * Load an image from an LZ4 compressed file: read it a chunk at a time,
+ * decompress each chunk while the next one is read, and load what comes
+ * out of that as it comes.
+ */
+static EFI_STATUS load_compressed_file(struct image_reader *reader,
+				       EFI_LOADED_IMAGE *li,
+				       EFI_IMAGE_ENTRY_POINT *entry_point,
+				       EFI_PHYSICAL_ADDRESS *alloc_address,
+				       UINTN *alloc_pages)
+{
+	EFI_STATUS efi_status;
+	struct image_stream stream;
+	struct lz4_stream lz4;
+	UINTN offset = 0, len, nextlen = 0;
+	int which = 0;
+
+	dprint(L"Decompressing LZ4 image\n");
+	ZeroMem(&stream, sizeof(stream));
+	lz4_stream_init(&lz4, image_stream_write, NULL, &stream);
+
+	len = min(reader->size, reader->chunk);
+	efi_status = image_read_start(reader, 0, reader->scratch[which], len);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	while (offset < reader->size) {
+		efi_status = image_read_wait(reader);
+		if (EFI_ERROR(efi_status))
+			goto done;
+
+		/* Get the next chunk coming before decompressing this one */
+		if (offset + len < reader->size) {
+			nextlen = min(reader->size - offset - len,
+				      reader->chunk);
+			efi_status = image_read_start(reader, offset + len,
+						      reader->scratch[!which],
+						      nextlen);
+			if (EFI_ERROR(efi_status))
+				goto done;
+		}
+
+		efi_status = lz4_stream_write(&lz4, reader->size,
+					      reader->scratch[which], len);
+		if (EFI_ERROR(efi_status))
+			goto done;
+
+		offset += len;
+		len = nextlen;
+		which = !which;
 	}
-	if (found_entry_point > 1) {
-		perror(L"%d sections contain entry point\n");
-		return EFI_UNSUPPORTED;
+
+	efi_status = lz4_stream_finish(&lz4);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	efi_status = image_stream_finish(&stream, li, entry_point,
+					 alloc_address, alloc_pages);
+
+done:
+	image_read_wait(reader);
+	lz4_stream_free(&lz4);
+	image_stream_free(&stream);
+	return efi_status;
+}
+#endif
+
+/*
+ * Load an image, the filesize bytes of file from base on, and get it
+ * ready to run: straight from the file into place when we can,
+ * otherwise by reading it in whole first.  In the latter case *data is
+ * the buffer it was read into.
+ */
+static EFI_STATUS handle_image_file(EFI_FILE *file, UINTN base,
+				    UINTN filesize,
+				    EFI_LOADED_IMAGE *li, void **data,
+				    int *datasize,
+				    EFI_IMAGE_ENTRY_POINT *entry_point,
+				    EFI_PHYSICAL_ADDRESS *alloc_address,
+				    UINTN *alloc_pages)
+{
+	EFI_STATUS efi_status;
+	struct image_reader reader;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	struct image_layout layout;
+	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	BOOLEAN fallback = TRUE, hashed = FALSE;
+#if defined(ENABLE_LZ4)
+	UINT8 magic[4];
+#endif
+
+	ZeroMem(&layout, sizeof(layout));
+	efi_status = image_reader_init(&reader, li->DeviceHandle, file,
+				       base, filesize);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+#if defined(ENABLE_LZ4)
+	if (filesize >= sizeof(magic) &&
+	    !EFI_ERROR(read_file_at(file, base, magic, sizeof(magic))) &&
+	    lz4_is_frame(magic, sizeof(magic))) {
+		efi_status = load_compressed_file(&reader, li, entry_point,
+						  alloc_address, alloc_pages);
+		goto done;
 	}
+#endif
 
-	return EFI_SUCCESS;
+	efi_status = load_image_direct(&reader, li, entry_point,
+				       alloc_address, alloc_pages, &fallback);
+	if (EFI_ERROR(efi_status) || !fallback)
+		goto done;
+
+	efi_status = read_image_hashed(&reader, data, &context, &layout,
+				       sha256hash, sha1hash, &hashed);
+	if (*data)
+		*datasize = filesize;
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	if (!hashed) {
+		efi_status = handle_image(*data, *datasize, li, entry_point,
+					  alloc_address, alloc_pages);
+		goto done;
+	}
+
+	/*
+	 * The headers and layout were worked out when only part of the
+	 * file was there, but with its full size, so they hold for all of
+	 * it; there's no need to parse them again.
+	 */
+	efi_status = load_hashed_image(*data, *datasize, &context, &layout,
+				       sha256hash, sha1hash, li, entry_point,
+				       alloc_address, alloc_pages);
+done:
+	image_layout_free(&layout);
+	image_reader_free(&reader);
+	return efi_status;
 }
 
 static int
@@ -1652,6 +3748,7 @@ should_use_fallback(EFI_HANDLE image_handle)
 	EFI_FILE *vh = NULL;
 	EFI_FILE *fh = NULL;
 	EFI_STATUS efi_status;
+	UINTN offset, size;
 	int ret = 0;
 
 	efi_status = gBS->HandleProtocol(image_handle, &EFI_LOADED_IMAGE_GUID,
@@ -1695,6 +3792,12 @@ should_use_fallback(EFI_HANDLE image_handle)
 
 	efi_status = vh->Open(vh, &fh, L"\\EFI\\BOOT" FALLBACK,
 			      EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(efi_status)) {
+		fh = NULL;
+		efi_status = bundle_find(li->DeviceHandle,
+					 L"\\EFI\\BOOT" BUNDLE, FALLBACK,
+					 &fh, &offset, &size);
+	}
 	if (EFI_ERROR(efi_status)) {
 		/* Do not print the error here - this is an acceptable case
 		 * for removable media, where we genuinely don't want
@@ -1811,16 +3914,16 @@ error:
 }
 
 /*
- * Open the second stage bootloader and read it into a buffer
+ * Open the file an image is to be loaded from, and find out how big it is
  */
-static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
-			      int *datasize, CHAR16 *PathName)
+static EFI_STATUS open_image (EFI_LOADED_IMAGE *li, CHAR16 *PathName,
+			      EFI_FILE **file, UINTN *filesize)
 {
 	EFI_STATUS efi_status;
 	EFI_HANDLE device;
 	EFI_FILE_INFO *fileinfo = NULL;
 	EFI_FILE_IO_INTERFACE *drive;
-	EFI_FILE *root, *grub;
+	EFI_FILE *root, *grub = NULL;
 	UINTN buffersize = sizeof(EFI_FILE_INFO);
 
 	device = li->DeviceHandle;
@@ -1846,8 +3949,15 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 	 * And then open the file
 	 */
 	efi_status = root->Open(root, &grub, PathName, EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(efi_status)) {
+	root->Close(root);
+	if (efi_status == EFI_NOT_FOUND) {
+		/* the caller may look for it in the bundle instead */
+		dprint(L"%s not found\n", PathName);
+		grub = NULL;
+		goto error;
+	} else if (EFI_ERROR(efi_status)) {
 		perror(L"Failed to open %s - %r\n", PathName, efi_status);
+		grub = NULL;
 		goto error;
 	}
 
@@ -1860,8 +3970,7 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 	}
 
 	/*
-	 * Find out how big the file is in order to allocate the storage
-	 * buffer
+	 * Find out how big the file is, so we know how much to read
 	 */
 	efi_status = grub->GetInfo(grub, &EFI_FILE_INFO_GUID, &buffersize,
 				   fileinfo);
@@ -1882,45 +3991,82 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 		goto error;
 	}
 
-	buffersize = fileinfo->FileSize;
-	*data = AllocatePool(buffersize);
-	if (!*data) {
-		perror(L"Unable to allocate file buffer\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto error;
-	}
-
-	/*
-	 * Perform the actual read
-	 */
-	efi_status = grub->Read(grub, &buffersize, *data);
-	if (efi_status == EFI_BUFFER_TOO_SMALL) {
-		FreePool(*data);
-		*data = AllocatePool(buffersize);
-		efi_status = grub->Read(grub, &buffersize, *data);
-	}
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Unexpected return from initial read: %r, buffersize %x\n",
-		       efi_status, buffersize);
+	if (fileinfo->FileSize > 0x7fffffff) {
+		perror(L"%s is too large\n", PathName);
+		efi_status = EFI_INVALID_PARAMETER;
 		goto error;
 	}
 
-	*datasize = buffersize;
+	*file = grub;
+	*filesize = fileinfo->FileSize;
 
 	FreePool(fileinfo);
 
 	return EFI_SUCCESS;
 error:
-	if (*data) {
-		FreePool(*data);
-		*data = NULL;
-	}
+	if (grub)
+		grub->Close(grub);
 
 	if (fileinfo)
 		FreePool(fileinfo);
 	return efi_status;
 }
 
+/*
+ * Look for ImagePath in the bundle next to us.  Only plain names are
+ * looked for, since a path to somewhere else means that file and no
+ * other.  If it's there, *path is set to the bundle's path followed by
+ * the member's name, which is what the image is recorded and measured
+ * as having been loaded from.
+ */
+static EFI_STATUS open_bundle_member(EFI_LOADED_IMAGE *li,
+				     CHAR16 *ImagePath, EFI_FILE **file,
+				     UINTN *offset, UINTN *size,
+				     EFI_DEVICE_PATH **path)
+{
+	EFI_STATUS efi_status;
+	EFI_DEVICE_PATH *bundledp = NULL, *memberdp = NULL;
+	CHAR16 *BundlePath = NULL;
+	CHAR16 *name, *p;
+
+	name = ImagePath[0] == L'\\' ? ImagePath + 1 : ImagePath;
+	for (p = name; *p; p++) {
+		if (*p == L'\\' || *p == L'/')
+			return EFI_NOT_FOUND;
+	}
+
+	efi_status = generate_path_from_image_path(li, BUNDLE, &BundlePath);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = bundle_find(li->DeviceHandle, BundlePath, name,
+				 file, offset, size);
+	if (EFI_ERROR(efi_status))
+		goto done;
+
+	bundledp = FileDevicePath(NULL, BundlePath);
+	memberdp = FileDevicePath(NULL, name);
+	*path = (bundledp && memberdp) ?
+		AppendDevicePath(bundledp, memberdp) : NULL;
+	if (!*path) {
+		perror(L"Unable to build path for %s in %s\n", name,
+		       BundlePath);
+		(*file)->Close(*file);
+		*file = NULL;
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto done;
+	}
+	console_print(L"Loading %s from %s\n", name, BundlePath);
+
+done:
+	if (bundledp)
+		FreePool(bundledp);
+	if (memberdp)
+		FreePool(memberdp);
+	FreePool(BundlePath);
+	return efi_status;
+}
+
 /*
  * Protocol entry point. If secure boot is enabled, verify that the provided
  * buffer is signed with a trusted key.
@@ -1963,8 +4109,11 @@ EFI_STATUS shim_verify (void *buffer, UINT32 size)
 		goto done;
 	}
 
-	efi_status = verify_buffer(buffer, size, &context,
-				   sha256hash, sha1hash);
+	efi_status = perf_time(PERF_VERIFY_SIGNATURES, size,
+			verify_signatures((char *)buffer +
+					  context.SecDir->VirtualAddress,
+					  size, &context,
+					  sha256hash, sha1hash));
 done:
 	in_protocol = 0;
 	return efi_status;
@@ -2013,7 +4162,19 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	void *sourcebuffer = NULL;
 	UINT64 sourcesize = 0;
 	void *data = NULL;
-	int datasize;
+	int datasize = 0;
+	EFI_FILE *file = NULL;
+	UINTN fileoffset = 0, filesize = 0;
+	EFI_DEVICE_PATH *FilePath = NULL;
+#if defined(ENABLE_LZ4)
+	struct lz4_stream lz4;
+#endif
+#if defined(HAVE_IMAGE_STREAM)
+	struct image_stream stream;
+	BOOLEAN streamed = FALSE;
+
+	ZeroMem(&stream, sizeof(stream));
+#endif
 
 	/*
 	 * We need to refer to the loaded image protocol on the running
@@ -2049,26 +4210,84 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 			       efi_status);
 			return efi_status;
 		}
+		/* datasize is an int, and has to be right before it's used */
+		if (sourcesize > 0x7fffffff) {
+			perror(L"TFTP image is too large\n");
+			FreePool(sourcebuffer);
+			efi_status = EFI_INVALID_PARAMETER;
+			goto done;
+		}
 		data = sourcebuffer;
 		datasize = sourcesize;
+		perf_mem_alloc(datasize);
+#if defined(ENABLE_LZ4)
+		if (lz4_is_frame(data, datasize)) {
+			lz4_stream_init(&lz4, image_stream_write, NULL,
+					&stream);
+			efi_status = lz4_stream_write(&lz4, datasize, data,
+						      datasize);
+			if (!EFI_ERROR(efi_status))
+				efi_status = lz4_stream_finish(&lz4);
+			lz4_stream_free(&lz4);
+
+			/* the compressed image is no use to anyone now */
+			FreePool(data);
+			perf_mem_free(datasize);
+			data = NULL;
+			datasize = 0;
+			if (EFI_ERROR(efi_status)) {
+				perror(L"Unable to decompress TFTP image: %r\n",
+				       efi_status);
+				image_stream_free(&stream);
+				return efi_status;
+			}
+			streamed = TRUE;
+		}
+#endif
 #if  defined(ENABLE_HTTPBOOT)
 	} else if (find_httpboot(li->DeviceHandle)) {
-		efi_status = httpboot_fetch_buffer (image_handle,
-						    &sourcebuffer,
-						    &sourcesize);
+		/*
+		 * The image is loaded as it arrives, received right where it
+		 * belongs wherever it can be, rather than being collected and
+		 * then copied into place
+		 */
+#if defined(ENABLE_LZ4)
+		lz4_stream_init(&lz4, image_stream_write, image_stream_place,
+				&stream);
+		efi_status = httpboot_fetch_stream(image_handle,
+						   lz4_stream_write,
+						   lz4_stream_place, &lz4);
+		if (!EFI_ERROR(efi_status))
+			efi_status = lz4_stream_finish(&lz4);
+		lz4_stream_free(&lz4);
+#else
+		efi_status = httpboot_fetch_stream(image_handle,
+						   image_stream_write,
+						   image_stream_place,
+						   &stream);
+#endif
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Unable to fetch HTTP image: %r\n",
 			       efi_status);
+			image_stream_free(&stream);
 			return efi_status;
 		}
-		data = sourcebuffer;
-		datasize = sourcesize;
+		streamed = TRUE;
 #endif
 	} else {
 		/*
-		 * Read the new executable off disk
+		 * Find the new executable on disk; it's read in when it's
+		 * loaded.  A file of its own always wins, and the bundle is
+		 * only looked in when there isn't one, so a bundle that's
+		 * been left behind can't hide a newer file.
 		 */
-		efi_status = load_image(li, &data, &datasize, PathName);
+		efi_status = open_image(li, PathName, &file, &filesize);
+		if (efi_status == EFI_NOT_FOUND)
+			efi_status = open_bundle_member(li, ImagePath, &file,
+							&fileoffset, &filesize,
+							&FilePath);
+		else if (!EFI_ERROR(efi_status))
+			dprint(L"Loading %s\n", PathName);
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Failed to load image %s: %r\n",
 			       PathName, efi_status);
@@ -2090,9 +4309,15 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	CopyMem(&li_bak, li, sizeof(li_bak));
 
 	/*
-	 * Update the loaded image with the second stage loader file path
+	 * Update the loaded image with the second stage loader file path,
+	 * or the bundle and member it came from
 	 */
-	li->FilePath = FileDevicePath(NULL, PathName);
+	if (FilePath) {
+		li->FilePath = FilePath;
+		FilePath = NULL;
+	} else {
+		li->FilePath = FileDevicePath(NULL, PathName);
+	}
 	if (!li->FilePath) {
 		perror(L"Unable to update loaded image file path\n");
 		efi_status = EFI_OUT_OF_RESOURCES;
@@ -2102,8 +4327,18 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	/*
 	 * Verify and, if appropriate, relocate and execute the executable
 	 */
-	efi_status = handle_image(data, datasize, li, &entry_point,
-				  &alloc_address, &alloc_pages);
+	if (file)
+		efi_status = handle_image_file(file, fileoffset, filesize, li,
+					       &data, &datasize, &entry_point,
+					       &alloc_address, &alloc_pages);
+#if defined(HAVE_IMAGE_STREAM)
+	else if (streamed)
+		efi_status = image_stream_finish(&stream, li, &entry_point,
+						 &alloc_address, &alloc_pages);
+#endif
+	else
+		efi_status = handle_image(data, datasize, li, &entry_point,
+					  &alloc_address, &alloc_pages);
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Failed to load image: %r\n", efi_status);
 		PrintErrors();
@@ -2113,6 +4348,26 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 
 	loader_is_participating = 0;
 
+	/*
+	 * Everything the image needs has been copied into place, so drop
+	 * the file and the buffer it was read into now, rather than leave
+	 * them taking up memory the next stage might want for itself.
+	 */
+	if (file) {
+		file->Close(file);
+		file = NULL;
+	}
+	if (data) {
+		FreePool(data);
+		perf_mem_free(datasize);
+		data = NULL;
+	}
+#if defined(HAVE_IMAGE_STREAM)
+	image_stream_free(&stream);
+#endif
+
+	perf_report();
+
 	/*
 	 * The binary is trusted and relocated. Run it
 	 */
@@ -2130,8 +4385,19 @@ done:
 	if (PathName)
 		FreePool(PathName);
 
-	if (data)
+	if (FilePath)
+		FreePool(FilePath);
+
+	if (file)
+		file->Close(file);
+
+	if (data) {
 		FreePool(data);
+		perf_mem_free(datasize);
+	}
+#if defined(HAVE_IMAGE_STREAM)
+	image_stream_free(&stream);
+#endif
 
 	return efi_status;
 }
@@ -2675,6 +4941,14 @@ shim_init(void)
 
 	hook_exit(systab);
 
+	/*
+	 * Read and index db, dbx, MokList and friends now, rather than
+	 * once per check.
+	 */
+	efi_status = sigdb_init();
+	if (EFI_ERROR(efi_status))
+		perror(L"sigdb_init() failed: %r\n", efi_status);
+
 	efi_status = install_shim_protocols();
 	if (EFI_ERROR(efi_status))
 		perror(L"install_shim_protocols() failed: %r\n", efi_status);
@@ -2700,6 +4974,14 @@ shim_fini(void)
 
 	unhook_exit();
 
+	sigdb_fini();
+#if defined(ENABLE_SHIM_CERT)
+	sigdb_anchor_free(&build_cert_anchor);
+#endif /* defined(ENABLE_SHIM_CERT) */
+#if defined(VENDOR_CERT_FILE)
+	sigdb_anchor_free(&vendor_cert_anchor);
+#endif /* defined(VENDOR_CERT_FILE) */
+
 	/*
 	 * Free the space allocated for the alternative 2nd stage loader
 	 */
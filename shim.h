@@ -120,6 +120,7 @@
 #endif
 
 #include "include/asm.h"
+#include "include/bundle.h"
 #include "include/compiler.h"
 #include "include/configtable.h"
 #include "include/console.h"
@@ -132,18 +133,23 @@
 #include "include/httpboot.h"
 #include "include/Ip4Config2.h"
 #include "include/Ip6Config.h"
+#include "include/lz4.h"
+#include "include/mp.h"
 #include "include/netboot.h"
 #include "include/PasswordCrypt.h"
 #include "include/PeImage.h"
+#include "include/perf.h"
 #include "include/replacements.h"
 #if defined(OVERRIDE_SECURITY_POLICY)
 #include "include/security_policy.h"
 #endif
+#include "include/sigdb.h"
 #include "include/simple_file.h"
 #include "include/str.h"
 #include "include/tpm.h"
 #include "include/ucs2.h"
 #include "include/variables.h"
+#include "include/verifycache.h"
 
 #include "version.h"
 
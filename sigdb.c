@@ -0,0 +1,567 @@
+/*
+ * sigdb.c - parsed, in-memory copies of the signature databases
+ *
+ * Every hash or certificate check used to fetch db, dbx, MokList or
+ * MokListX with GetVariable(), walk it linearly and free it again.  On
+ * machines with SMM backed variable stores each of those reads costs
+ * milliseconds, and a single image can need a dozen of them.  Instead,
+ * each database is read once, kept for the lifetime of shim, and its
+ * SHA-1 and SHA-256 entries are pulled out into sorted arrays so that
+ * membership is a binary search.  The cached copy is only dropped when
+ * shim itself writes or deletes the variable it came from.
+ *
+ * Nearly every lookup is a miss - an image hash is almost never in dbx -
+ * so each table also gets a small Bloom filter keyed on the digest
+ * prefix, which answers most misses with three bit tests, and a
+ * first-byte bucket table that narrows the binary search for the rest.
+ *
+ * The X509 entries get the same treatment: each one becomes a trust
+ * anchor whose decoded certificate store is built on first use and then
+ * reused for every signature checked against it.
+ */
+
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+
+#include <stdint.h>
+
+/*
+ * Bits of Bloom filter per entry, rounded up to a power of two overall.
+ * With three probes that's a false positive rate of about 0.5%, and a
+ * false positive only costs the binary search we'd have done anyway.
+ */
+#define SIGDB_BLOOM_BITS_PER_ENTRY	16
+#define SIGDB_BLOOM_PROBES		3
+
+struct sigdb_digests {
+	EFI_GUID *type;
+	UINTN size;
+	UINT8 *digests;
+	UINTN count;
+	UINT32 *bloom;
+	UINT32 bloom_mask;
+	UINT32 buckets[257];
+};
+
+#define SIGDB_SHA1	0
+#define SIGDB_SHA256	1
+#define SIGDB_NHASHES	2
+
+struct sigdb {
+	CHAR16 *name;		/* variable name, NULL for built-in lists */
+	EFI_GUID *guid;
+	CHAR16 *dbname;		/* name to measure into the TPM on a match */
+	BOOLEAN loaded;
+	BOOLEAN present;
+	UINT8 *data;
+	UINTN datasize;
+	struct sigdb_digests hashes[SIGDB_NHASHES];
+	struct sigdb_anchor *anchors;
+	UINTN nanchors;
+};
+
+static struct sigdb sigdbs[SIGDB_MAX] = {
+	[SIGDB_DB] = {
+		.name = L"db",
+		.guid = &EFI_SECURE_BOOT_DB_GUID,
+		.dbname = L"db",
+	},
+	[SIGDB_DBX] = {
+		.name = L"dbx",
+		.guid = &EFI_SECURE_BOOT_DB_GUID,
+		.dbname = L"dbx",
+	},
+	[SIGDB_MOK] = {
+		.name = L"MokList",
+		.guid = &SHIM_LOCK_GUID,
+		.dbname = L"MokList",
+	},
+	[SIGDB_MOKX] = {
+		.name = L"MokListX",
+		.guid = &SHIM_LOCK_GUID,
+		.dbname = L"MokListX",
+	},
+	[SIGDB_VENDOR_DB] = {
+		.guid = &EFI_SECURE_BOOT_DB_GUID,
+		.dbname = L"vendor_db",
+	},
+	[SIGDB_VENDOR_DBX] = {
+		.guid = &EFI_SECURE_BOOT_DB_GUID,
+		.dbname = L"dbx",
+	},
+};
+
+UINTN sigdb_generation = 0;
+
+static void
+swap_digests(UINT8 *a, UINT8 *b, UINTN size)
+{
+	UINT8 tmp;
+	UINTN i;
+
+	for (i = 0; i < size; i++) {
+		tmp = a[i];
+		a[i] = b[i];
+		b[i] = tmp;
+	}
+}
+
+static void
+sift_digests(UINT8 *base, UINTN size, UINTN root, UINTN end)
+{
+	UINTN child;
+
+	while ((child = root * 2 + 1) < end) {
+		if (child + 1 < end &&
+		    CompareMem(base + child * size,
+			       base + (child + 1) * size, size) < 0)
+			child++;
+		if (CompareMem(base + root * size,
+			       base + child * size, size) >= 0)
+			return;
+		swap_digests(base + root * size, base + child * size, size);
+		root = child;
+	}
+}
+
+/*
+ * Heapsort: in place, no recursion, and no quadratic case on the
+ * already-sorted lists that dbx updates tend to be.
+ */
+static void
+sort_digests(UINT8 *base, UINTN count, UINTN size)
+{
+	UINTN i;
+
+	if (count < 2)
+		return;
+
+	for (i = count / 2; i > 0; i--)
+		sift_digests(base, size, i - 1, count);
+	for (i = count - 1; i > 0; i--) {
+		swap_digests(base, base + i * size, size);
+		sift_digests(base, size, 0, i);
+	}
+}
+
+/*
+ * The digests are already uniformly distributed, so the probe positions
+ * are just successive 32-bit words of the digest itself.
+ */
+static inline UINT32
+digest_word(UINT8 *digest, UINTN n)
+{
+	UINT8 *p = digest + n * sizeof(UINT32);
+
+	return (UINT32)p[0] | (UINT32)p[1] << 8 |
+	       (UINT32)p[2] << 16 | (UINT32)p[3] << 24;
+}
+
+static EFI_STATUS
+build_filters(struct sigdb_digests *h)
+{
+	UINTN bits = 32, i, j;
+	UINT8 *digest;
+
+	while (bits < h->count * SIGDB_BLOOM_BITS_PER_ENTRY &&
+	       bits < 0x80000000UL)
+		bits <<= 1;
+
+	h->bloom = AllocateZeroPool(bits / 8);
+	if (!h->bloom)
+		return EFI_OUT_OF_RESOURCES;
+	h->bloom_mask = bits - 1;
+
+	ZeroMem(h->buckets, sizeof(h->buckets));
+	for (i = 0; i < h->count; i++) {
+		digest = h->digests + i * h->size;
+		for (j = 0; j < SIGDB_BLOOM_PROBES; j++) {
+			UINT32 bit = digest_word(digest, j) & h->bloom_mask;
+
+			h->bloom[bit / 32] |= 1U << (bit % 32);
+		}
+		h->buckets[digest[0] + 1]++;
+	}
+	/* turn the per-byte counts into start offsets */
+	for (i = 1; i < 257; i++)
+		h->buckets[i] += h->buckets[i - 1];
+
+	return EFI_SUCCESS;
+}
+
+static inline BOOLEAN
+maybe_has_digest(struct sigdb_digests *h, UINT8 *digest)
+{
+	UINTN j;
+
+	for (j = 0; j < SIGDB_BLOOM_PROBES; j++) {
+		UINT32 bit = digest_word(digest, j) & h->bloom_mask;
+
+		if (!(h->bloom[bit / 32] & (1U << (bit % 32))))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOLEAN
+find_digest(struct sigdb_digests *h, UINT8 *digest)
+{
+	UINTN lo, hi;
+
+	if (h->count == 0 || !maybe_has_digest(h, digest))
+		return FALSE;
+
+	lo = h->buckets[digest[0]];
+	hi = h->buckets[digest[0] + 1];
+
+	while (lo < hi) {
+		UINTN mid = lo + (hi - lo) / 2;
+		INTN rc = CompareMem(h->digests + mid * h->size, digest,
+				     h->size);
+
+		if (rc == 0)
+			return TRUE;
+		if (rc < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return FALSE;
+}
+
+/*
+ * Sanity check one EFI_SIGNATURE_LIST header before we walk it.
+ */
+static BOOLEAN
+valid_esl(EFI_SIGNATURE_LIST *esl, UINTN remaining)
+{
+	if (remaining < sizeof(*esl))
+		return FALSE;
+	if (esl->SignatureListSize > remaining ||
+	    esl->SignatureListSize < sizeof(*esl) ||
+	    esl->SignatureHeaderSize > esl->SignatureListSize - sizeof(*esl))
+		return FALSE;
+	if (esl->SignatureSize < sizeof(EFI_GUID))
+		return FALSE;
+	return TRUE;
+}
+
+static UINTN
+esl_count(EFI_SIGNATURE_LIST *esl)
+{
+	return (esl->SignatureListSize - sizeof(*esl) -
+		esl->SignatureHeaderSize) / esl->SignatureSize;
+}
+
+static EFI_STATUS
+index_digests(struct sigdb *db, struct sigdb_digests *h)
+{
+	EFI_SIGNATURE_LIST *esl;
+	EFI_SIGNATURE_DATA *sig;
+	UINTN remaining, count = 0, i;
+	UINT8 *out;
+
+	remaining = db->datasize;
+	esl = (EFI_SIGNATURE_LIST *)db->data;
+	while (remaining > 0 && valid_esl(esl, remaining)) {
+		if (CompareGuid(&esl->SignatureType, h->type) == 0 &&
+		    esl->SignatureSize >= sizeof(EFI_GUID) + h->size)
+			count += esl_count(esl);
+		remaining -= esl->SignatureListSize;
+		esl = (EFI_SIGNATURE_LIST *)((UINT8 *)esl + esl->SignatureListSize);
+	}
+
+	h->count = 0;
+	if (count == 0)
+		return EFI_SUCCESS;
+
+	h->digests = AllocatePool(count * h->size);
+	if (!h->digests)
+		return EFI_OUT_OF_RESOURCES;
+
+	out = h->digests;
+	remaining = db->datasize;
+	esl = (EFI_SIGNATURE_LIST *)db->data;
+	while (remaining > 0 && valid_esl(esl, remaining)) {
+		if (CompareGuid(&esl->SignatureType, h->type) == 0 &&
+		    esl->SignatureSize >= sizeof(EFI_GUID) + h->size) {
+			sig = (EFI_SIGNATURE_DATA *)((UINT8 *)esl + sizeof(*esl) +
+						     esl->SignatureHeaderSize);
+			for (i = 0; i < esl_count(esl); i++) {
+				CopyMem(out, sig->SignatureData, h->size);
+				out += h->size;
+				sig = (EFI_SIGNATURE_DATA *)((UINT8 *)sig +
+							     esl->SignatureSize);
+			}
+		}
+		remaining -= esl->SignatureListSize;
+		esl = (EFI_SIGNATURE_LIST *)((UINT8 *)esl + esl->SignatureListSize);
+	}
+
+	h->count = count;
+	sort_digests(h->digests, h->count, h->size);
+	return build_filters(h);
+}
+
+/*
+ * Only the first certificate of each X509 signature list is ever used
+ * as a trust anchor; that's how the lists have always been consulted.
+ */
+static EFI_STATUS
+index_anchors(struct sigdb *db)
+{
+	EFI_SIGNATURE_LIST *esl;
+	EFI_SIGNATURE_DATA *sig;
+	UINTN remaining, count = 0;
+
+	remaining = db->datasize;
+	esl = (EFI_SIGNATURE_LIST *)db->data;
+	while (remaining > 0 && valid_esl(esl, remaining)) {
+		if (CompareGuid(&esl->SignatureType,
+				&EFI_CERT_TYPE_X509_GUID) == 0 &&
+		    esl_count(esl) > 0)
+			count++;
+		remaining -= esl->SignatureListSize;
+		esl = (EFI_SIGNATURE_LIST *)((UINT8 *)esl + esl->SignatureListSize);
+	}
+
+	db->nanchors = 0;
+	if (count == 0)
+		return EFI_SUCCESS;
+
+	db->anchors = AllocateZeroPool(count * sizeof(*db->anchors));
+	if (!db->anchors)
+		return EFI_OUT_OF_RESOURCES;
+
+	remaining = db->datasize;
+	esl = (EFI_SIGNATURE_LIST *)db->data;
+	while (remaining > 0 && valid_esl(esl, remaining)) {
+		if (CompareGuid(&esl->SignatureType,
+				&EFI_CERT_TYPE_X509_GUID) == 0 &&
+		    esl_count(esl) > 0) {
+			struct sigdb_anchor *a = &db->anchors[db->nanchors++];
+
+			sig = (EFI_SIGNATURE_DATA *)((UINT8 *)esl + sizeof(*esl) +
+						     esl->SignatureHeaderSize);
+			a->cert = sig->SignatureData;
+			a->certsize = esl->SignatureSize - sizeof(EFI_GUID);
+			a->state = ANCHOR_UNCHECKED;
+		}
+		remaining -= esl->SignatureListSize;
+		esl = (EFI_SIGNATURE_LIST *)((UINT8 *)esl + esl->SignatureListSize);
+	}
+
+	return EFI_SUCCESS;
+}
+
+void
+sigdb_anchor_free(struct sigdb_anchor *anchor)
+{
+	if (anchor->store)
+		Pkcs7CertStoreFree(anchor->store);
+	anchor->store = NULL;
+	anchor->state = ANCHOR_UNCHECKED;
+}
+
+static void
+unload_one(struct sigdb *db)
+{
+	UINTN i;
+
+	for (i = 0; i < db->nanchors; i++)
+		sigdb_anchor_free(&db->anchors[i]);
+	if (db->anchors)
+		FreePool(db->anchors);
+	db->anchors = NULL;
+	db->nanchors = 0;
+
+	for (i = 0; i < SIGDB_NHASHES; i++) {
+		if (db->hashes[i].digests)
+			FreePool(db->hashes[i].digests);
+		if (db->hashes[i].bloom)
+			FreePool(db->hashes[i].bloom);
+		db->hashes[i].digests = NULL;
+		db->hashes[i].bloom = NULL;
+		db->hashes[i].count = 0;
+	}
+	if (db->name && db->data)
+		FreePool(db->data);
+	db->data = NULL;
+	db->datasize = 0;
+	db->present = FALSE;
+	db->loaded = FALSE;
+}
+
+static EFI_STATUS
+load_one(sigdb_id_t id)
+{
+	struct sigdb *db = &sigdbs[id];
+	EFI_STATUS efi_status;
+	UINTN i;
+
+	if (db->loaded)
+		return EFI_SUCCESS;
+
+	db->hashes[SIGDB_SHA1].type = &EFI_CERT_SHA1_GUID;
+	db->hashes[SIGDB_SHA1].size = SHA1_DIGEST_SIZE;
+	db->hashes[SIGDB_SHA256].type = &EFI_CERT_SHA256_GUID;
+	db->hashes[SIGDB_SHA256].size = SHA256_DIGEST_SIZE;
+
+	if (db->name) {
+		efi_status = get_variable(db->name, &db->data, &db->datasize,
+					  *db->guid);
+		if (EFI_ERROR(efi_status)) {
+			db->data = NULL;
+			db->datasize = 0;
+			db->present = FALSE;
+		} else {
+			db->present = TRUE;
+		}
+	} else if (id == SIGDB_VENDOR_DBX) {
+		db->data = vendor_deauthorized;
+		db->datasize = vendor_deauthorized_size;
+		db->present = TRUE;
+	} else {
+#if defined(VENDOR_DB_FILE)
+		db->data = vendor_authorized;
+		db->datasize = vendor_authorized_size;
+		db->present = TRUE;
+#else
+		db->present = FALSE;
+#endif
+	}
+
+	for (i = 0; db->present && i < SIGDB_NHASHES; i++) {
+		efi_status = index_digests(db, &db->hashes[i]);
+		if (EFI_ERROR(efi_status))
+			goto err;
+	}
+	if (db->present) {
+		efi_status = index_anchors(db);
+		if (EFI_ERROR(efi_status))
+			goto err;
+	}
+
+	dprint(L"indexed %s: %lu sha1, %lu sha256, %lu x509 entries\n",
+	       db->dbname, db->hashes[SIGDB_SHA1].count,
+	       db->hashes[SIGDB_SHA256].count, db->nanchors);
+	db->loaded = TRUE;
+	sigdb_generation++;
+	return EFI_SUCCESS;
+
+err:
+	perror(L"Could not index %s: %r\n", db->dbname, efi_status);
+	unload_one(db);
+	return efi_status;
+}
+
+/*
+ * Load and index every database up front, so the first verification
+ * doesn't pay for it.
+ */
+EFI_STATUS
+sigdb_init(void)
+{
+	EFI_STATUS efi_status;
+	UINTN i;
+
+	for (i = 0; i < SIGDB_MAX; i++) {
+		efi_status = load_one(i);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
+	return EFI_SUCCESS;
+}
+
+void
+sigdb_fini(void)
+{
+	UINTN i;
+
+	for (i = 0; i < SIGDB_MAX; i++)
+		unload_one(&sigdbs[i]);
+	sigdb_generation++;
+}
+
+/*
+ * Drop the cached copy of a variable we're about to have changed
+ * underneath us; it gets reloaded on its next use.
+ */
+void
+sigdb_invalidate(CHAR16 *name, EFI_GUID *guid)
+{
+	UINTN i;
+
+	for (i = 0; i < SIGDB_MAX; i++) {
+		struct sigdb *db = &sigdbs[i];
+
+		if (!db->name || !db->loaded)
+			continue;
+		if (StrCmp(db->name, name) != 0 ||
+		    CompareGuid(db->guid, guid) != 0)
+			continue;
+
+		dprint(L"invalidating %s\n", db->dbname);
+		unload_one(db);
+		sigdb_generation++;
+	}
+}
+
+/*
+ * Check a hash against one of the indexed signature databases
+ */
+CHECK_STATUS
+sigdb_check_hash(sigdb_id_t id, UINT8 *hash, UINTN hashsize,
+		 EFI_GUID *certtype)
+{
+	struct sigdb *db;
+	UINTN i;
+
+	if (id >= SIGDB_MAX || EFI_ERROR(load_one(id)))
+		return VAR_NOT_FOUND;
+
+	db = &sigdbs[id];
+	if (!db->present)
+		return VAR_NOT_FOUND;
+
+	for (i = 0; i < SIGDB_NHASHES; i++) {
+		struct sigdb_digests *h = &db->hashes[i];
+
+		if (h->size != hashsize || CompareGuid(h->type, certtype) != 0)
+			continue;
+
+		if (!find_digest(h, hash))
+			return DATA_NOT_FOUND;
+
+		tpm_measure_variable(db->dbname, *db->guid, hashsize, hash);
+		return DATA_FOUND;
+	}
+
+	return DATA_NOT_FOUND;
+}
+
+/*
+ * Hand out the trust anchors of a database, for the certificate checks.
+ */
+CHECK_STATUS
+sigdb_get_anchors(sigdb_id_t id, struct sigdb_anchor **anchors,
+		  UINTN *nanchors, CHAR16 **dbname, EFI_GUID **guid)
+{
+	struct sigdb *db;
+
+	if (id >= SIGDB_MAX || EFI_ERROR(load_one(id)))
+		return VAR_NOT_FOUND;
+
+	db = &sigdbs[id];
+	if (!db->present)
+		return VAR_NOT_FOUND;
+
+	*anchors = db->anchors;
+	*nanchors = db->nanchors;
+	*dbname = db->dbname;
+	*guid = db->guid;
+	return DATA_FOUND;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,791 @@
+/*
+ * bench.c - time shim's verification and loading paths on the host
+ *
+ * shim.c is built into this file, so its static functions can be
+ * called directly, and it runs against the firmware in test/mock*.c.
+ * Each operation is timed over a number of iterations and reported as
+ * time per operation, throughput, and what it asked of the firmware.
+ * See test/README.
+ */
+
+#include "../shim.c"
+
+#include "host.h"
+#include "mock.h"
+
+/* shim's linker script would have provided these */
+char _text, _data;
+
+struct reloc_fixture {
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	struct image_layout layout;
+	EFI_PHYSICAL_ADDRESS alloc_address;
+	UINTN alloc_pages;
+	char *buffer;
+	char *reloc;
+	UINTN relocsize;
+};
+
+struct bench_image {
+	CHAR8 *name;
+	CHAR16 *path;
+	void *data;
+	UINTN size;
+	BOOLEAN compressed;	/* an LZ4 frame, not an image */
+	EFI_LOADED_IMAGE li;
+	BOOLEAN have_reloc;
+	struct reloc_fixture reloc;
+};
+
+typedef EFI_STATUS (*bench_op_t)(struct bench_image *image);
+
+/*
+ * Signature lists for a variable, built up as the options are read
+ */
+struct esl_buffer {
+	UINT8 *data;
+	UINTN size;
+};
+
+static UINTN iterations = 100;
+static BOOLEAN quiet = TRUE;
+static EFI_LOADED_IMAGE bench_li;
+
+static INTN usage(void)
+{
+	console_print(L"usage: shim-bench [-v] [-n iterations] [-r root] [-t none|1.2|2.0]\n"
+		      L"                  [-c cert.der]... [-d db.esl] [-x dbx.esl] [-m MokList.esl]\n"
+		      L"                  [-h db hashes] [-H dbx hashes] [-k MokList hashes]\n"
+		      L"                  image...\n");
+	return 1;
+}
+
+static BOOLEAN parse_number(CHAR8 *s, UINTN *n)
+{
+	UINTN value = 0;
+
+	if (!*s)
+		return FALSE;
+	for (; *s; s++) {
+		if (*s < '0' || *s > '9')
+			return FALSE;
+		value = value * 10 + (*s - '0');
+	}
+	*n = value;
+	return TRUE;
+}
+
+/*
+ * Read a whole file from the host, relative to where we were started
+ */
+static EFI_STATUS read_host_file(CHAR8 *path, void **data, UINTN *size)
+{
+	UINT64 filesize;
+	UINTN done = 0;
+	INTN fd, ret;
+	UINT8 *buf;
+
+	fd = host_open(path);
+	if (fd < 0) {
+		perror(L"Could not open %a\n", path);
+		return EFI_NOT_FOUND;
+	}
+	if (host_file_size(fd, &filesize) < 0) {
+		host_close(fd);
+		return EFI_DEVICE_ERROR;
+	}
+
+	buf = AllocatePool(filesize ? filesize : 1);
+	if (!buf) {
+		host_close(fd);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	while (done < filesize) {
+		ret = host_pread(fd, buf + done, filesize - done, done);
+		if (ret <= 0) {
+			perror(L"Could not read %a\n", path);
+			FreePool(buf);
+			host_close(fd);
+			return EFI_DEVICE_ERROR;
+		}
+		done += ret;
+	}
+	host_close(fd);
+
+	*data = buf;
+	*size = filesize;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS esl_append(struct esl_buffer *esl, void *data, UINTN size)
+{
+	UINT8 *new;
+
+	new = AllocatePool(esl->size + size);
+	if (!new)
+		return EFI_OUT_OF_RESOURCES;
+	if (esl->data) {
+		CopyMem(new, esl->data, esl->size);
+		FreePool(esl->data);
+	}
+	CopyMem(new + esl->size, data, size);
+	esl->data = new;
+	esl->size += size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS esl_append_file(struct esl_buffer *esl, CHAR8 *path)
+{
+	EFI_STATUS efi_status;
+	void *data;
+	UINTN size;
+
+	efi_status = read_host_file(path, &data, &size);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = esl_append(esl, data, size);
+	FreePool(data);
+	return efi_status;
+}
+
+/*
+ * One list holding one DER certificate
+ */
+static EFI_STATUS esl_add_cert(struct esl_buffer *esl, CHAR8 *path)
+{
+	EFI_STATUS efi_status;
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *sig;
+	UINTN listsize;
+	void *cert;
+	UINTN certsize;
+
+	efi_status = read_host_file(path, &cert, &certsize);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	listsize = sizeof(*list) + sizeof(EFI_GUID) + certsize;
+	list = AllocateZeroPool(listsize);
+	if (!list) {
+		FreePool(cert);
+		return EFI_OUT_OF_RESOURCES;
+	}
+	CopyMem(&list->SignatureType, &EFI_CERT_TYPE_X509_GUID,
+		sizeof(EFI_GUID));
+	list->SignatureListSize = listsize;
+	list->SignatureSize = sizeof(EFI_GUID) + certsize;
+	sig = (EFI_SIGNATURE_DATA *)(list + 1);
+	CopyMem(&sig->SignatureOwner, &SHIM_LOCK_GUID, sizeof(EFI_GUID));
+	CopyMem(sig->SignatureData, cert, certsize);
+
+	efi_status = esl_append(esl, list, listsize);
+	FreePool(list);
+	FreePool(cert);
+	return efi_status;
+}
+
+/*
+ * One list of count SHA-256 hashes that won't match anything, to give
+ * the lookups something to get through
+ */
+static EFI_STATUS esl_add_hashes(struct esl_buffer *esl, UINTN count)
+{
+	static UINT64 seed = 0x9e3779b97f4a7c15ULL;
+	EFI_STATUS efi_status;
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *sig;
+	UINTN sigsize = sizeof(EFI_GUID) + SHA256_DIGEST_SIZE;
+	UINTN listsize, i, j;
+
+	if (!count)
+		return EFI_SUCCESS;
+
+	listsize = sizeof(*list) + count * sigsize;
+	list = AllocateZeroPool(listsize);
+	if (!list)
+		return EFI_OUT_OF_RESOURCES;
+	CopyMem(&list->SignatureType, &EFI_CERT_SHA256_GUID,
+		sizeof(EFI_GUID));
+	list->SignatureListSize = listsize;
+	list->SignatureSize = sigsize;
+
+	sig = (EFI_SIGNATURE_DATA *)(list + 1);
+	for (i = 0; i < count; i++) {
+		CopyMem(&sig->SignatureOwner, &SHIM_LOCK_GUID,
+			sizeof(EFI_GUID));
+		for (j = 0; j < SHA256_DIGEST_SIZE; j++) {
+			/* xorshift64 */
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			sig->SignatureData[j] = seed;
+		}
+		sig = (EFI_SIGNATURE_DATA *)((UINT8 *)sig + sigsize);
+	}
+
+	efi_status = esl_append(esl, list, listsize);
+	FreePool(list);
+	return efi_status;
+}
+
+/*
+ * Load the image through the mock file system, the way start_image()
+ * would find it
+ */
+static EFI_STATUS bench_image_init(struct bench_image *image, CHAR8 *name)
+{
+	EFI_STATUS efi_status;
+	EFI_FILE *file = NULL;
+	UINTN filesize;
+
+	ZeroMem(image, sizeof(*image));
+	image->name = name;
+	image->path = PoolPrint(L"\\%a", name);
+	if (!image->path)
+		return EFI_OUT_OF_RESOURCES;
+
+	CopyMem(&image->li, &bench_li, sizeof(image->li));
+	image->li.FilePath = FileDevicePath(NULL, image->path);
+	if (!image->li.FilePath)
+		return EFI_OUT_OF_RESOURCES;
+
+	efi_status = open_image(&image->li, image->path, &file, &filesize);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Could not open %s: %r\n", image->path, efi_status);
+		return efi_status;
+	}
+
+	image->data = AllocatePool(filesize);
+	if (!image->data) {
+		file->Close(file);
+		return EFI_OUT_OF_RESOURCES;
+	}
+	efi_status = read_file_at(file, 0, image->data, filesize);
+	file->Close(file);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	image->size = filesize;
+	image->compressed = lz4_is_frame(image->data, image->size);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Load the image once, as far as relocating it, so that the relocation
+ * can be timed on its own
+ */
+static EFI_STATUS reloc_fixture_init(struct bench_image *image)
+{
+	struct reloc_fixture *f = &image->reloc;
+	EFI_STATUS efi_status;
+
+	efi_status = read_header(image->data, image->size, &f->context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = image_layout_init(&f->layout, image->data, image->size,
+				       image->size, &f->context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	if (f->context.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC ||
+	    !f->context.RelocDir->Size || !f->layout.RelocSection) {
+		efi_status = EFI_NOT_FOUND;
+		goto err_layout;
+	}
+
+	efi_status = allocate_image(&f->context, &f->alloc_address,
+				    &f->alloc_pages, &f->buffer);
+	if (EFI_ERROR(efi_status))
+		goto err_layout;
+
+	CopyMem(f->buffer, image->data, f->context.SizeOfHeaders);
+	efi_status = check_sections(&f->context, &f->layout, f->buffer);
+	if (EFI_ERROR(efi_status))
+		goto err_pages;
+	copy_sections(&f->context, image->data, f->buffer);
+
+	f->reloc = (char *)image->data + f->layout.RelocSection->PointerToRawData;
+	f->relocsize = image->size - f->layout.RelocSection->PointerToRawData;
+	image->have_reloc = TRUE;
+	return EFI_SUCCESS;
+
+err_pages:
+	gBS->FreePages(f->alloc_address, f->alloc_pages);
+err_layout:
+	image_layout_free(&f->layout);
+	return efi_status;
+}
+
+static void bench_image_free(struct bench_image *image)
+{
+	if (image->have_reloc) {
+		gBS->FreePages(image->reloc.alloc_address,
+			       image->reloc.alloc_pages);
+		image_layout_free(&image->reloc.layout);
+	}
+	if (image->data)
+		FreePool(image->data);
+	if (image->li.FilePath)
+		FreePool(image->li.FilePath);
+	if (image->path)
+		FreePool(image->path);
+}
+
+static EFI_STATUS op_hash(struct bench_image *image)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	EFI_STATUS efi_status;
+
+	efi_status = read_header(image->data, image->size, &context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	return generate_hash(image->data, image->size, &context,
+			     sha256hash, sha1hash);
+}
+
+/*
+ * A new sigdb generation empties the verification cache, so this
+ * checks the signatures every time.  The databases stay indexed.
+ */
+static EFI_STATUS op_verify(struct bench_image *image)
+{
+	sigdb_generation++;
+	verification_method = VERIFIED_BY_NOTHING;
+	return shim_verify(image->data, image->size);
+}
+
+static EFI_STATUS op_verify_cached(struct bench_image *image)
+{
+	verification_method = VERIFIED_BY_NOTHING;
+	return shim_verify(image->data, image->size);
+}
+
+static EFI_STATUS op_relocate(struct bench_image *image)
+{
+	struct reloc_fixture *f = &image->reloc;
+
+	return relocate_coff(&f->context, f->layout.RelocSection,
+			     f->reloc, f->relocsize, f->buffer);
+}
+
+/*
+ * The whole of loading an image that's already in memory
+ */
+static EFI_STATUS op_load(struct bench_image *image)
+{
+	EFI_LOADED_IMAGE li;
+	EFI_IMAGE_ENTRY_POINT entry_point;
+	EFI_PHYSICAL_ADDRESS alloc_address;
+	UINTN alloc_pages;
+	EFI_STATUS efi_status;
+
+	CopyMem(&li, &image->li, sizeof(li));
+	verification_method = VERIFIED_BY_NOTHING;
+	efi_status = handle_image(image->data, image->size, &li, &entry_point,
+				  &alloc_address, &alloc_pages);
+	if (!EFI_ERROR(efi_status))
+		gBS->FreePages(alloc_address, alloc_pages);
+	return efi_status;
+}
+
+/*
+ * The same, but reading the image from the file system as it goes, the
+ * way start_image() does
+ */
+static EFI_STATUS op_load_file(struct bench_image *image)
+{
+	EFI_LOADED_IMAGE li;
+	EFI_IMAGE_ENTRY_POINT entry_point;
+	EFI_PHYSICAL_ADDRESS alloc_address;
+	UINTN alloc_pages, filesize;
+	EFI_FILE *file = NULL;
+	void *data = NULL;
+	int datasize = 0;
+	EFI_STATUS efi_status;
+
+	CopyMem(&li, &image->li, sizeof(li));
+	efi_status = open_image(&li, image->path, &file, &filesize);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	verification_method = VERIFIED_BY_NOTHING;
+	efi_status = handle_image_file(file, 0, filesize, &li, &data,
+				       &datasize, &entry_point,
+				       &alloc_address, &alloc_pages);
+	if (!EFI_ERROR(efi_status))
+		gBS->FreePages(alloc_address, alloc_pages);
+	if (data)
+		FreePool(data);
+	file->Close(file);
+	return efi_status;
+}
+
+#if defined(HAVE_IMAGE_STREAM)
+/* what receive_http_response() takes in at a time */
+#define BENCH_RX_WINDOW		(1024 * 1024)
+
+/*
+ * Loading an image as it arrives over the network, the way start_image()
+ * does for HTTP boot, with the network being a copy out of the image in
+ * memory.  Each piece is received where image_stream_place() says it
+ * goes, if anywhere, and through a window otherwise.
+ */
+static EFI_STATUS op_load_stream(struct bench_image *image)
+{
+	EFI_LOADED_IMAGE li;
+	EFI_IMAGE_ENTRY_POINT entry_point;
+	EFI_PHYSICAL_ADDRESS alloc_address;
+	UINTN alloc_pages, got = 0, len;
+	struct image_stream stream;
+#if defined(ENABLE_LZ4)
+	struct lz4_stream lz4;
+#endif
+	EFI_STATUS (*sink)(VOID *ctx, UINT64 size, VOID *data, UINTN len);
+	VOID *(*place)(VOID *ctx, UINTN *len) = NULL;
+	VOID *ctx = &stream;
+	char *window, *where;
+	EFI_STATUS efi_status = EFI_SUCCESS;
+
+	window = AllocatePool(BENCH_RX_WINDOW);
+	if (!window)
+		return EFI_OUT_OF_RESOURCES;
+
+	ZeroMem(&stream, sizeof(stream));
+	sink = image_stream_write;
+#if defined(ENABLE_HTTPBOOT)
+	place = image_stream_place;
+#endif
+#if defined(ENABLE_LZ4)
+	lz4_stream_init(&lz4, sink, place, ctx);
+	sink = lz4_stream_write;
+	place = lz4_stream_place;
+	ctx = &lz4;
+#endif
+
+	while (got < image->size && !EFI_ERROR(efi_status)) {
+		len = 0;
+		where = place ? place(ctx, &len) : NULL;
+		if (!where) {
+			where = window;
+			if (!len || len > BENCH_RX_WINDOW)
+				len = BENCH_RX_WINDOW;
+		}
+		len = min(len, image->size - got);
+
+		CopyMem(where, (char *)image->data + got, len);
+		efi_status = sink(ctx, image->size, where, len);
+		got += len;
+	}
+#if defined(ENABLE_LZ4)
+	if (!EFI_ERROR(efi_status))
+		efi_status = lz4_stream_finish(&lz4);
+	lz4_stream_free(&lz4);
+#endif
+
+	if (!EFI_ERROR(efi_status)) {
+		CopyMem(&li, &image->li, sizeof(li));
+		verification_method = VERIFIED_BY_NOTHING;
+		efi_status = image_stream_finish(&stream, &li, &entry_point,
+						 &alloc_address, &alloc_pages);
+		if (!EFI_ERROR(efi_status))
+			gBS->FreePages(alloc_address, alloc_pages);
+	}
+
+	image_stream_free(&stream);
+	FreePool(window);
+	return efi_status;
+}
+#endif
+
+static void report_header(void)
+{
+	console_print(L"%-14a %-28a %12a %8a %9a %10a %7a %6a  %a\n",
+		      "op", "image", "ns/op", "MB/s", "allocs/op", "peak-heap",
+		      "reads/op", "tpm/op", "status");
+}
+
+static void report(CHAR8 *op, CHAR8 *name, UINTN bytes, UINTN n,
+		   UINT64 elapsed, UINTN heap_base, EFI_STATUS status)
+{
+	UINT64 per_op = elapsed / n;
+
+	console_print(L"%-14a %-28a %12lu %8lu %9lu %10lu %7lu %6lu  %r\n",
+		      op, name ? name : (CHAR8 *)"-", per_op,
+		      per_op ? bytes * 1000ULL / per_op : 0,
+		      mock_stats.allocs / n, mock_stats.peak - heap_base,
+		      mock_stats.file_reads / n, mock_stats.tpm_events / n, status);
+}
+
+/*
+ * Once untimed, so that the first iteration doesn't pay for setting
+ * anything up, then the rest on the clock
+ */
+static void run(CHAR8 *opname, struct bench_image *image, UINTN bytes,
+		bench_op_t op)
+{
+	EFI_STATUS efi_status;
+	UINT64 start, elapsed;
+	UINTN heap_base, i;
+
+	mock_console_quiet(quiet);
+	op(image);
+	ClearErrors();
+
+	mock_stats_reset();
+	heap_base = mock_stats.live;
+	efi_status = EFI_SUCCESS;
+	start = host_now_ns();
+	for (i = 0; i < iterations; i++) {
+		efi_status = op(image);
+		ClearErrors();
+	}
+	elapsed = host_now_ns() - start;
+	mock_console_quiet(FALSE);
+
+	report(opname, image->name, bytes, iterations, elapsed, heap_base,
+	       efi_status);
+}
+
+/*
+ * Setup that only happens once a boot gets timed once
+ */
+static EFI_STATUS run_once(CHAR8 *opname, EFI_STATUS (*op)(void))
+{
+	EFI_STATUS efi_status;
+	UINT64 start;
+	UINTN heap_base;
+
+	mock_stats_reset();
+	heap_base = mock_stats.live;
+	mock_console_quiet(quiet);
+	start = host_now_ns();
+	efi_status = op();
+	start = host_now_ns() - start;
+	mock_console_quiet(FALSE);
+
+	report(opname, NULL, 0, 1, start, heap_base, efi_status);
+	return efi_status;
+}
+
+static EFI_STATUS bench_import_mok_state(void)
+{
+	return import_mok_state(global_image_handle);
+}
+
+INTN bench_main(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS efi_status;
+	EFI_SYSTEM_TABLE *st;
+	EFI_HANDLE image_handle = NULL, device;
+	struct esl_buffer db = { 0, }, dbx = { 0, }, mok = { 0, };
+	UINTN db_hashes = 0, dbx_hashes = 0, mok_hashes = 0;
+	struct bench_image image;
+	CHAR8 *root = (CHAR8 *)".";
+	CHAR8 *tpm = (CHAR8 *)"none";
+	CHAR8 *arg, *value;
+	UINT8 secure_boot = 1, setup_mode = 0;
+	INTN i;
+
+	st = mock_init();
+	efi_status = mock_install_protocol(&image_handle,
+					   &EFI_LOADED_IMAGE_GUID, &bench_li);
+	if (EFI_ERROR(efi_status))
+		return 1;
+
+	InitializeLib(image_handle, st);
+
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		if (arg[0] != '-' || !arg[1] || arg[2])
+			break;
+		if (arg[1] == 'v') {
+			quiet = FALSE;
+			continue;
+		}
+		if (i + 1 == argc)
+			return usage();
+		value = argv[++i];
+
+		switch (arg[1]) {
+		case 'n':
+			if (!parse_number(value, &iterations) || !iterations)
+				return usage();
+			break;
+		case 'r':
+			root = value;
+			break;
+		case 't':
+			tpm = value;
+			break;
+		case 'c':
+			efi_status = esl_add_cert(&db, value);
+			break;
+		case 'd':
+			efi_status = esl_append_file(&db, value);
+			break;
+		case 'x':
+			efi_status = esl_append_file(&dbx, value);
+			break;
+		case 'm':
+			efi_status = esl_append_file(&mok, value);
+			break;
+		case 'h':
+			if (!parse_number(value, &db_hashes))
+				return usage();
+			break;
+		case 'H':
+			if (!parse_number(value, &dbx_hashes))
+				return usage();
+			break;
+		case 'k':
+			if (!parse_number(value, &mok_hashes))
+				return usage();
+			break;
+		default:
+			return usage();
+		}
+		if (EFI_ERROR(efi_status)) {
+			PrintErrors();
+			return 1;
+		}
+	}
+	if (i == argc)
+		return usage();
+
+	/*
+	 * Without a TPM, or with a TPM 1.2, images can be loaded straight
+	 * from their files; a TPM 2.0 needs the whole file to measure.
+	 */
+	efi_status = EFI_SUCCESS;
+	if (!strcmpa(tpm, (CHAR8 *)"1.2"))
+		efi_status = mock_tcg_install();
+	else if (!strcmpa(tpm, (CHAR8 *)"2.0"))
+		efi_status = mock_tcg2_install();
+	else if (strcmpa(tpm, (CHAR8 *)"none"))
+		return usage();
+	if (EFI_ERROR(efi_status))
+		return 1;
+
+	efi_status = esl_add_hashes(&db, db_hashes);
+	if (!EFI_ERROR(efi_status))
+		efi_status = esl_add_hashes(&dbx, dbx_hashes);
+	if (!EFI_ERROR(efi_status))
+		efi_status = esl_add_hashes(&mok, mok_hashes);
+	if (EFI_ERROR(efi_status))
+		return 1;
+
+	/*
+	 * A machine in user mode with Secure Boot on, booting shim off a
+	 * file system rooted at root
+	 */
+	efi_status = mock_sfs_install(root, &device);
+	if (EFI_ERROR(efi_status))
+		return 1;
+	bench_li.SystemTable = st;
+	bench_li.DeviceHandle = device;
+	bench_li.ImageCodeType = EfiLoaderCode;
+	bench_li.ImageDataType = EfiLoaderData;
+
+	mock_preload_variable(L"SecureBoot", &GV_GUID,
+			      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			      EFI_VARIABLE_RUNTIME_ACCESS,
+			      sizeof(secure_boot), &secure_boot);
+	mock_preload_variable(L"SetupMode", &GV_GUID,
+			      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			      EFI_VARIABLE_RUNTIME_ACCESS,
+			      sizeof(setup_mode), &setup_mode);
+	if (db.size)
+		mock_preload_variable(L"db", &EFI_SECURE_BOOT_DB_GUID,
+				      EFI_VARIABLE_NON_VOLATILE |
+				      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+				      EFI_VARIABLE_RUNTIME_ACCESS |
+				      EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS,
+				      db.size, db.data);
+	if (dbx.size)
+		mock_preload_variable(L"dbx", &EFI_SECURE_BOOT_DB_GUID,
+				      EFI_VARIABLE_NON_VOLATILE |
+				      EFI_VARIABLE_BOOTSERVICE_ACCESS |
+				      EFI_VARIABLE_RUNTIME_ACCESS |
+				      EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS,
+				      dbx.size, dbx.data);
+	if (mok.size)
+		mock_preload_variable(L"MokList", &SHIM_LOCK_GUID,
+				      EFI_VARIABLE_NON_VOLATILE |
+				      EFI_VARIABLE_BOOTSERVICE_ACCESS,
+				      mok.size, mok.data);
+
+	/*
+	 * What efi_main() does before it goes looking for grub
+	 */
+	verification_method = VERIFIED_BY_NOTHING;
+
+	vendor_authorized_size = cert_table.vendor_authorized_size;
+	vendor_authorized = (UINT8 *)&cert_table + cert_table.vendor_authorized_offset;
+
+	vendor_deauthorized_size = cert_table.vendor_deauthorized_size;
+	vendor_deauthorized = (UINT8 *)&cert_table + cert_table.vendor_deauthorized_offset;
+
+#if defined(ENABLE_SHIM_CERT)
+	build_cert_size = sizeof(shim_cert);
+	build_cert = shim_cert;
+#endif /* defined(ENABLE_SHIM_CERT) */
+
+	shim_lock_interface.Verify = shim_verify;
+	shim_lock_interface.Hash = shim_hash;
+	shim_lock_interface.Context = shim_read_header;
+
+	systab = st;
+	global_image_handle = image_handle;
+
+	setup_verbosity();
+	init_openssl();
+
+	report_header();
+	efi_status = run_once((CHAR8 *)"mok-import", bench_import_mok_state);
+	if (!EFI_ERROR(efi_status))
+		efi_status = run_once((CHAR8 *)"init", shim_init);
+	if (EFI_ERROR(efi_status)) {
+		PrintErrors();
+		return 1;
+	}
+
+	for (; i < argc; i++) {
+		efi_status = bench_image_init(&image, argv[i]);
+		if (EFI_ERROR(efi_status)) {
+			PrintErrors();
+			bench_image_free(&image);
+			return 1;
+		}
+
+		/* a compressed image can only be loaded */
+		if (!image.compressed) {
+			run((CHAR8 *)"hash", &image, image.size, op_hash);
+			run((CHAR8 *)"verify", &image, image.size, op_verify);
+			run((CHAR8 *)"verify-cached", &image, image.size,
+			    op_verify_cached);
+			run((CHAR8 *)"load", &image, image.size, op_load);
+		}
+		run((CHAR8 *)"load-file", &image, image.size, op_load_file);
+#if defined(HAVE_IMAGE_STREAM)
+		run((CHAR8 *)"load-stream", &image, image.size,
+		    op_load_stream);
+#endif
+
+		if (!image.compressed &&
+		    !EFI_ERROR(reloc_fixture_init(&image)))
+			run((CHAR8 *)"relocate", &image,
+			    image.reloc.context.RelocDir->Size, op_relocate);
+		ClearErrors();
+
+		bench_image_free(&image);
+	}
+
+	return 0;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,152 @@
+/*
+ * host.c - the Linux system calls under the test harness
+ *
+ * Only x86_64 is supported; the rest of the harness doesn't care.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "host.h"
+
+#define SYS_pread64		17
+#define SYS_write		1
+#define SYS_close		3
+#define SYS_lseek		8
+#define SYS_mmap		9
+#define SYS_munmap		11
+#define SYS_clock_gettime	228
+#define SYS_exit_group		231
+#define SYS_openat		257
+
+#define AT_FDCWD		-100
+#define O_RDONLY		0
+#define O_CLOEXEC		02000000
+#define SEEK_END		2
+#define PROT_READ		1
+#define PROT_WRITE		2
+#define MAP_PRIVATE		0x02
+#define MAP_ANONYMOUS		0x20
+#define CLOCK_REALTIME		0
+#define CLOCK_MONOTONIC		1
+
+struct host_timespec {
+	INT64 tv_sec;
+	INT64 tv_nsec;
+};
+
+static INTN host_syscall(INTN n, INTN a, INTN b, INTN c, INTN d, INTN e,
+			 INTN f)
+{
+	INTN ret;
+	register INTN r10 __asm__("r10") = d;
+	register INTN r8 __asm__("r8") = e;
+	register INTN r9 __asm__("r9") = f;
+
+	__asm__ __volatile__("syscall"
+			     : "=a" (ret)
+			     : "a" (n), "D" (a), "S" (b), "d" (c),
+			       "r" (r10), "r" (r8), "r" (r9)
+			     : "rcx", "r11", "memory");
+	return ret;
+}
+
+INTN host_open(CHAR8 *path)
+{
+	return host_syscall(SYS_openat, AT_FDCWD, (INTN)path,
+			    O_RDONLY | O_CLOEXEC, 0, 0, 0);
+}
+
+INTN host_close(INTN fd)
+{
+	return host_syscall(SYS_close, fd, 0, 0, 0, 0, 0);
+}
+
+INTN host_pread(INTN fd, VOID *buf, UINTN size, UINT64 offset)
+{
+	return host_syscall(SYS_pread64, fd, (INTN)buf, size, offset, 0, 0);
+}
+
+INTN host_write(INTN fd, VOID *buf, UINTN size)
+{
+	return host_syscall(SYS_write, fd, (INTN)buf, size, 0, 0, 0);
+}
+
+INTN host_file_size(INTN fd, UINT64 *size)
+{
+	INTN ret;
+
+	ret = host_syscall(SYS_lseek, fd, 0, SEEK_END, 0, 0, 0);
+	if (ret < 0)
+		return ret;
+	*size = ret;
+	return 0;
+}
+
+VOID *host_map(UINTN size)
+{
+	INTN ret;
+
+	ret = host_syscall(SYS_mmap, 0, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	/* errors come back as -4095..-1 */
+	if ((UINTN)ret > (UINTN)-4096)
+		return NULL;
+	return (VOID *)ret;
+}
+
+VOID host_unmap(VOID *addr, UINTN size)
+{
+	host_syscall(SYS_munmap, (INTN)addr, size, 0, 0, 0, 0);
+}
+
+UINT64 host_now_ns(void)
+{
+	struct host_timespec ts;
+
+	host_syscall(SYS_clock_gettime, CLOCK_MONOTONIC, (INTN)&ts,
+		     0, 0, 0, 0);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Seconds since the epoch
+ */
+UINT64 host_wall_clock(void)
+{
+	struct host_timespec ts;
+
+	host_syscall(SYS_clock_gettime, CLOCK_REALTIME, (INTN)&ts,
+		     0, 0, 0, 0);
+	return ts.tv_sec;
+}
+
+VOID host_exit(INTN status)
+{
+	for (;;)
+		host_syscall(SYS_exit_group, status, 0, 0, 0, 0, 0);
+}
+
+/*
+ * The kernel starts us with argc at the top of the stack and argv just
+ * above it, and nothing else set up.
+ */
+void host_start(INTN argc, CHAR8 **argv) __attribute__((__used__));
+
+void host_start(INTN argc, CHAR8 **argv)
+{
+	host_exit(bench_main(argc, argv));
+}
+
+__asm__(".text\n"
+	".globl _start\n"
+	".type _start, @function\n"
+	"_start:\n"
+	"	xor %rbp, %rbp\n"
+	"	mov (%rsp), %rdi\n"
+	"	lea 8(%rsp), %rsi\n"
+	"	and $-16, %rsp\n"
+	"	call host_start\n"
+	"	hlt\n");
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,27 @@
+#ifndef SHIM_TEST_HOST_H
+#define SHIM_TEST_HOST_H
+
+/*
+ * The little the harness needs from the Linux host it runs on.  These
+ * are raw system calls rather than the C library, since Cryptlib brings
+ * its own malloc(), printf(), read() and the rest, and the two can't be
+ * linked together.
+ */
+extern INTN host_open(CHAR8 *path);
+extern INTN host_close(INTN fd);
+extern INTN host_pread(INTN fd, VOID *buf, UINTN size, UINT64 offset);
+extern INTN host_write(INTN fd, VOID *buf, UINTN size);
+extern INTN host_file_size(INTN fd, UINT64 *size);
+extern VOID *host_map(UINTN size);
+extern VOID host_unmap(VOID *addr, UINTN size);
+extern UINT64 host_now_ns(void);
+extern UINT64 host_wall_clock(void);
+extern VOID host_exit(INTN status) __attribute__((__noreturn__));
+
+/*
+ * What runs once the process has started; argv is as the kernel passed
+ * it.
+ */
+extern INTN bench_main(INTN argc, CHAR8 **argv);
+
+#endif /* SHIM_TEST_HOST_H */
@@ -0,0 +1,342 @@
+/*
+ * mock-sfs.c - a read-only SimpleFileSystem over a host directory
+ *
+ * "\EFI\BOOT\foo.efi" on the volume is <root>/EFI/BOOT/foo.efi on the
+ * host.  Reads go straight to pread(), and are counted.  The files are
+ * revision 2, so they have ReadEx(), but nothing happens in the
+ * background here; a read is done before ReadEx() returns, and its
+ * event signalled.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "compiler.h"
+#include "guid.h"
+
+#include "host.h"
+#include "mock.h"
+
+#define MOCK_PATH_MAX		1024
+
+struct mock_file {
+	EFI_FILE file;		/* must be first */
+	INTN fd;		/* -1 for the volume's root */
+	UINT64 position;
+	UINT64 size;
+	CHAR16 *name;
+};
+
+static CHAR8 *sfs_root;
+
+static EFI_FILE mock_file_template;
+
+static struct mock_file *new_file(INTN fd, UINT64 size, CHAR16 *name)
+{
+	struct mock_file *f;
+	UINTN namesize = (StrLen(name) + 1) * sizeof(CHAR16);
+
+	f = mock_alloc(sizeof(*f) + namesize);
+	if (!f)
+		return NULL;
+	ZeroMem(f, sizeof(*f));
+	CopyMem(&f->file, &mock_file_template, sizeof(f->file));
+	f->fd = fd;
+	f->size = size;
+	f->name = (CHAR16 *)(f + 1);
+	CopyMem(f->name, name, namesize);
+	return f;
+}
+
+/*
+ * Builds <root>/<name> with the backslashes turned around.  Names are
+ * taken to be ASCII; anything else is refused.
+ */
+static BOOLEAN host_path(CHAR16 *name, CHAR8 *path, UINTN size)
+{
+	UINTN n = 0;
+
+	while (sfs_root[n]) {
+		if (n == size - 1)
+			return FALSE;
+		path[n] = sfs_root[n];
+		n++;
+	}
+
+	while (*name == L'\\')
+		name++;
+	if (n + 1 >= size)
+		return FALSE;
+	path[n++] = '/';
+
+	for (; *name; name++) {
+		if (*name >= 0x80 || n == size - 1)
+			return FALSE;
+		path[n++] = *name == L'\\' ? '/' : *name;
+	}
+	path[n] = 0;
+	return TRUE;
+}
+
+static EFI_STATUS EFIAPI mock_file_open(EFI_FILE *this UNUSED,
+					EFI_FILE **new, CHAR16 *name,
+					UINT64 mode, UINT64 attributes UNUSED)
+{
+	CHAR8 path[MOCK_PATH_MAX];
+	struct mock_file *f;
+	UINT64 size;
+	INTN fd;
+
+	if (!new || !name)
+		return EFI_INVALID_PARAMETER;
+	if (mode != EFI_FILE_MODE_READ)
+		return EFI_WRITE_PROTECTED;
+	if (!host_path(name, path, sizeof(path)))
+		return EFI_NOT_FOUND;
+
+	fd = host_open(path);
+	if (fd < 0)
+		return EFI_NOT_FOUND;
+	if (host_file_size(fd, &size) < 0) {
+		host_close(fd);
+		return EFI_DEVICE_ERROR;
+	}
+
+	f = new_file(fd, size, name);
+	if (!f) {
+		host_close(fd);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	*new = &f->file;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_close(EFI_FILE *this)
+{
+	struct mock_file *f = (struct mock_file *)this;
+
+	if (f->fd >= 0)
+		host_close(f->fd);
+	mock_free(f);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_delete(EFI_FILE *this)
+{
+	mock_file_close(this);
+	return EFI_WARN_DELETE_FAILURE;
+}
+
+static EFI_STATUS EFIAPI mock_file_read(EFI_FILE *this, UINTN *size,
+					VOID *buffer)
+{
+	struct mock_file *f = (struct mock_file *)this;
+	UINTN done = 0;
+	INTN ret;
+
+	if (!size || (*size && !buffer))
+		return EFI_INVALID_PARAMETER;
+	if (f->fd < 0)
+		return EFI_UNSUPPORTED;
+	if (f->position > f->size)
+		return EFI_DEVICE_ERROR;
+
+	if (*size > f->size - f->position)
+		*size = f->size - f->position;
+
+	while (done < *size) {
+		ret = host_pread(f->fd, (UINT8 *)buffer + done, *size - done,
+				 f->position + done);
+		if (ret <= 0)
+			return EFI_DEVICE_ERROR;
+		done += ret;
+	}
+
+	mock_stats.file_reads++;
+	mock_stats.file_bytes += done;
+	f->position += done;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_read_ex(EFI_FILE *this,
+					   EFI_FILE_IO_TOKEN *token)
+{
+	EFI_STATUS efi_status;
+
+	if (!token)
+		return EFI_INVALID_PARAMETER;
+
+	efi_status = mock_file_read(this, &token->BufferSize, token->Buffer);
+	if (efi_status == EFI_INVALID_PARAMETER)
+		return efi_status;
+
+	token->Status = efi_status;
+	if (token->Event)
+		gBS->SignalEvent(token->Event);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_open_ex(EFI_FILE *this, EFI_FILE **new,
+					   CHAR16 *name, UINT64 mode,
+					   UINT64 attributes,
+					   EFI_FILE_IO_TOKEN *token)
+{
+	EFI_STATUS efi_status;
+
+	if (!token)
+		return EFI_INVALID_PARAMETER;
+
+	efi_status = mock_file_open(this, new, name, mode, attributes);
+	token->Status = efi_status;
+	if (token->Event)
+		gBS->SignalEvent(token->Event);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_write_ex(EFI_FILE *this UNUSED,
+					    EFI_FILE_IO_TOKEN *token UNUSED)
+{
+	return EFI_WRITE_PROTECTED;
+}
+
+static EFI_STATUS EFIAPI mock_file_flush_ex(EFI_FILE *this UNUSED,
+					    EFI_FILE_IO_TOKEN *token)
+{
+	if (!token)
+		return EFI_INVALID_PARAMETER;
+
+	token->Status = EFI_SUCCESS;
+	if (token->Event)
+		gBS->SignalEvent(token->Event);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_write(EFI_FILE *this UNUSED,
+					 UINTN *size UNUSED,
+					 VOID *buffer UNUSED)
+{
+	return EFI_WRITE_PROTECTED;
+}
+
+static EFI_STATUS EFIAPI mock_file_get_position(EFI_FILE *this,
+						UINT64 *position)
+{
+	struct mock_file *f = (struct mock_file *)this;
+
+	if (!position)
+		return EFI_INVALID_PARAMETER;
+	if (f->fd < 0)
+		return EFI_UNSUPPORTED;
+	*position = f->position;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_set_position(EFI_FILE *this,
+						UINT64 position)
+{
+	struct mock_file *f = (struct mock_file *)this;
+
+	if (f->fd < 0)
+		return position ? EFI_UNSUPPORTED : EFI_SUCCESS;
+	/* all ones means the end of the file */
+	f->position = position == ~0ULL ? f->size : position;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_get_info(EFI_FILE *this, EFI_GUID *type,
+					    UINTN *size, VOID *buffer)
+{
+	struct mock_file *f = (struct mock_file *)this;
+	EFI_FILE_INFO *info = buffer;
+	UINTN namesize = (StrLen(f->name) + 1) * sizeof(CHAR16);
+	UINTN needed = SIZE_OF_EFI_FILE_INFO + namesize;
+
+	if (!type || !size)
+		return EFI_INVALID_PARAMETER;
+	if (CompareMem(type, &EFI_FILE_INFO_GUID, sizeof(*type)))
+		return EFI_UNSUPPORTED;
+
+	if (*size < needed) {
+		*size = needed;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	if (!buffer)
+		return EFI_INVALID_PARAMETER;
+
+	ZeroMem(info, needed);
+	info->Size = needed;
+	info->FileSize = f->size;
+	info->PhysicalSize = f->size;
+	info->Attribute = EFI_FILE_READ_ONLY;
+	if (f->fd < 0)
+		info->Attribute |= EFI_FILE_DIRECTORY;
+	CopyMem(info->FileName, f->name, namesize);
+	*size = needed;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_set_info(EFI_FILE *this UNUSED,
+					    EFI_GUID *type UNUSED,
+					    UINTN size UNUSED,
+					    VOID *buffer UNUSED)
+{
+	return EFI_WRITE_PROTECTED;
+}
+
+static EFI_STATUS EFIAPI mock_file_flush(EFI_FILE *this UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_FILE mock_file_template = {
+	.Revision = EFI_FILE_PROTOCOL_REVISION2,
+	.Open = mock_file_open,
+	.Close = mock_file_close,
+	.Delete = mock_file_delete,
+	.Read = mock_file_read,
+	.Write = mock_file_write,
+	.GetPosition = mock_file_get_position,
+	.SetPosition = mock_file_set_position,
+	.GetInfo = mock_file_get_info,
+	.SetInfo = mock_file_set_info,
+	.Flush = mock_file_flush,
+	.OpenEx = mock_file_open_ex,
+	.ReadEx = mock_file_read_ex,
+	.WriteEx = mock_file_write_ex,
+	.FlushEx = mock_file_flush_ex,
+};
+
+static EFI_STATUS EFIAPI mock_open_volume(EFI_FILE_IO_INTERFACE *this UNUSED,
+					  EFI_FILE_HANDLE *root)
+{
+	struct mock_file *f;
+
+	if (!root)
+		return EFI_INVALID_PARAMETER;
+
+	f = new_file(-1, 0, L"");
+	if (!f)
+		return EFI_OUT_OF_RESOURCES;
+	*root = &f->file;
+	return EFI_SUCCESS;
+}
+
+static EFI_FILE_IO_INTERFACE mock_sfs = {
+	.Revision = EFI_FILE_IO_INTERFACE_REVISION,
+	.OpenVolume = mock_open_volume,
+};
+
+/*
+ * Puts the file system on a new handle, which is returned in *device for
+ * use as a loaded image's DeviceHandle.
+ */
+EFI_STATUS mock_sfs_install(CHAR8 *root, EFI_HANDLE *device)
+{
+	sfs_root = root;
+	*device = NULL;
+	return mock_install_protocol(device, &EFI_SIMPLE_FILE_SYSTEM_GUID,
+				     &mock_sfs);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,208 @@
+/*
+ * mock-tpm.c - TPMs that measure nothing
+ *
+ * Either a TPM 1.2, behind the TCG protocol, or a TPM 2.0 with a SHA-256
+ * bank and a TCG 2.0 event log, behind TCG2.  shim sees a present TPM
+ * and takes its usual measurement paths for that kind; the events are
+ * only counted.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "compiler.h"
+#include "guid.h"
+#include "tpm.h"
+
+#include "mock.h"
+
+#define EFI_TCG2_BOOT_HASH_ALG_SHA256	0x00000002
+
+static EFI_STATUS EFIAPI mock_status_check(efi_tpm_protocol_t *this UNUSED,
+					   TCG_EFI_BOOT_SERVICE_CAPABILITY *caps,
+					   uint32_t *features,
+					   EFI_PHYSICAL_ADDRESS *log,
+					   EFI_PHYSICAL_ADDRESS *last)
+{
+	if (!caps || caps->Size < sizeof(*caps))
+		return EFI_INVALID_PARAMETER;
+
+	ZeroMem(caps, sizeof(*caps));
+	caps->Size = sizeof(*caps);
+	caps->StructureVersion.Major = 1;
+	caps->StructureVersion.Minor = 2;
+	caps->ProtocolSpecVersion.Major = 1;
+	caps->ProtocolSpecVersion.Minor = 2;
+	caps->HashAlgorithmBitmap = 1;		/* SHA-1 */
+	caps->TPMPresentFlag = 1;
+	if (features)
+		*features = 0;
+	if (log)
+		*log = 0;
+	if (last)
+		*last = 0;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_hash_all(efi_tpm_protocol_t *this UNUSED,
+				       uint8_t *data UNUSED,
+				       uint64_t len UNUSED,
+				       uint32_t alg UNUSED,
+				       uint64_t *hashed_len UNUSED,
+				       uint8_t **result UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_log_event(efi_tpm_protocol_t *this UNUSED,
+					TCG_PCR_EVENT *event UNUSED,
+					uint32_t *number UNUSED,
+					uint32_t flags UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_pass_through_to_tpm(efi_tpm_protocol_t *this UNUSED,
+						  uint32_t insize UNUSED,
+						  uint8_t *in UNUSED,
+						  uint32_t outsize UNUSED,
+						  uint8_t *out UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+/*
+ * With no data, the digest in the event is what's extended; that's how
+ * shim measures images into a TPM 1.2.
+ */
+static EFI_STATUS EFIAPI mock_log_extend_event(efi_tpm_protocol_t *this UNUSED,
+					       EFI_PHYSICAL_ADDRESS data,
+					       uint64_t len,
+					       uint32_t alg UNUSED,
+					       TCG_PCR_EVENT *event,
+					       uint32_t *number,
+					       EFI_PHYSICAL_ADDRESS *last)
+{
+	if (!event || (!data && len))
+		return EFI_INVALID_PARAMETER;
+
+	mock_stats.tpm_events++;
+	mock_stats.tpm_bytes += len;
+	if (number)
+		*number = mock_stats.tpm_events;
+	if (last)
+		*last = 0;
+	return EFI_SUCCESS;
+}
+
+static efi_tpm_protocol_t mock_tcg = {
+	.status_check = mock_status_check,
+	.hash_all = mock_hash_all,
+	.log_event = mock_log_event,
+	.pass_through_to_tpm = mock_pass_through_to_tpm,
+	.log_extend_event = mock_log_extend_event,
+};
+
+EFI_STATUS mock_tcg_install(void)
+{
+	EFI_HANDLE handle = NULL;
+
+	return mock_install_protocol(&handle, &EFI_TPM_GUID, &mock_tcg);
+}
+
+static EFI_STATUS EFIAPI mock_get_capability(efi_tpm2_protocol_t *this UNUSED,
+					     EFI_TCG2_BOOT_SERVICE_CAPABILITY *caps)
+{
+	if (!caps || caps->Size < sizeof(*caps))
+		return EFI_INVALID_PARAMETER;
+
+	ZeroMem(caps, sizeof(*caps));
+	caps->Size = sizeof(*caps);
+	caps->StructureVersion.Major = 1;
+	caps->StructureVersion.Minor = 1;
+	caps->ProtocolVersion.Major = 1;
+	caps->ProtocolVersion.Minor = 1;
+	caps->HashAlgorithmBitmap = EFI_TCG2_BOOT_HASH_ALG_SHA256;
+	caps->SupportedEventLogs = EFI_TCG2_EVENT_LOG_FORMAT_TCG_2;
+	caps->TPMPresentFlag = TRUE;
+	caps->MaxCommandSize = 4096;
+	caps->MaxResponseSize = 4096;
+	caps->NumberOfPcrBanks = 1;
+	caps->ActivePcrBanks = EFI_TCG2_BOOT_HASH_ALG_SHA256;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_get_event_log(efi_tpm2_protocol_t *this UNUSED,
+					    EFI_TCG2_EVENT_LOG_FORMAT format UNUSED,
+					    EFI_PHYSICAL_ADDRESS *location UNUSED,
+					    EFI_PHYSICAL_ADDRESS *last UNUSED,
+					    BOOLEAN *truncated UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_hash_log_extend_event(efi_tpm2_protocol_t *this UNUSED,
+						    uint64_t flags UNUSED,
+						    EFI_PHYSICAL_ADDRESS data,
+						    uint64_t len,
+						    EFI_TCG2_EVENT *event)
+{
+	if (!event || (!data && len))
+		return EFI_INVALID_PARAMETER;
+	if (event->Size < event->Header.HeaderSize + sizeof(event->Size))
+		return EFI_INVALID_PARAMETER;
+
+	mock_stats.tpm_events++;
+	mock_stats.tpm_bytes += len;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_submit_command(efi_tpm2_protocol_t *this UNUSED,
+					     uint32_t insize UNUSED,
+					     uint8_t *in UNUSED,
+					     uint32_t outsize UNUSED,
+					     uint8_t *out UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_get_active_pcr_banks(efi_tpm2_protocol_t *this UNUSED,
+						   uint32_t *banks)
+{
+	if (!banks)
+		return EFI_INVALID_PARAMETER;
+	*banks = EFI_TCG2_BOOT_HASH_ALG_SHA256;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_active_pcr_banks(efi_tpm2_protocol_t *this UNUSED,
+						   uint32_t banks UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_get_result_of_set_active_pcr_banks(efi_tpm2_protocol_t *this UNUSED,
+								 uint32_t *present UNUSED,
+								 uint32_t *response UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static efi_tpm2_protocol_t mock_tcg2 = {
+	.get_capability = mock_get_capability,
+	.get_event_log = mock_get_event_log,
+	.hash_log_extend_event = mock_hash_log_extend_event,
+	.submit_command = mock_submit_command,
+	.get_active_pcr_blanks = mock_get_active_pcr_banks,
+	.set_active_pcr_banks = mock_set_active_pcr_banks,
+	.get_result_of_set_active_pcr_banks = mock_get_result_of_set_active_pcr_banks,
+};
+
+EFI_STATUS mock_tcg2_install(void)
+{
+	EFI_HANDLE handle = NULL;
+
+	return mock_install_protocol(&handle, &EFI_TPM2_GUID, &mock_tcg2);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,249 @@
+/*
+ * mock-variables.c - an in-memory UEFI variable store
+ *
+ * Variables live in a list in firmware memory.  The store enforces the
+ * size limits QueryVariableInfo() reports, so shim's handling of a full
+ * store can be exercised too; mock_preload_variable() doesn't, so that
+ * a corpus bigger than a variable can still be set up.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "compiler.h"
+#include "host.h"
+#include "mock.h"
+
+#define MOCK_MAX_VARIABLE_SIZE	(64 * 1024)
+#define MOCK_MAX_STORAGE_SIZE	(4 * 1024 * 1024)
+
+#define MOCK_ATTRS		(EFI_VARIABLE_NON_VOLATILE |		\
+				 EFI_VARIABLE_BOOTSERVICE_ACCESS |	\
+				 EFI_VARIABLE_RUNTIME_ACCESS |		\
+				 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS | \
+				 EFI_VARIABLE_APPEND_WRITE)
+
+struct mock_variable {
+	struct mock_variable *next;
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINT32 attrs;
+	UINTN size;
+	UINT8 *data;
+};
+
+static struct mock_variable *variables;
+static UINTN storage_used;
+
+static UINTN name_size(CHAR16 *name)
+{
+	return (StrLen(name) + 1) * sizeof(CHAR16);
+}
+
+static struct mock_variable *find_variable(CHAR16 *name, EFI_GUID *guid,
+					   struct mock_variable ***prev)
+{
+	struct mock_variable **v;
+
+	for (v = &variables; *v; v = &(*v)->next) {
+		if (StrCmp((*v)->name, name) == 0 &&
+		    !CompareMem(&(*v)->guid, guid, sizeof(*guid))) {
+			if (prev)
+				*prev = v;
+			return *v;
+		}
+	}
+	return NULL;
+}
+
+static void delete_variable(struct mock_variable **prev)
+{
+	struct mock_variable *v = *prev;
+
+	*prev = v->next;
+	storage_used -= name_size(v->name) + v->size;
+	if (v->data)
+		mock_free(v->data);
+	mock_free(v->name);
+	mock_free(v);
+}
+
+/*
+ * Replace (or with append, extend) the variable's data, creating it if
+ * it doesn't exist yet.
+ */
+static EFI_STATUS store_variable(CHAR16 *name, EFI_GUID *guid, UINT32 attrs,
+				 UINTN size, VOID *data, BOOLEAN append)
+{
+	struct mock_variable *v;
+	UINT8 *new_data = NULL;
+	UINTN old_size = 0;
+
+	v = find_variable(name, guid, NULL);
+	if (v && append)
+		old_size = v->size;
+
+	if (old_size + size) {
+		new_data = mock_alloc(old_size + size);
+		if (!new_data)
+			return EFI_OUT_OF_RESOURCES;
+		if (old_size)
+			CopyMem(new_data, v->data, old_size);
+		CopyMem(new_data + old_size, data, size);
+	}
+
+	if (!v) {
+		v = mock_alloc(sizeof(*v));
+		if (!v)
+			goto err;
+		ZeroMem(v, sizeof(*v));
+		v->name = mock_alloc(name_size(name));
+		if (!v->name) {
+			mock_free(v);
+			goto err;
+		}
+		CopyMem(v->name, name, name_size(name));
+		CopyMem(&v->guid, guid, sizeof(*guid));
+		v->next = variables;
+		variables = v;
+		storage_used += name_size(name);
+	}
+
+	if (v->data)
+		mock_free(v->data);
+	storage_used += old_size + size - v->size;
+	v->data = new_data;
+	v->size = old_size + size;
+	v->attrs = attrs;
+	return EFI_SUCCESS;
+
+err:
+	if (new_data)
+		mock_free(new_data);
+	return EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS mock_preload_variable(CHAR16 *name, EFI_GUID *guid, UINT32 attrs,
+				 UINTN size, VOID *data)
+{
+	return store_variable(name, guid, attrs, size, data, FALSE);
+}
+
+EFI_STATUS EFIAPI mock_get_variable(CHAR16 *name, EFI_GUID *guid,
+				    UINT32 *attrs, UINTN *size, VOID *data)
+{
+	struct mock_variable *v;
+
+	if (!name || !guid || !size)
+		return EFI_INVALID_PARAMETER;
+
+	v = find_variable(name, guid, NULL);
+	if (!v)
+		return EFI_NOT_FOUND;
+
+	if (*size < v->size) {
+		*size = v->size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	if (!data && v->size)
+		return EFI_INVALID_PARAMETER;
+
+	if (v->size)
+		CopyMem(data, v->data, v->size);
+	*size = v->size;
+	if (attrs)
+		*attrs = v->attrs;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI mock_get_next_variable_name(UINTN *size, CHAR16 *name,
+					      EFI_GUID *guid)
+{
+	struct mock_variable *v;
+	UINTN needed;
+
+	if (!size || !name || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	if (name[0] == 0) {
+		v = variables;
+	} else {
+		v = find_variable(name, guid, NULL);
+		if (!v)
+			return EFI_INVALID_PARAMETER;
+		v = v->next;
+	}
+	if (!v)
+		return EFI_NOT_FOUND;
+
+	needed = name_size(v->name);
+	if (*size < needed) {
+		*size = needed;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	CopyMem(name, v->name, needed);
+	CopyMem(guid, &v->guid, sizeof(*guid));
+	*size = needed;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI mock_set_variable(CHAR16 *name, EFI_GUID *guid,
+				    UINT32 attrs, UINTN size, VOID *data)
+{
+	struct mock_variable *v, **prev = NULL;
+	BOOLEAN append = !!(attrs & EFI_VARIABLE_APPEND_WRITE);
+	UINTN grow;
+
+	if (!name || !name[0] || !guid || (size && !data))
+		return EFI_INVALID_PARAMETER;
+	if (attrs & ~MOCK_ATTRS)
+		return EFI_UNSUPPORTED;
+	if ((attrs & EFI_VARIABLE_RUNTIME_ACCESS) &&
+	    !(attrs & EFI_VARIABLE_BOOTSERVICE_ACCESS))
+		return EFI_INVALID_PARAMETER;
+
+	v = find_variable(name, guid, &prev);
+
+	/* no data, or no access, means delete */
+	if (!(attrs & ~EFI_VARIABLE_APPEND_WRITE) || (size == 0 && !append)) {
+		if (!v)
+			return EFI_NOT_FOUND;
+		delete_variable(prev);
+		return EFI_SUCCESS;
+	}
+
+	attrs &= ~EFI_VARIABLE_APPEND_WRITE;
+	if (v && v->attrs != attrs)
+		return EFI_INVALID_PARAMETER;
+	if (append && size == 0)
+		return EFI_SUCCESS;
+
+	grow = size + (append && v ? v->size : 0);
+	if (grow > MOCK_MAX_VARIABLE_SIZE)
+		return EFI_OUT_OF_RESOURCES;
+	if (!v)
+		grow += name_size(name);
+	else if (!append)
+		grow -= v->size < grow ? v->size : grow;
+	if (storage_used + grow > MOCK_MAX_STORAGE_SIZE)
+		return EFI_OUT_OF_RESOURCES;
+
+	return store_variable(name, guid, attrs, size, data, append);
+}
+
+EFI_STATUS EFIAPI mock_query_variable_info(UINT32 attrs UNUSED,
+					   UINT64 *max_storage,
+					   UINT64 *remaining,
+					   UINT64 *max_size)
+{
+	if (!max_storage || !remaining || !max_size)
+		return EFI_INVALID_PARAMETER;
+
+	*max_storage = MOCK_MAX_STORAGE_SIZE;
+	*remaining = storage_used < MOCK_MAX_STORAGE_SIZE ?
+		     MOCK_MAX_STORAGE_SIZE - storage_used : 0;
+	*max_size = MOCK_MAX_VARIABLE_SIZE;
+	return EFI_SUCCESS;
+}
+
+// vim:fenc=utf-8:tw=75:noet
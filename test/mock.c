@@ -0,0 +1,1127 @@
+/*
+ * mock.c - a system table for running shim's code as a Linux process
+ *
+ * The boot services keep a small protocol database and hand out memory
+ * from the host, counting it as they go.  Anything shim shouldn't be
+ * doing under the harness (starting images, exiting boot services)
+ * fails with EFI_UNSUPPORTED.  See test/mock.h.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "compiler.h"
+#include "host.h"
+#include "mock.h"
+
+/* UEFI 2.70 */
+#define MOCK_UEFI_REVISION	((2 << 16) | 70)
+
+#define MOCK_HANDLES		32
+#define MOCK_PROTOCOLS		8
+#define MOCK_CONFIG_TABLES	16
+
+#define PAGE_ROUND(x)		(((x) + EFI_PAGE_SIZE - 1) & ~(EFI_PAGE_SIZE - 1))
+
+struct mock_stats mock_stats;
+
+static void count_alloc(UINTN size)
+{
+	mock_stats.allocs++;
+	mock_stats.live += size;
+	if (mock_stats.live > mock_stats.peak)
+		mock_stats.peak = mock_stats.live;
+}
+
+static void count_free(UINTN size)
+{
+	mock_stats.frees++;
+	mock_stats.live -= size;
+}
+
+/*
+ * Start counting again from here.  What's already allocated stays
+ * allocated, so peak starts out as live.
+ */
+void mock_stats_reset(void)
+{
+	UINTN live = mock_stats.live;
+
+	ZeroMem(&mock_stats, sizeof(mock_stats));
+	mock_stats.live = live;
+	mock_stats.peak = live;
+}
+
+/*
+ * Pool memory comes in power of two classes carved out of big chunks
+ * mapped from the host, so an allocation costs about what it would in
+ * firmware rather than a system call.  Anything bigger than the largest
+ * class is mapped on its own.
+ */
+#define POOL_MIN_SHIFT		5
+#define POOL_MAX_SHIFT		20
+#define POOL_CHUNK_SIZE		(16UL << 20)
+
+struct pool_header {
+	UINTN size;		/* as asked for */
+	UINTN shift;		/* its class, or 0 if it's mapped on its own */
+};
+
+static VOID *pool_free_lists[POOL_MAX_SHIFT + 1];
+static UINT8 *pool_chunk;
+static UINTN pool_chunk_left;
+
+VOID *mock_alloc(UINTN size)
+{
+	struct pool_header *hdr;
+	UINTN total = size + sizeof(*hdr);
+	UINTN shift = POOL_MIN_SHIFT;
+
+	if (total < size)
+		return NULL;
+
+	if (total > (1UL << POOL_MAX_SHIFT)) {
+		hdr = host_map(PAGE_ROUND(total));
+		if (!hdr)
+			return NULL;
+		hdr->shift = 0;
+	} else {
+		while ((1UL << shift) < total)
+			shift++;
+
+		if (pool_free_lists[shift]) {
+			hdr = pool_free_lists[shift];
+			pool_free_lists[shift] = *(VOID **)hdr;
+		} else {
+			if (pool_chunk_left < (1UL << shift)) {
+				pool_chunk = host_map(POOL_CHUNK_SIZE);
+				if (!pool_chunk) {
+					pool_chunk_left = 0;
+					return NULL;
+				}
+				pool_chunk_left = POOL_CHUNK_SIZE;
+			}
+			hdr = (struct pool_header *)pool_chunk;
+			pool_chunk += 1UL << shift;
+			pool_chunk_left -= 1UL << shift;
+		}
+		hdr->shift = shift;
+	}
+
+	hdr->size = size;
+	return hdr + 1;
+}
+
+void mock_free(VOID *buffer)
+{
+	struct pool_header *hdr = (struct pool_header *)buffer - 1;
+	UINTN shift = hdr->shift;
+
+	if (shift == 0) {
+		host_unmap(hdr, PAGE_ROUND(hdr->size + sizeof(*hdr)));
+		return;
+	}
+
+	*(VOID **)hdr = pool_free_lists[shift];
+	pool_free_lists[shift] = hdr;
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pool(EFI_MEMORY_TYPE type UNUSED,
+					    UINTN size, VOID **buffer)
+{
+	if (!buffer)
+		return EFI_INVALID_PARAMETER;
+
+	*buffer = mock_alloc(size);
+	if (!*buffer)
+		return EFI_OUT_OF_RESOURCES;
+
+	count_alloc(size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_free_pool(VOID *buffer)
+{
+	if (!buffer)
+		return EFI_INVALID_PARAMETER;
+
+	count_free(((struct pool_header *)buffer - 1)->size);
+	mock_free(buffer);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pages(EFI_ALLOCATE_TYPE type,
+					     EFI_MEMORY_TYPE memtype UNUSED,
+					     UINTN pages,
+					     EFI_PHYSICAL_ADDRESS *memory)
+{
+	EFI_PHYSICAL_ADDRESS addr;
+	UINTN size = pages * EFI_PAGE_SIZE;
+
+	if (!memory || pages == 0 || size / EFI_PAGE_SIZE != pages)
+		return EFI_INVALID_PARAMETER;
+
+	/* we can't promise any particular address */
+	if (type == AllocateAddress)
+		return EFI_NOT_FOUND;
+
+	addr = (EFI_PHYSICAL_ADDRESS)(UINTN)host_map(size);
+	if (!addr)
+		return EFI_OUT_OF_RESOURCES;
+	if (type == AllocateMaxAddress && addr + size - 1 > *memory) {
+		host_unmap((VOID *)(UINTN)addr, size);
+		return EFI_NOT_FOUND;
+	}
+
+	*memory = addr;
+	count_alloc(size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_free_pages(EFI_PHYSICAL_ADDRESS memory,
+					 UINTN pages)
+{
+	if (!memory || memory & (EFI_PAGE_SIZE - 1))
+		return EFI_INVALID_PARAMETER;
+
+	host_unmap((VOID *)(UINTN)memory, pages * EFI_PAGE_SIZE);
+	count_free(pages * EFI_PAGE_SIZE);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_get_memory_map(UINTN *size UNUSED,
+					     EFI_MEMORY_DESCRIPTOR *map UNUSED,
+					     UINTN *key UNUSED,
+					     UINTN *descsize UNUSED,
+					     UINT32 *descver UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+/*
+ * Events.  Nothing else runs here, so a timer goes off as soon as it's
+ * set, and waiting for an event that hasn't been signalled would never
+ * end; that fails instead.
+ */
+struct mock_event {
+	UINT32 type;
+	EFI_EVENT_NOTIFY notify;
+	VOID *context;
+	BOOLEAN signaled;
+};
+
+static EFI_TPL current_tpl = TPL_APPLICATION;
+
+static EFI_TPL EFIAPI mock_raise_tpl(EFI_TPL tpl)
+{
+	EFI_TPL old = current_tpl;
+
+	current_tpl = tpl;
+	return old;
+}
+
+static VOID EFIAPI mock_restore_tpl(EFI_TPL tpl)
+{
+	current_tpl = tpl;
+}
+
+static EFI_STATUS EFIAPI mock_create_event(UINT32 type, EFI_TPL tpl UNUSED,
+					   EFI_EVENT_NOTIFY notify,
+					   VOID *context, EFI_EVENT *event)
+{
+	struct mock_event *ev;
+
+	if (!event)
+		return EFI_INVALID_PARAMETER;
+
+	ev = mock_alloc(sizeof(*ev));
+	if (!ev)
+		return EFI_OUT_OF_RESOURCES;
+	ZeroMem(ev, sizeof(*ev));
+	ev->type = type;
+	ev->notify = notify;
+	ev->context = context;
+
+	*event = ev;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_create_event_ex(UINT32 type, EFI_TPL tpl,
+					      EFI_EVENT_NOTIFY notify,
+					      const VOID *context,
+					      const EFI_GUID *group UNUSED,
+					      EFI_EVENT *event)
+{
+	return mock_create_event(type, tpl, notify, (VOID *)context, event);
+}
+
+static EFI_STATUS EFIAPI mock_signal_event(EFI_EVENT event)
+{
+	struct mock_event *ev = event;
+
+	if (!ev)
+		return EFI_INVALID_PARAMETER;
+
+	ev->signaled = TRUE;
+	if ((ev->type & EVT_NOTIFY_SIGNAL) && ev->notify)
+		ev->notify(ev, ev->context);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_timer(EFI_EVENT event,
+					EFI_TIMER_DELAY type,
+					UINT64 trigger UNUSED)
+{
+	if (!event)
+		return EFI_INVALID_PARAMETER;
+
+	if (type == TimerCancel)
+		return EFI_SUCCESS;
+	return mock_signal_event(event);
+}
+
+static EFI_STATUS EFIAPI mock_check_event(EFI_EVENT event)
+{
+	struct mock_event *ev = event;
+
+	if (!ev)
+		return EFI_INVALID_PARAMETER;
+
+	/* a wait event gets the chance to signal itself when checked */
+	if (!ev->signaled && (ev->type & EVT_NOTIFY_WAIT) && ev->notify)
+		ev->notify(ev, ev->context);
+	if (!ev->signaled)
+		return EFI_NOT_READY;
+	ev->signaled = FALSE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_wait_for_event(UINTN n, EFI_EVENT *events,
+					     UINTN *index)
+{
+	UINTN i;
+
+	if (!n || !events || !index)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < n; i++) {
+		if (mock_check_event(events[i]) == EFI_SUCCESS) {
+			*index = i;
+			return EFI_SUCCESS;
+		}
+	}
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_close_event(EFI_EVENT event)
+{
+	if (!event)
+		return EFI_INVALID_PARAMETER;
+
+	mock_free(event);
+	return EFI_SUCCESS;
+}
+
+/*
+ * The protocol database: a handle is a slot in handles[], with the
+ * protocols installed on it.
+ */
+struct mock_protocol {
+	EFI_GUID guid;
+	VOID *interface;
+};
+
+struct mock_handle {
+	BOOLEAN used;
+	UINTN count;
+	struct mock_protocol protocols[MOCK_PROTOCOLS];
+};
+
+static struct mock_handle handles[MOCK_HANDLES];
+
+static struct mock_handle *find_handle(EFI_HANDLE handle)
+{
+	struct mock_handle *h = handle;
+
+	if (h < handles || h >= handles + MOCK_HANDLES || !h->used)
+		return NULL;
+	return h;
+}
+
+static struct mock_protocol *find_protocol(struct mock_handle *h,
+					   EFI_GUID *guid)
+{
+	UINTN i;
+
+	for (i = 0; i < h->count; i++) {
+		if (!CompareMem(&h->protocols[i].guid, guid, sizeof(*guid)))
+			return &h->protocols[i];
+	}
+	return NULL;
+}
+
+EFI_STATUS mock_install_protocol(EFI_HANDLE *handle, EFI_GUID *guid,
+				 VOID *interface)
+{
+	struct mock_handle *h;
+	UINTN i;
+
+	if (!handle || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	if (*handle) {
+		h = find_handle(*handle);
+		if (!h)
+			return EFI_INVALID_PARAMETER;
+		if (find_protocol(h, guid))
+			return EFI_INVALID_PARAMETER;
+		if (h->count == MOCK_PROTOCOLS)
+			return EFI_OUT_OF_RESOURCES;
+	} else {
+		for (i = 0; i < MOCK_HANDLES && handles[i].used; i++)
+			;
+		if (i == MOCK_HANDLES)
+			return EFI_OUT_OF_RESOURCES;
+		h = &handles[i];
+		ZeroMem(h, sizeof(*h));
+		h->used = TRUE;
+	}
+
+	CopyMem(&h->protocols[h->count].guid, guid, sizeof(*guid));
+	h->protocols[h->count].interface = interface;
+	h->count++;
+
+	*handle = h;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_install_protocol_interface(EFI_HANDLE *handle,
+							 EFI_GUID *guid,
+							 EFI_INTERFACE_TYPE type,
+							 VOID *interface)
+{
+	if (type != EFI_NATIVE_INTERFACE)
+		return EFI_INVALID_PARAMETER;
+	return mock_install_protocol(handle, guid, interface);
+}
+
+static EFI_STATUS EFIAPI mock_reinstall_protocol_interface(EFI_HANDLE handle,
+							   EFI_GUID *guid,
+							   VOID *old,
+							   VOID *new)
+{
+	struct mock_handle *h = find_handle(handle);
+	struct mock_protocol *p;
+
+	if (!h || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	p = find_protocol(h, guid);
+	if (!p || p->interface != old)
+		return EFI_NOT_FOUND;
+	p->interface = new;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_uninstall_protocol_interface(EFI_HANDLE handle,
+							   EFI_GUID *guid,
+							   VOID *interface)
+{
+	struct mock_handle *h = find_handle(handle);
+	struct mock_protocol *p;
+
+	if (!h || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	p = find_protocol(h, guid);
+	if (!p || p->interface != interface)
+		return EFI_NOT_FOUND;
+
+	h->count--;
+	CopyMem(p, p + 1, (h->protocols + h->count - p) * sizeof(*p));
+	if (h->count == 0)
+		h->used = FALSE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_handle_protocol(EFI_HANDLE handle,
+					      EFI_GUID *guid,
+					      VOID **interface)
+{
+	struct mock_handle *h = find_handle(handle);
+	struct mock_protocol *p;
+
+	if (!h || !guid || !interface)
+		return EFI_INVALID_PARAMETER;
+
+	p = find_protocol(h, guid);
+	if (!p)
+		return EFI_UNSUPPORTED;
+	*interface = p->interface;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_open_protocol(EFI_HANDLE handle, EFI_GUID *guid,
+					    VOID **interface,
+					    EFI_HANDLE agent UNUSED,
+					    EFI_HANDLE controller UNUSED,
+					    UINT32 attributes)
+{
+	struct mock_handle *h = find_handle(handle);
+	struct mock_protocol *p;
+
+	if (!h || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	p = find_protocol(h, guid);
+	if (!p)
+		return EFI_UNSUPPORTED;
+	if (attributes & EFI_OPEN_PROTOCOL_TEST_PROTOCOL)
+		return EFI_SUCCESS;
+	if (!interface)
+		return EFI_INVALID_PARAMETER;
+	*interface = p->interface;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_close_protocol(EFI_HANDLE handle,
+					     EFI_GUID *guid,
+					     EFI_HANDLE agent UNUSED,
+					     EFI_HANDLE controller UNUSED)
+{
+	struct mock_handle *h = find_handle(handle);
+
+	if (!h || !guid)
+		return EFI_INVALID_PARAMETER;
+	if (!find_protocol(h, guid))
+		return EFI_NOT_FOUND;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_open_protocol_information(EFI_HANDLE handle UNUSED,
+							EFI_GUID *guid UNUSED,
+							EFI_OPEN_PROTOCOL_INFORMATION_ENTRY **entries UNUSED,
+							UINTN *count UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_protocols_per_handle(EFI_HANDLE handle UNUSED,
+						   EFI_GUID ***guids UNUSED,
+						   UINTN *count UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_register_protocol_notify(EFI_GUID *guid UNUSED,
+						       EFI_EVENT event UNUSED,
+						       VOID **registration UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+/*
+ * Fills in up to max of the handles that match, and returns how many
+ * there are altogether.
+ */
+static UINTN match_handles(EFI_LOCATE_SEARCH_TYPE type, EFI_GUID *guid,
+			   EFI_HANDLE *buffer, UINTN max)
+{
+	UINTN i, n = 0;
+
+	for (i = 0; i < MOCK_HANDLES; i++) {
+		if (!handles[i].used)
+			continue;
+		if (type == ByProtocol && !find_protocol(&handles[i], guid))
+			continue;
+		if (n < max)
+			buffer[n] = &handles[i];
+		n++;
+	}
+	return n;
+}
+
+static EFI_STATUS EFIAPI mock_locate_handle(EFI_LOCATE_SEARCH_TYPE type,
+					    EFI_GUID *guid,
+					    VOID *key UNUSED, UINTN *size,
+					    EFI_HANDLE *buffer)
+{
+	UINTN n;
+
+	if (type == ByRegisterNotify)
+		return EFI_UNSUPPORTED;
+	if (!size || (type == ByProtocol && !guid))
+		return EFI_INVALID_PARAMETER;
+
+	n = match_handles(type, guid, buffer,
+			  buffer ? *size / sizeof(EFI_HANDLE) : 0);
+	if (n == 0)
+		return EFI_NOT_FOUND;
+	if (*size < n * sizeof(EFI_HANDLE)) {
+		*size = n * sizeof(EFI_HANDLE);
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	*size = n * sizeof(EFI_HANDLE);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE type,
+						   EFI_GUID *guid,
+						   VOID *key UNUSED,
+						   UINTN *count,
+						   EFI_HANDLE **buffer)
+{
+	EFI_STATUS efi_status;
+	UINTN n;
+
+	if (type == ByRegisterNotify)
+		return EFI_UNSUPPORTED;
+	if (!count || !buffer || (type == ByProtocol && !guid))
+		return EFI_INVALID_PARAMETER;
+
+	n = match_handles(type, guid, NULL, 0);
+	if (n == 0)
+		return EFI_NOT_FOUND;
+
+	/* the caller frees this, so it's theirs to count */
+	efi_status = mock_allocate_pool(EfiBootServicesData,
+					n * sizeof(EFI_HANDLE),
+					(VOID **)buffer);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	*count = match_handles(type, guid, *buffer, n);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_locate_protocol(EFI_GUID *guid,
+					      VOID *registration UNUSED,
+					      VOID **interface)
+{
+	struct mock_protocol *p;
+	UINTN i;
+
+	if (!guid || !interface)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < MOCK_HANDLES; i++) {
+		if (!handles[i].used)
+			continue;
+		p = find_protocol(&handles[i], guid);
+		if (p) {
+			*interface = p->interface;
+			return EFI_SUCCESS;
+		}
+	}
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_locate_device_path(EFI_GUID *guid UNUSED,
+						 EFI_DEVICE_PATH **path UNUSED,
+						 EFI_HANDLE *device UNUSED)
+{
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_install_multiple(EFI_HANDLE *handle UNUSED, ...)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_uninstall_multiple(EFI_HANDLE handle UNUSED, ...)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_CONFIGURATION_TABLE config_tables[MOCK_CONFIG_TABLES];
+static EFI_SYSTEM_TABLE system_table;
+
+static EFI_STATUS EFIAPI mock_install_configuration_table(EFI_GUID *guid,
+							  VOID *table)
+{
+	UINTN i, n = system_table.NumberOfTableEntries;
+
+	if (!guid)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < n; i++) {
+		if (!CompareMem(&config_tables[i].VendorGuid, guid,
+				sizeof(*guid)))
+			break;
+	}
+
+	if (!table) {
+		if (i == n)
+			return EFI_NOT_FOUND;
+		CopyMem(&config_tables[i], &config_tables[i + 1],
+			(n - i - 1) * sizeof(config_tables[0]));
+		system_table.NumberOfTableEntries--;
+		return EFI_SUCCESS;
+	}
+
+	if (i == n) {
+		if (n == MOCK_CONFIG_TABLES)
+			return EFI_OUT_OF_RESOURCES;
+		CopyMem(&config_tables[i].VendorGuid, guid, sizeof(*guid));
+		system_table.NumberOfTableEntries++;
+	}
+	config_tables[i].VendorTable = table;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Images are never started under the harness
+ */
+static EFI_STATUS EFIAPI mock_load_image(BOOLEAN policy UNUSED,
+					 EFI_HANDLE parent UNUSED,
+					 EFI_DEVICE_PATH *path UNUSED,
+					 VOID *buffer UNUSED, UINTN size UNUSED,
+					 EFI_HANDLE *image UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_start_image(EFI_HANDLE image UNUSED,
+					  UINTN *size UNUSED,
+					  CHAR16 **data UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_exit(EFI_HANDLE image UNUSED,
+				   EFI_STATUS status UNUSED,
+				   UINTN size UNUSED, CHAR16 *data UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_unload_image(EFI_HANDLE image UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_exit_boot_services(EFI_HANDLE image UNUSED,
+						 UINTN key UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_connect_controller(EFI_HANDLE controller UNUSED,
+						 EFI_HANDLE *driver UNUSED,
+						 EFI_DEVICE_PATH *path UNUSED,
+						 BOOLEAN recursive UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_disconnect_controller(EFI_HANDLE controller UNUSED,
+						    EFI_HANDLE driver UNUSED,
+						    EFI_HANDLE child UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_get_next_monotonic_count(UINT64 *count)
+{
+	static UINT64 monotonic;
+
+	if (!count)
+		return EFI_INVALID_PARAMETER;
+	*count = monotonic++;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Nobody's waiting for us, so there's no need to wait for them
+ */
+static EFI_STATUS EFIAPI mock_stall(UINTN usecs UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_watchdog_timer(UINTN timeout UNUSED,
+						 UINT64 code UNUSED,
+						 UINTN size UNUSED,
+						 CHAR16 *data UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_calculate_crc32(VOID *data, UINTN size,
+					      UINT32 *crc32)
+{
+	UINT8 *p = data;
+	UINT32 crc = 0xffffffff;
+	UINTN i, bit;
+
+	if (!data || !size || !crc32)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < size; i++) {
+		crc ^= p[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	*crc32 = ~crc;
+	return EFI_SUCCESS;
+}
+
+static VOID EFIAPI mock_copy_mem(VOID *dest, VOID *src, UINTN size)
+{
+	CopyMem(dest, src, size);
+}
+
+static VOID EFIAPI mock_set_mem(VOID *buffer, UINTN size, UINT8 value)
+{
+	SetMem(buffer, size, value);
+}
+
+static EFI_BOOT_SERVICES boot_services = {
+	.Hdr = {
+		.Signature = EFI_BOOT_SERVICES_SIGNATURE,
+		.Revision = MOCK_UEFI_REVISION,
+		.HeaderSize = sizeof(EFI_BOOT_SERVICES),
+	},
+	.RaiseTPL = mock_raise_tpl,
+	.RestoreTPL = mock_restore_tpl,
+	.AllocatePages = mock_allocate_pages,
+	.FreePages = mock_free_pages,
+	.GetMemoryMap = mock_get_memory_map,
+	.AllocatePool = mock_allocate_pool,
+	.FreePool = mock_free_pool,
+	.CreateEvent = mock_create_event,
+	.SetTimer = mock_set_timer,
+	.WaitForEvent = mock_wait_for_event,
+	.SignalEvent = mock_signal_event,
+	.CloseEvent = mock_close_event,
+	.CheckEvent = mock_check_event,
+	.InstallProtocolInterface = mock_install_protocol_interface,
+	.ReinstallProtocolInterface = mock_reinstall_protocol_interface,
+	.UninstallProtocolInterface = mock_uninstall_protocol_interface,
+	.HandleProtocol = mock_handle_protocol,
+	.RegisterProtocolNotify = mock_register_protocol_notify,
+	.LocateHandle = mock_locate_handle,
+	.LocateDevicePath = mock_locate_device_path,
+	.InstallConfigurationTable = mock_install_configuration_table,
+	.LoadImage = mock_load_image,
+	.StartImage = mock_start_image,
+	.Exit = mock_exit,
+	.UnloadImage = mock_unload_image,
+	.ExitBootServices = mock_exit_boot_services,
+	.GetNextMonotonicCount = mock_get_next_monotonic_count,
+	.Stall = mock_stall,
+	.SetWatchdogTimer = mock_set_watchdog_timer,
+	.ConnectController = mock_connect_controller,
+	.DisconnectController = mock_disconnect_controller,
+	.OpenProtocol = mock_open_protocol,
+	.CloseProtocol = mock_close_protocol,
+	.OpenProtocolInformation = mock_open_protocol_information,
+	.ProtocolsPerHandle = mock_protocols_per_handle,
+	.LocateHandleBuffer = mock_locate_handle_buffer,
+	.LocateProtocol = mock_locate_protocol,
+	.InstallMultipleProtocolInterfaces = mock_install_multiple,
+	.UninstallMultipleProtocolInterfaces = mock_uninstall_multiple,
+	.CalculateCrc32 = mock_calculate_crc32,
+	.CopyMem = mock_copy_mem,
+	.SetMem = mock_set_mem,
+	.CreateEventEx = mock_create_event_ex,
+};
+
+/*
+ * Runtime services; the variable store is in mock-variables.c
+ */
+static EFI_STATUS EFIAPI mock_get_time(EFI_TIME *time,
+				       EFI_TIME_CAPABILITIES *caps)
+{
+	UINT64 now = host_wall_clock();
+	UINT64 days = now / 86400, secs = now % 86400;
+	UINT64 era, doe, yoe, doy, mp, year, month, day;
+
+	if (!time)
+		return EFI_INVALID_PARAMETER;
+
+	/* days since 1970-01-01 to a date, by way of 0000-03-01 */
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = mp < 10 ? mp + 3 : mp - 9;
+	year = yoe + era * 400 + (month <= 2);
+
+	ZeroMem(time, sizeof(*time));
+	time->Year = year;
+	time->Month = month;
+	time->Day = day;
+	time->Hour = secs / 3600;
+	time->Minute = secs / 60 % 60;
+	time->Second = secs % 60;
+
+	if (caps) {
+		caps->Resolution = 1;
+		caps->Accuracy = 50000000;
+		caps->SetsToZero = FALSE;
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_time(EFI_TIME *time UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_get_wakeup_time(BOOLEAN *enabled UNUSED,
+					      BOOLEAN *pending UNUSED,
+					      EFI_TIME *time UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_set_wakeup_time(BOOLEAN enable UNUSED,
+					      EFI_TIME *time UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_set_virtual_address_map(UINTN size UNUSED,
+						      UINTN descsize UNUSED,
+						      UINT32 descver UNUSED,
+						      EFI_MEMORY_DESCRIPTOR *map UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_convert_pointer(UINTN type UNUSED,
+					      VOID **address UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_get_next_high_monotonic_count(UINT32 *count UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+/*
+ * shim only resets when something has gone badly wrong, which under the
+ * harness means the run is over.
+ */
+static VOID EFIAPI mock_reset_system(EFI_RESET_TYPE type UNUSED,
+				     EFI_STATUS status,
+				     UINTN size UNUSED, CHAR16 *data UNUSED)
+{
+	mock_console_quiet(FALSE);
+	Print(L"ResetSystem() called: %r\n", status);
+	host_exit(2);
+}
+
+static EFI_STATUS EFIAPI mock_update_capsule(VOID **capsules UNUSED,
+					     UINTN count UNUSED,
+					     EFI_PHYSICAL_ADDRESS list UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_query_capsule_capabilities(VOID **capsules UNUSED,
+							 UINTN count UNUSED,
+							 UINT64 *max UNUSED,
+							 EFI_RESET_TYPE *type UNUSED)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_RUNTIME_SERVICES runtime_services = {
+	.Hdr = {
+		.Signature = EFI_RUNTIME_SERVICES_SIGNATURE,
+		.Revision = MOCK_UEFI_REVISION,
+		.HeaderSize = sizeof(EFI_RUNTIME_SERVICES),
+	},
+	.GetTime = mock_get_time,
+	.SetTime = mock_set_time,
+	.GetWakeupTime = mock_get_wakeup_time,
+	.SetWakeupTime = mock_set_wakeup_time,
+	.SetVirtualAddressMap = mock_set_virtual_address_map,
+	.ConvertPointer = mock_convert_pointer,
+	.GetVariable = mock_get_variable,
+	.GetNextVariableName = mock_get_next_variable_name,
+	.SetVariable = mock_set_variable,
+	.GetNextHighMonotonicCount = mock_get_next_high_monotonic_count,
+	.ResetSystem = mock_reset_system,
+	.UpdateCapsule = mock_update_capsule,
+	.QueryCapsuleCapabilities = mock_query_capsule_capabilities,
+	.QueryVariableInfo = mock_query_variable_info,
+};
+
+/*
+ * The console is the process's stdout, as UTF-8.  It's kept quiet while
+ * the benchmarks run, so that what shim prints doesn't get timed too.
+ */
+static BOOLEAN console_quiet;
+
+void mock_console_quiet(BOOLEAN quiet)
+{
+	console_quiet = quiet;
+}
+
+static EFI_STATUS EFIAPI mock_output_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+					    CHAR16 *str)
+{
+	CHAR8 buf[256];
+	UINTN n = 0;
+
+	if (console_quiet)
+		return EFI_SUCCESS;
+
+	for (; *str; str++) {
+		if (n > sizeof(buf) - 3) {
+			host_write(1, buf, n);
+			n = 0;
+		}
+		if (*str == L'\r') {
+			continue;
+		} else if (*str < 0x80) {
+			buf[n++] = *str;
+		} else if (*str < 0x800) {
+			buf[n++] = 0xc0 | (*str >> 6);
+			buf[n++] = 0x80 | (*str & 0x3f);
+		} else {
+			buf[n++] = 0xe0 | (*str >> 12);
+			buf[n++] = 0x80 | ((*str >> 6) & 0x3f);
+			buf[n++] = 0x80 | (*str & 0x3f);
+		}
+	}
+	if (n)
+		host_write(1, buf, n);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_output_reset(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+					   BOOLEAN extended UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_test_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+					  CHAR16 *str UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_query_mode(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+					 UINTN mode, UINTN *columns,
+					 UINTN *rows)
+{
+	if (mode != 0)
+		return EFI_UNSUPPORTED;
+	*columns = 80;
+	*rows = 25;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_mode(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+				       UINTN mode)
+{
+	return mode == 0 ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_set_attribute(SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+					    UINTN attribute)
+{
+	this->Mode->Attribute = attribute;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_clear_screen(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_set_cursor_position(SIMPLE_TEXT_OUTPUT_INTERFACE *this UNUSED,
+						  UINTN column UNUSED,
+						  UINTN row UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_enable_cursor(SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+					    BOOLEAN visible)
+{
+	this->Mode->CursorVisible = visible;
+	return EFI_SUCCESS;
+}
+
+static SIMPLE_TEXT_OUTPUT_MODE console_mode = {
+	.MaxMode = 1,
+	.Attribute = EFI_LIGHTGRAY,
+};
+
+static SIMPLE_TEXT_OUTPUT_INTERFACE console_out = {
+	.Reset = mock_output_reset,
+	.OutputString = mock_output_string,
+	.TestString = mock_test_string,
+	.QueryMode = mock_query_mode,
+	.SetMode = mock_set_mode,
+	.SetAttribute = mock_set_attribute,
+	.ClearScreen = mock_clear_screen,
+	.SetCursorPosition = mock_set_cursor_position,
+	.EnableCursor = mock_enable_cursor,
+	.Mode = &console_mode,
+};
+
+/*
+ * Whoever is at the keyboard presses Enter as soon as they're asked
+ * to, so an alert box shim puts up doesn't stop the run.
+ */
+static EFI_STATUS EFIAPI mock_input_reset(SIMPLE_INPUT_INTERFACE *this UNUSED,
+					  BOOLEAN extended UNUSED)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_read_key_stroke(SIMPLE_INPUT_INTERFACE *this UNUSED,
+					      EFI_INPUT_KEY *key)
+{
+	if (!key)
+		return EFI_INVALID_PARAMETER;
+
+	key->ScanCode = SCAN_NULL;
+	key->UnicodeChar = CHAR_CARRIAGE_RETURN;
+	return EFI_SUCCESS;
+}
+
+static VOID EFIAPI mock_wait_for_key(EFI_EVENT event, VOID *context UNUSED)
+{
+	mock_signal_event(event);
+}
+
+static SIMPLE_INPUT_INTERFACE console_in = {
+	.Reset = mock_input_reset,
+	.ReadKeyStroke = mock_read_key_stroke,
+};
+
+static EFI_SYSTEM_TABLE system_table = {
+	.Hdr = {
+		.Signature = EFI_SYSTEM_TABLE_SIGNATURE,
+		.Revision = MOCK_UEFI_REVISION,
+		.HeaderSize = sizeof(EFI_SYSTEM_TABLE),
+	},
+	.FirmwareVendor = L"shim test harness",
+	.ConIn = &console_in,
+	.ConOut = &console_out,
+	.StdErr = &console_out,
+	.RuntimeServices = &runtime_services,
+	.BootServices = &boot_services,
+	.ConfigurationTable = config_tables,
+};
+
+EFI_SYSTEM_TABLE *mock_init(void)
+{
+	if (!console_in.WaitForKey)
+		mock_create_event(EVT_NOTIFY_WAIT, TPL_NOTIFY,
+				  mock_wait_for_key, NULL,
+				  &console_in.WaitForKey);
+	return &system_table;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,67 @@
+#ifndef SHIM_TEST_MOCK_H
+#define SHIM_TEST_MOCK_H
+
+/*
+ * Just enough UEFI firmware to run shim's verification and loading code
+ * as a Linux process: a system table whose boot services keep a protocol
+ * database and hand out memory from the host, runtime services backed
+ * by an in-memory variable store, TPMs that only count what they're
+ * asked to measure, and a SimpleFileSystem over a host directory.
+ * See test/README.
+ */
+
+/*
+ * What the code under test has asked of the firmware since the last
+ * mock_stats_reset().  Memory is pool and pages together, counted in the
+ * bytes asked for.
+ */
+struct mock_stats {
+	UINTN allocs;
+	UINTN frees;
+	UINTN live;		/* bytes allocated and not yet freed */
+	UINTN peak;		/* the most live has been */
+	UINTN file_reads;
+	UINT64 file_bytes;
+	UINTN tpm_events;
+	UINT64 tpm_bytes;
+};
+
+extern struct mock_stats mock_stats;
+extern void mock_stats_reset(void);
+
+extern EFI_SYSTEM_TABLE *mock_init(void);
+extern void mock_console_quiet(BOOLEAN quiet);
+extern EFI_STATUS mock_install_protocol(EFI_HANDLE *handle, EFI_GUID *guid,
+					VOID *interface);
+
+/*
+ * Memory the firmware keeps for itself, which isn't counted
+ */
+extern VOID *mock_alloc(UINTN size);
+extern void mock_free(VOID *buffer);
+
+/* mock-variables.c */
+extern EFI_STATUS mock_preload_variable(CHAR16 *name, EFI_GUID *guid,
+					UINT32 attrs, UINTN size, VOID *data);
+extern EFI_STATUS EFIAPI mock_get_variable(CHAR16 *name, EFI_GUID *guid,
+					   UINT32 *attrs, UINTN *size,
+					   VOID *data);
+extern EFI_STATUS EFIAPI mock_get_next_variable_name(UINTN *size,
+						     CHAR16 *name,
+						     EFI_GUID *guid);
+extern EFI_STATUS EFIAPI mock_set_variable(CHAR16 *name, EFI_GUID *guid,
+					   UINT32 attrs, UINTN size,
+					   VOID *data);
+extern EFI_STATUS EFIAPI mock_query_variable_info(UINT32 attrs,
+						  UINT64 *max_storage,
+						  UINT64 *remaining,
+						  UINT64 *max_size);
+
+/* mock-tpm.c: a TPM 1.2 or a TPM 2.0 */
+extern EFI_STATUS mock_tcg_install(void);
+extern EFI_STATUS mock_tcg2_install(void);
+
+/* mock-sfs.c */
+extern EFI_STATUS mock_sfs_install(CHAR8 *root, EFI_HANDLE *device);
+
+#endif /* SHIM_TEST_MOCK_H */
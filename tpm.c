@@ -245,6 +245,24 @@ EFI_STATUS tpm_log_pe(EFI_PHYSICAL_ADDRESS buf, UINTN size,
 	return efi_status;
 }
 
+/*
+ * Whether tpm_log_pe() has to be given the whole PE file.  A TPM 2.0
+ * has the firmware hash the image itself; a TPM 1.2 only ever gets the
+ * Authenticode hash we computed.
+ */
+BOOLEAN tpm_log_pe_needs_file(void)
+{
+	efi_tpm_protocol_t *tpm;
+	efi_tpm2_protocol_t *tpm2;
+	EFI_STATUS efi_status;
+
+	efi_status = tpm_locate_protocol(&tpm, &tpm2, NULL, NULL);
+	if (EFI_ERROR(efi_status))
+		return efi_status != EFI_NOT_FOUND;
+
+	return tpm2 != NULL;
+}
+
 typedef struct {
 	EFI_GUID VariableName;
 	UINT64 UnicodeNameLength;
@@ -0,0 +1,111 @@
+/*
+ * verifycache.c - remember which images have already been verified
+ *
+ * grub hands the kernel, and anything else it loads, back to us through
+ * shim_verify(), and the same image can come by more than once; each
+ * time would otherwise pay for the PKCS7 parse and the RSA operations.
+ * Successful verifications are remembered here, keyed by a SHA-256 over
+ * the image's Authenticode SHA-256 and its certificate table, so a copy
+ * of an image carrying other signatures is always checked afresh.
+ *
+ * Only successes are kept: a failure may be down to something passing,
+ * like running out of memory, and mustn't stick.  Nothing here is shared
+ * with any other image; each shim starts with an empty cache, which it
+ * drops whenever one of the signature databases is reloaded.
+ *
+ * Each entry also remembers the certificate that authorized the image,
+ * so that a hit measures it into the TPM just as the full verification
+ * would have.
+ */
+
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+
+#define VERIFY_CACHE_ENTRIES	32
+
+struct verify_cache_entry {
+	UINT8 key[SHA256_DIGEST_SIZE];
+	verification_method_t method;
+	struct verify_authority authority;
+	BOOLEAN valid;
+};
+
+static struct verify_cache_entry entries[VERIFY_CACHE_ENTRIES];
+static UINTN next_entry;
+static UINTN cache_generation;
+
+/*
+ * Entries can point at certificates inside the signature databases, so
+ * they mustn't outlive the copies of the databases they were made with.
+ */
+static void
+check_generation(void)
+{
+	if (cache_generation == sigdb_generation)
+		return;
+
+	ZeroMem(entries, sizeof(entries));
+	next_entry = 0;
+	cache_generation = sigdb_generation;
+}
+
+BOOLEAN
+verify_cache_key(UINT8 *sha256hash, char *certs, UINTN certsize,
+		 UINT8 *key)
+{
+	void *ctx;
+	BOOLEAN ok;
+
+	ctx = AllocatePool(Sha256GetContextSize());
+	if (!ctx)
+		return FALSE;
+
+	ok = Sha256Init(ctx) &&
+	     Sha256Update(ctx, sha256hash, SHA256_DIGEST_SIZE) &&
+	     Sha256Update(ctx, certs, certsize) &&
+	     Sha256Final(ctx, key);
+	FreePool(ctx);
+	return ok;
+}
+
+BOOLEAN
+verify_cache_lookup(UINT8 *key, verification_method_t *method,
+		    struct verify_authority *authority)
+{
+	UINTN i;
+
+	check_generation();
+
+	for (i = 0; i < VERIFY_CACHE_ENTRIES; i++) {
+		struct verify_cache_entry *e = &entries[i];
+
+		if (!e->valid ||
+		    CompareMem(e->key, key, SHA256_DIGEST_SIZE) != 0)
+			continue;
+
+		*method = e->method;
+		CopyMem(authority, &e->authority, sizeof(*authority));
+		return TRUE;
+	}
+	return FALSE;
+}
+
+void
+verify_cache_record(UINT8 *key, verification_method_t method,
+		    struct verify_authority *authority)
+{
+	struct verify_cache_entry *e;
+
+	check_generation();
+
+	e = &entries[next_entry];
+	next_entry = (next_entry + 1) % VERIFY_CACHE_ENTRIES;
+
+	CopyMem(e->key, key, SHA256_DIGEST_SIZE);
+	e->method = method;
+	CopyMem(&e->authority, authority, sizeof(e->authority));
+	e->valid = TRUE;
+}
+
+// vim:fenc=utf-8:tw=75:noet